@@ -0,0 +1,186 @@
+#include "pathtracer.h"
+
+#include <cstdio>
+
+using namespace std;
+
+namespace CMU462 {
+
+  PathTracer* PathTracer::new_frame_tracer(
+      const std::map<const StaticScene::Mesh*, MeshBVH>& mesh_accels) {
+
+    PathTracer* tracer = new PathTracer(ns_aa, max_ray_depth, ns_area_light,
+        ns_diff, ns_glsy, ns_refr, numWorkerThreads, NULL, bvhWidth,
+        bvhRefitRatio, bvhCacheDir, samplesPerPass, adaptiveTolerance, "",
+        randomSeed, pixelSamplerName, lightSamplerName, wavefront,
+        rayPackets);
+
+    // the environment map is only read while rendering, so all frames share it
+    tracer->envLight = envLight;
+    tracer->imageTileSize = imageTileSize;
+    tracer->imageWriter = imageWriter;
+    tracer->meshAccels = mesh_accels;
+    return tracer;
+  }
+
+  void PathTracer::render_frames(size_t num_frames,
+                                 const std::function<Scene*(size_t)>& make_scene,
+                                 const std::string& prefix) {
+
+    if ((state != INIT && state != READY) || !camera ||
+        sampleBuffer.is_empty() || !num_frames) {
+      return;
+    }
+
+    frameTracers.reset(new std::atomic<PathTracer*>[num_frames]);
+    framesFinished.reset(new std::atomic<bool>[num_frames]);
+    for (size_t f = 0; f < num_frames; f++) {
+      frameTracers[f] = NULL;
+      framesFinished[f] = false;
+    }
+    workerFrames.reset(new std::atomic<size_t>[numWorkerThreads]);
+    for (size_t i = 0; i < numWorkerThreads; i++) workerFrames[i] = 0;
+    firstFrame = 0;
+    continueRaytracing = true;
+
+    fprintf(stdout, "[PathTracer] Rendering %zu frames on %zu threads...\n",
+            num_frames, numWorkerThreads);
+    Timer frames_timer;
+    frames_timer.start();
+    vector<std::thread> threads;
+    for (size_t i = 0; i < numWorkerThreads; i++) {
+      threads.push_back(std::thread(&PathTracer::frame_worker_thread, this, i,
+                                    num_frames, prefix));
+    }
+
+    // Set up the frames in order on this thread, as far ahead as allowed.
+    // The workers pick each one up as soon as it is published. Meshes that
+    // did not change keep their BVHs from the last frame, starting with the
+    // ones of the current scene. The top level is small and is rebuilt for
+    // every frame, as earlier frames may still be rendered with theirs.
+    size_t deleted = 0;  // frames before it have no tracer anymore
+    std::map<const StaticScene::Mesh*, MeshBVH> mesh_accels = meshAccels;
+    for (size_t f = 0; f < num_frames; f++) {
+      {
+        std::unique_lock<std::mutex> lock(frameMutex);
+        frameCond.wait(lock, [&] { return f < firstFrame + VIDEO_FRAMES_AHEAD; });
+      }
+
+      // Delete the tracers of finished frames that no worker looks at
+      // anymore, so that long animations do not keep all of them around.
+      size_t in_use = firstFrame;
+      for (size_t i = 0; i < numWorkerThreads; i++) {
+        in_use = min(in_use, workerFrames[i].load());
+      }
+      for (; deleted < in_use; deleted++) {
+        delete frameTracers[deleted].exchange(NULL);
+      }
+
+      PathTracer* tracer = new_frame_tracer(mesh_accels);
+      tracer->set_camera(camera);
+      tracer->set_frame_size(sampleBuffer.w, sampleBuffer.h);
+      tracer->set_scene(make_scene(f));
+      tracer->prepare_render();
+      mesh_accels = tracer->meshAccels;
+      {
+        std::lock_guard<std::mutex> lock(frameMutex);
+        frameTracers[f].store(tracer, std::memory_order_release);
+      }
+      frameCond.notify_all();
+    }
+
+    for (std::thread& t : threads) t.join();
+    for (size_t f = deleted; f < num_frames; f++) delete frameTracers[f].load();
+    frameTracers.reset();
+    framesFinished.reset();
+    workerFrames.reset();
+
+    frames_timer.stop();
+    fprintf(stdout, "[PathTracer] Rendered %zu frames (%.4fs, %.4fs per "
+            "frame)\n", num_frames, frames_timer.duration(),
+            frames_timer.duration() / num_frames);
+  }
+
+  void PathTracer::frame_worker_thread(size_t worker, size_t num_frames,
+                                       const std::string& prefix) {
+
+    size_t index;
+    while (continueRaytracing) {
+      // Only frames from first on are looked at from now on, so the tracers
+      // of earlier ones may be deleted. firstFrame never decreases, so the
+      // frames before the one published last are not looked at either.
+      size_t first = firstFrame;
+      workerFrames[worker] = first;
+      if (first >= num_frames) break;
+
+      // Take a tile of the earliest frame that has one, so that a frame
+      // finishes as soon as possible, and later frames only fill in for
+      // the tiles still being rendered.
+      bool found = false;
+      size_t last = min(num_frames, first + VIDEO_FRAMES_AHEAD);
+      size_t next = last;  // first frame that is not set up yet
+      for (size_t f = first; f < last && !found; f++) {
+        PathTracer* tracer = frameTracers[f].load(std::memory_order_acquire);
+        if (!tracer) {
+          next = f;  // later frames are not set up either
+          break;
+        }
+        if (framesFinished[f]) continue;
+        WorkStealingQueue<WorkItem>& queue = tracer->workQueue;
+        if (!queue.try_get_work(worker, &index)) continue;
+        found = true;
+
+        const WorkItem& work = queue.get_item(index);
+        size_t remaining = tracer->raytrace_tile(work.tile_x, work.tile_y,
+                                                 work.tile_w, work.tile_h);
+        if (remaining && tracer->adaptiveTolerance > 0) {
+          queue.put_back(worker, index, remaining);
+        } else if (remaining) {
+          queue.put_back(worker, index);
+        } else {
+          queue.done();
+          if (!queue.num_pending() && !framesFinished[f].exchange(true)) {
+            finish_frame(f, num_frames, prefix);
+          }
+        }
+      }
+      if (found) continue;
+
+      std::unique_lock<std::mutex> lock(frameMutex);
+      if (next < last) {
+        // nothing to do until the next frame is set up
+        frameCond.wait(lock, [&] { return frameTracers[next].load() != NULL; });
+      } else {
+        // The tiles left are all being rendered by other workers, which
+        // keep the ones they put back. Wait for a frame to finish, which
+        // makes room for the next one.
+        frameCond.wait(lock, [&] { return firstFrame != first; });
+      }
+    }
+  }
+
+  void PathTracer::finish_frame(size_t frame, size_t num_frames,
+                                const std::string& prefix) {
+
+    PathTracer* tracer = frameTracers[frame];
+    char num[32];
+    sprintf(num, "%04zu", frame);
+    // the frame is not needed anymore, so the writer takes its pixels
+    ImageBuffer& frame_buffer = tracer->frameBuffer;
+    write_png(prefix + num + ".png", std::move(frame_buffer.data),
+              frame_buffer.w, frame_buffer.h, true);
+
+    // Other workers may still look at the work queue, so the tracer itself
+    // is only deleted once they have all moved on to later frames. Its
+    // scene, BVHs and the meshes baked for the frame go now.
+    tracer->state = READY;
+    tracer->clear();
+
+    std::lock_guard<std::mutex> lock(frameMutex);
+    size_t first = firstFrame;
+    while (first < num_frames && framesFinished[first]) first++;
+    firstFrame = first;
+    frameCond.notify_all();
+  }
+
+}  // namespace CMU462
@@ -11,7 +11,6 @@
 #include "dynamic_scene/skeleton.h"
 #include "dynamic_scene/joint.h"
 
-#include "CMU462/lodepng.h"
 
 #include "GLFW/glfw3.h"
 
@@ -30,6 +29,7 @@ namespace CMU462 {
 Application::Application(AppConfig config)
 {
    scene = nullptr;
+   headless = false;
 
    pathtracer = new PathTracer (
          config.pathtracer_ns_aa,
@@ -39,8 +39,29 @@ Application::Application(AppConfig config)
          config.pathtracer_ns_glsy,
          config.pathtracer_ns_refr,
          config.pathtracer_num_threads,
-         config.pathtracer_envmap
+         config.pathtracer_envmap,
+         config.pathtracer_bvh_width,
+         config.pathtracer_bvh_refit_ratio,
+         config.pathtracer_bvh_cache_dir,
+         config.pathtracer_samples_per_pass,
+         config.pathtracer_adaptive_tolerance,
+         config.pathtracer_sample_heatmap,
+         config.pathtracer_random_seed,
+         config.pathtracer_pixel_sampler,
+         config.pathtracer_light_sampler,
+         config.pathtracer_wavefront,
+         config.pathtracer_ray_packets,
+         config.pathtracer_time_budget,
+         config.pathtracer_checkpoint,
+         config.pathtracer_checkpoint_interval,
+         config.pathtracer_resume,
+         config.pathtracer_listen_port
          );
+   imageWriter = new ImageWriter(config.image_writer_threads,
+                                 config.image_fast_compression,
+                                 config.image_exr_half,
+                                 config.image_exr_zip);
+   pathtracer->set_image_writer(imageWriter);
 
    timestep = 0.1;
    damping_factor = 0.0;
@@ -54,6 +75,7 @@ Application::~Application()
 {
    if( pathtracer != nullptr ) delete pathtracer;
    if( scene != nullptr ) delete scene;
+   delete imageWriter;
 }
 
 void Application::init()
@@ -104,13 +126,7 @@ void Application::init()
    // requires init, and init requires init_camera (which is only called by
    // load()).
    screenW = screenH = 600; // Default value
-   CameraInfo cameraInfo;
-   cameraInfo.hFov = 20;
-   cameraInfo.vFov = 28;
-   cameraInfo.nClip = 0.1;
-   cameraInfo.fClip = 100;
-   camera.configure(cameraInfo, screenW, screenH);
-   canonicalCamera.configure(cameraInfo, screenW, screenH);
+   init_default_camera();
 
    // Now initialize the timeline
    timeline.setMaxFrame(300);
@@ -221,23 +237,7 @@ void Application::render() {
       pathtracer->update_screen();
       break;
     case ANIMATE_MODE:
-      if (timeline.isCurrentlyPlaying()) {
-        for (auto o : scene->objects) {
-          DynamicScene::Mesh *mesh = dynamic_cast<DynamicScene::Mesh*>(o);
-          if (mesh != nullptr) {
-            for (int i = 0; i < 2; i++) {
-              switch (integrator) {
-                case Integrator::Forward_Euler:
-                  mesh->forward_euler(timestep, damping_factor);
-                  break;
-                case Integrator::Symplectic_Euler:
-                  mesh->symplectic_euler(timestep, damping_factor);
-                  break;
-              }
-            }
-          }
-        }
-      }
+      if (timeline.isCurrentlyPlaying()) step_physics();
       if (action == Action::Raytrace_Video) {
         raytrace_video();
         return;
@@ -449,7 +449,17 @@ void Application::init_camera(CameraInfo& cameraInfo,
                               const Matrix4x4& transform) {
   camera.configure(cameraInfo, screenW, screenH);
   canonicalCamera.configure(cameraInfo, screenW, screenH);
-  set_projection_matrix();
+  if (!headless) set_projection_matrix();
+}
+
+void Application::init_default_camera() {
+  CameraInfo cameraInfo;
+  cameraInfo.hFov = 20;
+  cameraInfo.vFov = 28;
+  cameraInfo.nClip = 0.1;
+  cameraInfo.fClip = 100;
+  camera.configure(cameraInfo, screenW, screenH);
+  canonicalCamera.configure(cameraInfo, screenW, screenH);
 }
 
 void Application::reset_camera() {
@@ -926,6 +936,7 @@ void Application::keyboard_event( int key, int event, unsigned char mods )
             for (auto o : scene->objects) {
               if (o->getInfo()[0][0] == 'M') { // Mesh
                 ((DynamicScene::Mesh*)o)->resetWave();
+                ((DynamicScene::Mesh*)o)->resetInstanceMesh();
               }
             }
             break;
@@ -1596,6 +1607,77 @@ void Application::to_animate_mode() {
   setGhosted(true);
 }
 
+void Application::load_headless(SceneInfo* sceneInfo, size_t w, size_t h) {
+  headless = true;
+  mode = MODEL_MODE;
+  action = Action::Navigate;
+  screenW = w;
+  screenH = h;
+  init_default_camera();
+  initialize_style();
+
+  load(sceneInfo);
+}
+
+void Application::render_to_file(SceneInfo* sceneInfo, size_t w, size_t h,
+                                 const string& filename) {
+  load_headless(sceneInfo, w, h);
+  set_up_pathtracer();
+  pathtracer->start_raytracing();
+  pathtracer->wait_until_done();
+  pathtracer->save_image(filename);
+  imageWriter->wait();
+}
+
+void Application::render_for_coordinator(SceneInfo* sceneInfo,
+                                         const string& address) {
+  size_t w, h;
+  if (!pathtracer->connect_coordinator(address, &w, &h)) return;
+  load_headless(sceneInfo, w, h);
+  set_up_pathtracer();
+  pathtracer->serve_coordinator();
+}
+
+void Application::render_video_to_files(SceneInfo* sceneInfo,
+                                        const string& sceneFilePath,
+                                        size_t w, size_t h, size_t num_frames) {
+  load_headless(sceneInfo, w, h);
+  loadSkeleton(sceneFilePath.c_str(), scene);
+  integrator = Integrator::Forward_Euler;
+  scene->triangulateSelection();
+
+  // The scenes of the frames are made while rendering, as they are needed,
+  // in order. Like the animation mode, every frame after the first takes
+  // the physics steps of the one before.
+  pathtracer->set_camera(&camera);
+  pathtracer->set_frame_size(w, h);
+  string videoPrefix = string("Video_") + to_string(time(NULL)) + string("_");
+  pathtracer->render_frames(num_frames, [this](size_t frame) {
+    if (frame > 0) step_physics();
+    scene->pose_at(frame, useCapsuleRadius);
+    return scene->get_transformed_static_scene(frame);
+  }, videoPrefix);
+  imageWriter->wait();
+}
+
+void Application::step_physics() {
+  for (auto o : scene->objects) {
+    DynamicScene::Mesh *mesh = dynamic_cast<DynamicScene::Mesh*>(o);
+    if (mesh != nullptr) {
+      for (int i = 0; i < 2; i++) {
+        switch (integrator) {
+          case Integrator::Forward_Euler:
+            mesh->forward_euler(timestep, damping_factor);
+            break;
+          case Integrator::Symplectic_Euler:
+            mesh->symplectic_euler(timestep, damping_factor);
+            break;
+        }
+      }
+    }
+  }
+}
+
 void Application::to_visualize_mode() {
   if (mode == VISUALIZE_MODE) return;
   set_up_pathtracer();
@@ -1628,7 +1710,8 @@ void Application::rasterize_video() {
     sprintf(num, "%04d", timeline.getCurrentFrame());
     string fname = videoPrefix + string(num) + string(".png");
 
-    char *colors = new char[screenW*screenH*4];
+    vector<uint32_t> frame(screenW*screenH);
+    char *colors = (char*) &frame[0];
 
     glReadPixels(0,0,screenW,screenH, GL_RGBA, GL_UNSIGNED_BYTE, colors);
 
@@ -1637,20 +1720,13 @@ void Application::rasterize_video() {
         colors[i] = 255;
     }
 
-    uint32_t *frame = (uint32_t*)colors;
-    size_t w = screenW;
-    size_t h = screenH;
-    uint32_t* frame_out = new uint32_t[w * h];
-    for(size_t i = 0; i < h; ++i) {
-      memcpy(frame_out + i * w, frame + (h - i - 1) * w, 4 * w);
-    }
-
-    fprintf(stderr, "[Animator] Saving to file: %s... ", fname.c_str());
-    lodepng::encode(fname, (unsigned char*) frame_out, w, h);
-    fprintf(stderr, "Done!\n");
+    // the writer flips the rows, which OpenGL reads bottom to top
+    fprintf(stderr, "[Animator] Saving to file: %s\n", fname.c_str());
+    imageWriter->write_png(fname, std::move(frame), screenW, screenH, true);
 
     if (timeline.getCurrentFrame() == timeline.getMaxFrame()) {
       timeline.action_rewind();
+      imageWriter->wait();
       cout << "Done rendering video!" << endl;
       action = Action::Object;
     }
@@ -1676,13 +1752,15 @@ void Application::raytrace_video() {
       if (timeline.getCurrentFrame() == timeline.getMaxFrame()) {
         timeline.action_stop();
         timeline.action_rewind();
+        imageWriter->wait();
         cout << "Done rendering video!" << endl;
         action = Action::Object;
         return;
       }
+      // the topology is the same in every frame, only refit the BVH
       pathtracer->stop();
-      pathtracer->clear();
-      set_up_pathtracer();
+      pathtracer->update_scene(
+          scene->get_transformed_static_scene(timeline.getCurrentFrame()));
       pathtracer->start_raytracing();
 
     }
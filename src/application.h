@@ -56,6 +56,27 @@ struct AppConfig {
 
     pathtracer_num_threads = 1;
     pathtracer_envmap = NULL;
+    pathtracer_bvh_width = 2;
+    pathtracer_bvh_refit_ratio = 1.5;
+    pathtracer_bvh_cache_dir = "";
+    pathtracer_samples_per_pass = 0;
+    pathtracer_adaptive_tolerance = 0;
+    pathtracer_sample_heatmap = "";
+    pathtracer_random_seed = 0;
+    pathtracer_pixel_sampler = "random";
+    pathtracer_light_sampler = "power";
+    pathtracer_wavefront = false;
+    pathtracer_ray_packets = true;
+    pathtracer_time_budget = 0;
+    pathtracer_checkpoint = "";
+    pathtracer_checkpoint_interval = 60;
+    pathtracer_resume = false;
+    pathtracer_listen_port = 0;
+
+    image_writer_threads = 2;
+    image_fast_compression = false;
+    image_exr_half = true;
+    image_exr_zip = true;
 
   }
 
@@ -67,6 +88,27 @@ struct AppConfig {
   size_t pathtracer_ns_refr;
   size_t pathtracer_num_threads;
   HDRImageBuffer* pathtracer_envmap;
+  size_t pathtracer_bvh_width;
+  double pathtracer_bvh_refit_ratio;
+  std::string pathtracer_bvh_cache_dir;
+  size_t pathtracer_samples_per_pass;
+  double pathtracer_adaptive_tolerance;
+  std::string pathtracer_sample_heatmap;
+  uint64_t pathtracer_random_seed;
+  std::string pathtracer_pixel_sampler;
+  std::string pathtracer_light_sampler;
+  bool pathtracer_wavefront;
+  bool pathtracer_ray_packets;
+  double pathtracer_time_budget;
+  std::string pathtracer_checkpoint;
+  double pathtracer_checkpoint_interval;
+  bool pathtracer_resume;
+  int pathtracer_listen_port;
+
+  size_t image_writer_threads;
+  bool image_fast_compression;
+  bool image_exr_half;
+  bool image_exr_zip;
 
 };
 
@@ -91,6 +133,37 @@ class Application : public Renderer {
   void char_event( unsigned int codepoint );
 
   void load(Collada::SceneInfo* sceneInfo);
+
+  /**
+   * Render a scene with the path tracer at the given resolution, through the
+   * camera of the scene, and save the result to a png file. Unlike init and
+   * load this makes no OpenGL calls, so it needs neither a Viewer nor a
+   * display. Returns once the image is saved.
+   */
+  void render_to_file(Collada::SceneInfo* sceneInfo, size_t w, size_t h,
+                      const std::string& filename);
+
+  /**
+   * Render passes over tiles of a scene for a coordinator, another instance
+   * whose path tracer takes remote workers, until it has no more work. The
+   * image size comes from the coordinator. Like render_to_file this makes
+   * no OpenGL calls.
+   */
+  void render_for_coordinator(Collada::SceneInfo* sceneInfo,
+                              const std::string& address);
+
+  /**
+   * Render the first num_frames frames of the animation of a scene with the
+   * path tracer, without a window, to png files named like those of the
+   * video mode. The animation is loaded from the skeleton files next to the
+   * scene file. Every frame is posed and takes its physics steps like a
+   * frame of the animation mode. The next frames are set up while a frame
+   * renders, and threads that run out of work on a frame start on the next
+   * one.
+   */
+  void render_video_to_files(Collada::SceneInfo* sceneInfo,
+                             const std::string& sceneFilePath,
+                             size_t w, size_t h, size_t num_frames);
   void writeScene( const char* filename );
   void loadScene( const char* filename );
 
@@ -152,8 +225,13 @@ class Application : public Renderer {
   void raytrace_video();
   void rasterize_video();
 
+  // Advance the physics of every mesh by the steps the animation takes in
+  // a frame.
+  void step_physics();
+
   DynamicScene::Scene *scene;
   PathTracer* pathtracer;
+  ImageWriter* imageWriter;  // writes screenshots and video frames
 
   // View Frustrum Variables.
   // On resize, the aspect ratio is changed. On reset_camera, the position and
@@ -164,6 +242,9 @@ class Application : public Renderer {
   size_t screenW;
   size_t screenH;
 
+  // Rendering to a file, without a window or an OpenGL context.
+  bool headless;
+
   double timestep;
   double damping_factor;
 
@@ -203,6 +284,12 @@ class Application : public Renderer {
 
   void set_scroll_rate();
 
+  // Sets up a camera for scenes that do not define one.
+  void init_default_camera();
+
+  // Loads a scene to render at the given size, without a window.
+  void load_headless(Collada::SceneInfo* sceneInfo, size_t w, size_t h);
+
   // Resets the camera to the canonical initial view position.
   void reset_camera();
 
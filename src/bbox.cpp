@@ -9,12 +9,30 @@ namespace CMU462 {
 
   bool BBox::intersect(const Ray& r, double& t0, double& t1) const {
 
-    // TODO:
-    // Implement ray - bounding box intersection test
-    // If the ray intersected the bouding box within the range given by
+    // Slab test using the ray's precomputed inverse direction and signs to
+    // pick the near and far plane of each slab. If the ray intersected the bounding box within the range given by
     // t0, t1, update t0 and t1 with the new intersection times.
 
-    return false;
+    double tmin = ((r.sign[0] ? max.x : min.x) - r.o.x) * r.inv_d.x;
+    double tmax = ((r.sign[0] ? min.x : max.x) - r.o.x) * r.inv_d.x;
+
+    double tymin = ((r.sign[1] ? max.y : min.y) - r.o.y) * r.inv_d.y;
+    double tymax = ((r.sign[1] ? min.y : max.y) - r.o.y) * r.inv_d.y;
+    if (tmin > tymax || tymin > tmax) return false;
+    if (tymin > tmin) tmin = tymin;
+    if (tymax < tmax) tmax = tymax;
+
+    double tzmin = ((r.sign[2] ? max.z : min.z) - r.o.z) * r.inv_d.z;
+    double tzmax = ((r.sign[2] ? min.z : max.z) - r.o.z) * r.inv_d.z;
+    if (tmin > tzmax || tzmin > tmax) return false;
+    if (tzmin > tmin) tmin = tzmin;
+    if (tzmax < tmax) tmax = tzmax;
+
+    if (tmin > t1 || tmax < t0) return false;
+
+    t0 = std::max(t0, tmin);
+    t1 = std::min(t1, tmax);
+    return true;
 
   }
 
@@ -35,7 +35,8 @@ namespace CMU462 {
     return albedo * (1.0 / PI);
   }
 
-  Spectrum DiffuseBSDF::sample_f(const Vector3D& wo, Vector3D* wi, float* pdf) {
+  Spectrum DiffuseBSDF::sample_f(const Vector3D& wo, Vector3D* wi, float* pdf,
+      RNG& rng) {
     return Spectrum();
   }
 
@@ -45,7 +46,8 @@ namespace CMU462 {
     return Spectrum();
   }
 
-  Spectrum MirrorBSDF::sample_f(const Vector3D& wo, Vector3D* wi, float* pdf) {
+  Spectrum MirrorBSDF::sample_f(const Vector3D& wo, Vector3D* wi, float* pdf,
+      RNG& rng) {
 
     // TODO:
     // Implement MirrorBSDF
@@ -60,7 +62,8 @@ namespace CMU462 {
      return Spectrum();
      }
 
-     Spectrum GlossyBSDF::sample_f(const Vector3D& wo, Vector3D* wi, float* pdf) {
+     Spectrum GlossyBSDF::sample_f(const Vector3D& wo, Vector3D* wi, float* pdf,
+      RNG& rng) {
    *pdf = 1.0f;
    return reflect(wo, wi, reflectance);
    }
@@ -72,7 +75,8 @@ namespace CMU462 {
     return Spectrum();
   }
 
-  Spectrum RefractionBSDF::sample_f(const Vector3D& wo, Vector3D* wi, float* pdf) {
+  Spectrum RefractionBSDF::sample_f(const Vector3D& wo, Vector3D* wi, float* pdf,
+      RNG& rng) {
 
     // TODO:
     // Implement RefractionBSDF
@@ -86,7 +90,8 @@ namespace CMU462 {
     return Spectrum();
   }
 
-  Spectrum GlassBSDF::sample_f(const Vector3D& wo, Vector3D* wi, float* pdf) {
+  Spectrum GlassBSDF::sample_f(const Vector3D& wo, Vector3D* wi, float* pdf,
+      RNG& rng) {
 
     // TODO:
     // Compute Fresnel coefficient and either reflect or refract based on it.
@@ -119,8 +124,9 @@ namespace CMU462 {
     return Spectrum();
   }
 
-  Spectrum EmissionBSDF::sample_f(const Vector3D& wo, Vector3D* wi, float* pdf) {
-    *wi  = sampler.get_sample(pdf);
+  Spectrum EmissionBSDF::sample_f(const Vector3D& wo, Vector3D* wi, float* pdf,
+      RNG& rng) {
+    *wi  = sampler.get_sample(rng, pdf);
     return Spectrum();
   }
 
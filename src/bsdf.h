@@ -74,9 +74,11 @@ namespace CMU462 {
        * \param wo outgoing light direction in local space of point of intersection
        * \param wi address to store incident light direction
        * \param pdf address to store the pdf of the output incident direction
+       * \param rng generator of the random numbers used to sample
        * \return reflectance in the output incident and given outgoing directions
        */
-      virtual Spectrum sample_f (const Vector3D& wo, Vector3D* wi, float* pdf) = 0;
+      virtual Spectrum sample_f (const Vector3D& wo, Vector3D* wi, float* pdf,
+                                 RNG& rng) = 0;
 
       /**
        * Get the emission value of the surface material. For non-emitting surfaces
@@ -116,7 +118,8 @@ namespace CMU462 {
       DiffuseBSDF(const Spectrum& a) : albedo(a) { rasterize_color = a; }
 
       Spectrum f(const Vector3D& wo, const Vector3D& wi);
-      Spectrum sample_f(const Vector3D& wo, Vector3D* wi, float* pdf);
+      Spectrum sample_f(const Vector3D& wo, Vector3D* wi, float* pdf,
+                        RNG& rng);
       Spectrum get_emission() const { return Spectrum(); }
       bool is_delta() const { return false; }
 
@@ -138,7 +141,8 @@ namespace CMU462 {
       }
 
       Spectrum f(const Vector3D& wo, const Vector3D& wi);
-      Spectrum sample_f(const Vector3D& wo, Vector3D* wi, float* pdf);
+      Spectrum sample_f(const Vector3D& wo, Vector3D* wi, float* pdf,
+                        RNG& rng);
       Spectrum get_emission() const { return Spectrum(); }
       bool is_delta() const { return true; }
 
@@ -160,7 +164,8 @@ namespace CMU462 {
      : reflectance(reflectance), roughness(roughness) { }
 
      Spectrum f(const Vector3D& wo, const Vector3D& wi);
-     Spectrum sample_f(const Vector3D& wo, Vector3D* wi, float* pdf);
+     Spectrum sample_f(const Vector3D& wo, Vector3D* wi, float* pdf,
+                        RNG& rng);
      Spectrum get_emission() const { return Spectrum(); }
      bool is_delta() const { return false; }
 
@@ -183,7 +188,8 @@ namespace CMU462 {
          }
 
       Spectrum f(const Vector3D& wo, const Vector3D& wi);
-      Spectrum sample_f(const Vector3D& wo, Vector3D* wi, float* pdf);
+      Spectrum sample_f(const Vector3D& wo, Vector3D* wi, float* pdf,
+                        RNG& rng);
       Spectrum get_emission() const { return Spectrum(); }
       bool is_delta() const { return true; }
 
@@ -207,7 +213,8 @@ namespace CMU462 {
         roughness(roughness), ior(ior) { rasterize_color = transmittance; }
 
       Spectrum f(const Vector3D& wo, const Vector3D& wi);
-      Spectrum sample_f(const Vector3D& wo, Vector3D* wi, float* pdf);
+      Spectrum sample_f(const Vector3D& wo, Vector3D* wi, float* pdf,
+                        RNG& rng);
       Spectrum get_emission() const { return Spectrum(); }
       bool is_delta() const { return true; }
 
@@ -229,7 +236,8 @@ namespace CMU462 {
       EmissionBSDF(const Spectrum& radiance) : radiance(radiance) { }
 
       Spectrum f(const Vector3D& wo, const Vector3D& wi);
-      Spectrum sample_f(const Vector3D& wo, Vector3D* wi, float* pdf);
+      Spectrum sample_f(const Vector3D& wo, Vector3D* wi, float* pdf,
+                        RNG& rng);
       Spectrum get_emission() const { return radiance; }
       bool is_delta() const { return false; }
 
@@ -1,78 +1,732 @@
 #include "bvh.h"
 
 #include "CMU462/CMU462.h"
+#include "CMU462/timer.h"
 #include "static_scene/triangle.h"
 
+#include <algorithm>
+#include <atomic>
+#include <cmath>
 #include <iostream>
 #include <stack>
+#include <thread>
 
 using namespace std;
 
 namespace CMU462 { namespace StaticScene {
 
+  // Relative costs used by the surface area heuristic. Only their ratio
+  // matters for the choice of splits; intersecting a primitive is the unit.
+  static const double BVH_TRAVERSAL_COST = 0.125;
+  static const double BVH_INTERSECT_COST = 1.0;
+
+  // Below this depth nodes are split at the SAH optimum, deeper nodes are
+  // split at the object median so that the depth of any tree stays below
+  // BVH_STACK_SIZE and the fixed size traversal stacks cannot overflow.
+  static const size_t BVH_SAH_MAX_DEPTH = 64;
+
+  // Ranges with fewer primitives than this per thread are not worth the cost
+  // of starting threads for binning or bounding.
+  static const size_t BVH_PARALLEL_GRAIN = 4096;
+
+  /**
+   * A subtree whose construction was deferred by the parallel top level
+   * build. The built subtree is stored to *slot.
+   */
+  struct BVHAccel::BuildTask {
+    BVHNode** slot;  ///< where to store the root of the subtree
+    size_t start;    ///< start index into the build primitives
+    size_t end;      ///< end index into the build primitives
+    size_t depth;    ///< depth of the root of the subtree
+  };
+
+  /**
+   * A centroid bin used when evaluating SAH split candidates.
+   */
+  struct BVHBin {
+    BVHBin() : count(0) { }
+    BBox bb;       ///< bounds of the primitives that fell into the bin
+    size_t count;  ///< number of primitives that fell into the bin
+  };
+
+  /**
+   * Number of chunks parallel_chunks splits a range of n items into.
+   */
+  static size_t num_chunks(size_t n, size_t num_threads) {
+    return std::max<size_t>(1, std::min(num_threads, n / BVH_PARALLEL_GRAIN));
+  }
+
+  /**
+   * Call func(chunk, begin, end) on each of num_chunks(end - start,
+   * num_threads) contiguous chunks of [start, end). The first chunk runs on
+   * the calling thread, the others on threads of their own.
+   */
+  template <typename F>
+  static void parallel_chunks(size_t start, size_t end, size_t num_threads,
+      const F& func) {
+
+    size_t chunks = num_chunks(end - start, num_threads);
+    size_t chunk_size = (end - start + chunks - 1) / chunks;
+
+    vector<thread> threads;
+    for (size_t c = 1; c < chunks; ++c) {
+      size_t begin = std::min(end, start + c * chunk_size);
+      size_t finish = std::min(end, begin + chunk_size);
+      threads.push_back(thread(func, c, begin, finish));
+    }
+    func(0, start, std::min(end, start + chunk_size));
+    for (thread& t : threads) t.join();
+  }
+
+  /**
+   * Convert to single precision, rounding towards -inf (round_down) or
+   * +inf (round_up) so that converted bounds never shrink.
+   */
+  static float round_down(double d) {
+    float f = (float) d;
+    return f > d ? nextafterf(f, -INF_F) : f;
+  }
+
+  static float round_up(double d) {
+    float f = (float) d;
+    return f < d ? nextafterf(f, INF_F) : f;
+  }
+
   BVHAccel::BVHAccel(const std::vector<Primitive *> &_primitives,
-      size_t max_leaf_size) {
+      size_t max_leaf_size, size_t num_bins, size_t num_threads, size_t width,
+      const std::string& cache_dir)
+    : max_leaf_size(std::min<size_t>(std::max<size_t>(1, max_leaf_size),
+                                     UINT16_MAX)),
+      num_bins(std::max<size_t>(2, num_bins)),
+      num_threads(std::max<size_t>(1, num_threads)),
+      width(std::min<size_t>(width >= 8 ? 8 : width >= 4 ? 4 : 2,
+                             max_supported_width())),
+      cache_dir(cache_dir) {
 
-    this->primitives = _primitives;
+    construct(_primitives);
+  }
 
-    // TODO:
-    // Construct a BVH from the given vector of primitives and maximum leaf
-    // size configuration. The starter code build a BVH aggregate with a
-    // single leaf node (which is also the root) that encloses all the
-    // primitives.
+  void BVHAccel::construct(const std::vector<Primitive *> &_primitives) {
 
-    BBox bb;
-    for (size_t i = 0; i < primitives.size(); ++i) {
-      bb.expand(primitives[i]->get_bbox());
+    Timer timer;
+    stats = BVHStats();
+    nodes.clear();
+    nodes4.clear();
+    nodes8.clear();
+    size_t n = _primitives.size();
+
+    // bounds of all primitives //
+    timer.start();
+    vector<BuildPrimitive> build_prims(n);
+    parallel_chunks(0, n, this->num_threads,
+        [&](size_t chunk, size_t first, size_t last) {
+          for (size_t i = first; i < last; ++i) {
+            build_prims[i].prim = _primitives[i];
+            build_prims[i].index = i;
+            build_prims[i].bb = _primitives[i]->get_bbox();
+            build_prims[i].centroid = build_prims[i].bb.centroid();
+          }
+        });
+    timer.stop();
+    stats.bounds_time = timer.duration();
+
+    // A tree cached by an earlier run over primitives with the same bounds,
+    // with the same build parameters, replaces the build.
+    uint64_t key = 0;
+    bool cached = false;
+    bool use_cache = !cache_dir.empty() && n > 0;
+    if (use_cache) {
+      key = cache_key(build_prims);
+      cached = load_cache(key, build_prims);
     }
+    if (!cached) {
+      build_tree(build_prims);
+      if (use_cache) save_cache(key);
+    }
+
+    // store the primitives in leaf order
+    primitives.resize(n);
+    for (size_t i = 0; i < n; ++i) {
+      primitives[i] = _primitives[order[i]];
+    }
+    precompute_triangles();
 
-    root = new BVHNode(bb, 0, primitives.size());
+    // collapse into a wide tree if requested
+    if (n > 0 && width == 4) collapse<4>(0, nodes4);
+    if (n > 0 && width == 8) collapse<8>(0, nodes8);
 
   }
 
-  BVHAccel::~BVHAccel() {
+  void BVHAccel::build_tree(vector<BuildPrimitive>& build_prims) {
+
+    Timer timer;
+    size_t n = build_prims.size();
+
+    // top levels //
+    // Split until there are a few subtrees per thread so that threads which
+    // draw small subtrees can pick up more work while others finish theirs.
+    timer.start();
+    BVHNode* root = NULL;
+    vector<BuildTask> tasks;
+    size_t task_size = this->num_threads == 1 ? n :
+      std::max(n / (4 * this->num_threads), BVH_PARALLEL_GRAIN);
+    if (n <= task_size) {
+      BuildTask task = { &root, 0, n, 0 };
+      tasks.push_back(task);
+    } else {
+      root = build_top(build_prims, 0, n, 0, task_size, tasks);
+    }
+    timer.stop();
+    stats.top_time = timer.duration();
+
+    // independent subtrees //
+    timer.start();
+    std::sort(tasks.begin(), tasks.end(),
+        [](const BuildTask& a, const BuildTask& b) {
+          return a.end - a.start > b.end - b.start;
+        });
+
+    size_t workers = std::min(this->num_threads, tasks.size());
+    vector<BVHStats> worker_stats(workers);
+    std::atomic<size_t> next_task(0);
+    auto worker = [&](size_t w) {
+      size_t t;
+      while ((t = next_task++) < tasks.size()) {
+        const BuildTask& task = tasks[t];
+        *task.slot = build(build_prims, task.start, task.end, task.depth,
+                           worker_stats[w]);
+      }
+    };
+
+    vector<thread> threads;
+    for (size_t w = 1; w < workers; ++w) {
+      threads.push_back(thread(worker, w));
+    }
+    worker(0);
+    for (thread& t : threads) t.join();
+    for (const BVHStats& s : worker_stats) stats.merge(s);
+    timer.stop();
+    stats.subtree_time = timer.duration();
 
-    // TODO:
-    // Implement a proper destructor for your BVH accelerator aggregate
+    // the build accumulates unnormalized cost, scale by the root area
+    double root_area = root->bb.surface_area();
+    if (root_area > 0) stats.sah_cost /= root_area;
+    stats.build_sah_cost = stats.sah_cost;
 
+    // convert to the compact layout used for traversal
+    nodes.reserve(stats.num_nodes);
+    flatten(root);
+    destroy(root);
+
+    order.resize(n);
+    for (size_t i = 0; i < n; ++i) {
+      order[i] = build_prims[i].index;
+    }
   }
 
+  bool BVHAccel::refit(const std::vector<Primitive *> &_primitives,
+      double max_cost_ratio) {
+
+    size_t n = primitives.size();
+    if (_primitives.size() != n || n == 0) {
+      construct(_primitives);
+      return false;
+    }
+
+    // primitive bounds, in leaf order
+    vector<BBox> prim_bbs(n);
+    parallel_chunks(0, n, num_threads,
+        [&](size_t chunk, size_t first, size_t last) {
+          for (size_t i = first; i < last; ++i) {
+            prim_bbs[i] = _primitives[order[i]]->get_bbox();
+          }
+        });
+
+    // Children follow their parent in depth-first order, so walking the
+    // nodes backwards visits both children of a node before the node.
+    vector<BBox> node_bbs(nodes.size());
+    double cost = 0;
+    for (size_t k = nodes.size(); k-- > 0;) {
+      LinearBVHNode& node = nodes[k];
+      BBox bb;
+      if (node.isLeaf()) {
+        for (size_t p = node.offset; p < node.offset + node.count; ++p) {
+          bb.expand(prim_bbs[p]);
+        }
+        cost += bb.surface_area() * BVH_INTERSECT_COST * node.count;
+      } else {
+        bb = node_bbs[get_left(k)];
+        bb.expand(node_bbs[get_right(k)]);
+        cost += bb.surface_area() * BVH_TRAVERSAL_COST;
+      }
+      node_bbs[k] = bb;
+    }
+    double root_area = node_bbs[0].surface_area();
+    if (root_area > 0) cost /= root_area;
+
+    if (cost > max_cost_ratio * stats.build_sah_cost) {
+      construct(_primitives);
+      return false;
+    }
+
+    for (size_t k = 0; k < nodes.size(); ++k) {
+      for (int axis = 0; axis < 3; ++axis) {
+        nodes[k].min[axis] = round_down(node_bbs[k].min[axis]);
+        nodes[k].max[axis] = round_up(node_bbs[k].max[axis]);
+      }
+    }
+    stats.sah_cost = cost;
+
+    for (size_t i = 0; i < n; ++i) {
+      primitives[i] = _primitives[order[i]];
+    }
+    precompute_triangles();
+
+    // the collapse picks children by area, so redo it for the new bounds
+    nodes4.clear();
+    nodes8.clear();
+    if (width == 4) collapse<4>(0, nodes4);
+    if (width == 8) collapse<8>(0, nodes8);
+
+    return true;
+  }
+
+  void BVHAccel::bound(const vector<BuildPrimitive>& build_prims,
+      size_t start, size_t end, size_t num_threads,
+      BBox& bb, BBox& centroid_bb) {
+
+    bb = BBox();
+    centroid_bb = BBox();
+
+    size_t chunks = num_chunks(end - start, num_threads);
+    if (chunks == 1) {
+      for (size_t i = start; i < end; ++i) {
+        bb.expand(build_prims[i].bb);
+        centroid_bb.expand(build_prims[i].centroid);
+      }
+      return;
+    }
+
+    vector<BBox> chunk_bb(chunks), chunk_centroid_bb(chunks);
+    parallel_chunks(start, end, num_threads,
+        [&](size_t chunk, size_t first, size_t last) {
+          for (size_t i = first; i < last; ++i) {
+            chunk_bb[chunk].expand(build_prims[i].bb);
+            chunk_centroid_bb[chunk].expand(build_prims[i].centroid);
+          }
+        });
+
+    for (size_t c = 0; c < chunks; ++c) {
+      bb.expand(chunk_bb[c]);
+      centroid_bb.expand(chunk_centroid_bb[c]);
+    }
+  }
+
+  bool BVHAccel::split(vector<BuildPrimitive>& build_prims,
+      size_t start, size_t end, size_t depth, size_t num_threads,
+      const BBox& bb, const BBox& centroid_bb, size_t& mid) const {
+
+    size_t range = end - start;
+    if (range <= 1) return false;
+
+    double area = bb.surface_area();
+    double leaf_cost = BVH_INTERSECT_COST * range;
+
+    // find the cheapest binned split over all three axes
+    int best_axis = -1;
+    size_t best_bin = 0;
+    double best_cost = INF_D;
+
+    if (depth < BVH_SAH_MAX_DEPTH) {
+
+      // each chunk bins all three axes into its own set of bins, which are
+      // summed up into the set of the first chunk afterwards
+      size_t chunks = num_chunks(range, num_threads);
+      size_t bins_per_chunk = 3 * num_bins;
+      vector<BVHBin> bins(chunks * bins_per_chunk);
+      parallel_chunks(start, end, num_threads,
+          [&](size_t chunk, size_t first, size_t last) {
+            BVHBin* chunk_bins = &bins[chunk * bins_per_chunk];
+            for (int axis = 0; axis < 3; ++axis) {
+              double axis_extent = centroid_bb.extent[axis];
+              if (axis_extent <= 0) continue;
+              double axis_min = centroid_bb.min[axis];
+              double scale = num_bins / axis_extent;
+              BVHBin* axis_bins = chunk_bins + axis * num_bins;
+              for (size_t i = first; i < last; ++i) {
+                size_t b = (size_t) ((build_prims[i].centroid[axis] - axis_min) * scale);
+                b = std::min(b, num_bins - 1);
+                axis_bins[b].bb.expand(build_prims[i].bb);
+                axis_bins[b].count++;
+              }
+            }
+          });
+      for (size_t c = 1; c < chunks; ++c) {
+        for (size_t b = 0; b < bins_per_chunk; ++b) {
+          bins[b].bb.expand(bins[c * bins_per_chunk + b].bb);
+          bins[b].count += bins[c * bins_per_chunk + b].count;
+        }
+      }
+
+      vector<double> right_area(num_bins);
+      vector<size_t> right_count(num_bins);
+
+      for (int axis = 0; axis < 3; ++axis) {
+
+        if (centroid_bb.extent[axis] <= 0) continue;
+        const BVHBin* axis_bins = &bins[axis * num_bins];
+
+        // sweep from the right to get the cost of every right partition
+        BBox right_bb;
+        size_t count = 0;
+        for (size_t b = num_bins - 1; b > 0; --b) {
+          right_bb.expand(axis_bins[b].bb);
+          count += axis_bins[b].count;
+          right_area[b] = right_bb.surface_area();
+          right_count[b] = count;
+        }
+
+        // sweep from the left, splitting between bins b - 1 and b
+        BBox left_bb;
+        count = 0;
+        for (size_t b = 1; b < num_bins; ++b) {
+          left_bb.expand(axis_bins[b - 1].bb);
+          count += axis_bins[b - 1].count;
+          if (count == 0 || right_count[b] == 0) continue;
+
+          double cost = BVH_TRAVERSAL_COST + BVH_INTERSECT_COST *
+            (left_bb.surface_area() * count +
+             right_area[b] * right_count[b]) / area;
+          if (cost < best_cost) {
+            best_cost = cost;
+            best_axis = axis;
+            best_bin = b;
+          }
+        }
+      }
+    }
+
+    // make a leaf if splitting does not pay off and the leaf is small enough
+    if (range <= max_leaf_size && leaf_cost <= best_cost) return false;
+
+    if (best_axis >= 0) {
+      double axis_min = centroid_bb.min[best_axis];
+      double scale = num_bins / centroid_bb.extent[best_axis];
+      size_t nbins = num_bins;
+      int axis = best_axis;
+      size_t split = best_bin;
+      vector<BuildPrimitive>::iterator it = std::partition(
+          build_prims.begin() + start, build_prims.begin() + end,
+          [=](const BuildPrimitive& p) {
+            size_t b = (size_t) ((p.centroid[axis] - axis_min) * scale);
+            return std::min(b, nbins - 1) < split;
+          });
+      mid = it - build_prims.begin();
+    } else {
+      // either all centroids coincide, so no plane separates them, or the
+      // tree got too deep; split the range in half to respect the maximum
+      // leaf size
+      mid = start + range / 2;
+    }
+
+    return true;
+  }
+
+  BVHNode* BVHAccel::build(vector<BuildPrimitive>& build_prims,
+      size_t start, size_t end, size_t depth, BVHStats& stats) const {
+
+    BBox bb, centroid_bb;
+    bound(build_prims, start, end, 1, bb, centroid_bb);
+
+    BVHNode* node = new BVHNode(bb, start, end - start);
+    stats.num_nodes++;
+    stats.max_depth = std::max(stats.max_depth, depth);
+
+    size_t mid;
+    if (!split(build_prims, start, end, depth, 1, bb, centroid_bb, mid)) {
+      stats.num_leaves++;
+      stats.sah_cost += bb.surface_area() * BVH_INTERSECT_COST * node->range;
+      return node;
+    }
+
+    stats.sah_cost += bb.surface_area() * BVH_TRAVERSAL_COST;
+    node->l = build(build_prims, start, mid, depth + 1, stats);
+    node->r = build(build_prims, mid, end, depth + 1, stats);
+    return node;
+  }
+
+  BVHNode* BVHAccel::build_top(vector<BuildPrimitive>& build_prims,
+      size_t start, size_t end, size_t depth,
+      size_t task_size, vector<BuildTask>& tasks) {
+
+    BBox bb, centroid_bb;
+    bound(build_prims, start, end, num_threads, bb, centroid_bb);
+
+    BVHNode* node = new BVHNode(bb, start, end - start);
+    stats.num_nodes++;
+    stats.max_depth = std::max(stats.max_depth, depth);
+
+    size_t mid;
+    if (!split(build_prims, start, end, depth, num_threads,
+               bb, centroid_bb, mid)) {
+      stats.num_leaves++;
+      stats.sah_cost += bb.surface_area() * BVH_INTERSECT_COST * node->range;
+      return node;
+    }
+
+    stats.sah_cost += bb.surface_area() * BVH_TRAVERSAL_COST;
+
+    if (mid - start <= task_size) {
+      BuildTask task = { &node->l, start, mid, depth + 1 };
+      tasks.push_back(task);
+    } else {
+      node->l = build_top(build_prims, start, mid, depth + 1, task_size, tasks);
+    }
+
+    if (end - mid <= task_size) {
+      BuildTask task = { &node->r, mid, end, depth + 1 };
+      tasks.push_back(task);
+    } else {
+      node->r = build_top(build_prims, mid, end, depth + 1, task_size, tasks);
+    }
+
+    return node;
+  }
+
+  static_assert(sizeof(LinearBVHNode) == 32,
+                "LinearBVHNode should fill half a cache line");
+
+  size_t BVHAccel::flatten(const BVHNode* node) {
+
+    size_t index = nodes.size();
+    nodes.push_back(LinearBVHNode());
+
+    LinearBVHNode& linear = nodes[index];
+    for (int axis = 0; axis < 3; ++axis) {
+      linear.min[axis] = round_down(node->bb.min[axis]);
+      linear.max[axis] = round_up(node->bb.max[axis]);
+    }
+
+    if (node->isLeaf()) {
+      linear.offset = node->start;
+      linear.count = node->range;
+      linear.leaf = 1;
+    } else {
+      linear.count = 0;
+      linear.leaf = 0;
+      flatten(node->l);
+      size_t right = flatten(node->r);
+      nodes[index].offset = right;  // push_back may have moved the array
+    }
+
+    return index;
+  }
+
+  void BVHAccel::destroy(BVHNode* node) {
+    if (!node) return;
+    destroy(node->l);
+    destroy(node->r);
+    delete node;
+  }
+
+  BVHAccel::~BVHAccel() { }
+
   BBox BVHAccel::get_bbox() const {
-    return root->bb;
+    return nodes[0].bbox();
+  }
+
+  void BVHAccel::get_range(size_t node, size_t* start, size_t* range) const {
+
+    size_t first = node;
+    while (!nodes[first].isLeaf()) first = get_left(first);
+
+    size_t last = node;
+    while (!nodes[last].isLeaf()) last = get_right(last);
+
+    *start = nodes[first].offset;
+    *range = nodes[last].offset + nodes[last].count - *start;
+  }
+
+  /**
+   * Ray - node bounding box slab test, as BBox::intersect but against the
+   * single precision bounds of a linear node. On a hit within [t0, t1] the
+   * entry time is written to t0.
+   */
+  static inline bool intersect_node(const LinearBVHNode& node, const Ray& r,
+      double& t0, double t1) {
+
+    double tmin = ((r.sign[0] ? node.max[0] : node.min[0]) - r.o.x) * r.inv_d.x;
+    double tmax = ((r.sign[0] ? node.min[0] : node.max[0]) - r.o.x) * r.inv_d.x;
+
+    double tymin = ((r.sign[1] ? node.max[1] : node.min[1]) - r.o.y) * r.inv_d.y;
+    double tymax = ((r.sign[1] ? node.min[1] : node.max[1]) - r.o.y) * r.inv_d.y;
+    if (tmin > tymax || tymin > tmax) return false;
+    if (tymin > tmin) tmin = tymin;
+    if (tymax < tmax) tmax = tymax;
+
+    double tzmin = ((r.sign[2] ? node.max[2] : node.min[2]) - r.o.z) * r.inv_d.z;
+    double tzmax = ((r.sign[2] ? node.min[2] : node.max[2]) - r.o.z) * r.inv_d.z;
+    if (tmin > tzmax || tzmin > tmax) return false;
+    if (tzmin > tmin) tmin = tzmin;
+    if (tzmax < tmax) tmax = tzmax;
+
+    if (tmin > t1 || tmax < t0) return false;
+
+    t0 = std::max(t0, tmin);
+    return true;
   }
 
   bool BVHAccel::intersect(const Ray &ray) const {
 
-    // TODO:
-    // Implement ray - bvh aggregate intersection test. A ray intersects
-    // with a BVH aggregate if and only if it intersects a primitive in
-    // the BVH that is not an aggregate.
-    bool hit = false;
-    for (size_t p = 0; p < primitives.size(); ++p) {
-      if(primitives[p]->intersect(ray)) hit = true;
+    if (!nodes4.empty()) return intersect_wide(nodes4, ray, NULL);
+    if (!nodes8.empty()) return intersect_wide(nodes8, ray, NULL);
+    return intersect_subtree(0, ray, NULL);
+
+  }
+
+  bool BVHAccel::intersect(const Ray &ray, Intersection *i) const {
+
+    if (!nodes4.empty()) return intersect_wide(nodes4, ray, i);
+    if (!nodes8.empty()) return intersect_wide(nodes8, ray, i);
+    return intersect_subtree(0, ray, i);
+
+  }
+
+  bool BVHAccel::intersect_subtree(size_t root, const Ray &ray,
+      Intersection *i) const {
+
+    if (i) return intersect_closest(root, ray, i);
+
+    // Any hit terminates the traversal, so the order in which the children
+    // are visited does not matter here.
+    double t0 = ray.min_t;
+    if (!intersect_node(nodes[root], ray, t0, ray.max_t)) return false;
+
+    uint32_t todo[BVH_STACK_SIZE];
+    size_t todo_size = 0;
+    todo[todo_size++] = root;
+
+    while (todo_size > 0) {
+      size_t index = todo[--todo_size];
+      const LinearBVHNode& node = nodes[index];
+
+      if (node.isLeaf()) {
+        if (intersect_leaf(node.offset, node.count, ray, NULL)) return true;
+        continue;
+      }
+
+      double l0 = ray.min_t, r0 = ray.min_t;
+      if (intersect_node(nodes[index + 1], ray, l0, ray.max_t)) {
+        todo[todo_size++] = index + 1;
+      }
+      if (intersect_node(nodes[node.offset], ray, r0, ray.max_t)) {
+        todo[todo_size++] = node.offset;
+      }
     }
 
-    return hit;
+    return false;
 
   }
 
-  bool BVHAccel::intersect(const Ray &ray, Intersection *i) const {
+  bool BVHAccel::intersect_closest(size_t root, const Ray &ray,
+      Intersection *i) const {
+
+    // Front-to-back traversal. The nearer child is visited first and the
+    // entry time of the farther one is kept on the stack, so that subtrees
+    // starting beyond the closest hit found so far (ray.max_t, which the
+    // primitives shrink on every hit) are skipped without being opened.
+    double t0 = ray.min_t;
+    if (!intersect_node(nodes[root], ray, t0, ray.max_t)) return false;
 
-    // TODO:
-    // Implement ray - bvh aggregate intersection test. A ray intersects
-    // with a BVH aggregate if and only if it intersects a primitive in
-    // the BVH that is not an aggregate. When an intersection does happen.
-    // You should store the non-aggregate primitive in the intersection data
-    // and not the BVH aggregate itself.
+    struct StackEntry {
+      uint32_t node;
+      double t;
+    };
+
+    StackEntry todo[BVH_STACK_SIZE];
+    size_t todo_size = 0;
+    todo[todo_size].node = root;
+    todo[todo_size].t = t0;
+    todo_size++;
 
     bool hit = false;
-    for (size_t p = 0; p < primitives.size(); ++p) {
-      if(primitives[p]->intersect(ray, i)) hit = true;
+    while (todo_size > 0) {
+      StackEntry entry = todo[--todo_size];
+      if (entry.t > ray.max_t) continue;
+      const LinearBVHNode& node = nodes[entry.node];
+
+      if (node.isLeaf()) {
+        if (intersect_leaf(node.offset, node.count, ray, i)) hit = true;
+        continue;
+      }
+
+      uint32_t left = entry.node + 1, right = node.offset;
+      double l0 = ray.min_t, r0 = ray.min_t;
+      bool hit_l = intersect_node(nodes[left], ray, l0, ray.max_t);
+      bool hit_r = intersect_node(nodes[right], ray, r0, ray.max_t);
+
+      if (hit_l && hit_r) {
+        uint32_t first = left, second = right;
+        double first_t = l0, second_t = r0;
+        if (r0 < l0) {
+          std::swap(first, second);
+          std::swap(first_t, second_t);
+        }
+        todo[todo_size].node = second; todo[todo_size].t = second_t; todo_size++;
+        todo[todo_size].node = first;  todo[todo_size].t = first_t;  todo_size++;
+      } else if (hit_l) {
+        todo[todo_size].node = left;  todo[todo_size].t = l0; todo_size++;
+      } else if (hit_r) {
+        todo[todo_size].node = right; todo[todo_size].t = r0; todo_size++;
+      }
     }
 
     return hit;
 
   }
 
+  BVHInstance::BVHInstance(const BVHAccel* accel, const Matrix4x4& transform)
+    : accel(accel), transform(transform), inverse(transform.inv()) { }
+
+  BBox BVHInstance::get_bbox() const {
+
+    BBox object_bb = accel->get_bbox();
+    if (object_bb.empty()) return BBox();
+
+    BBox bb;
+    for (int c = 0; c < 8; ++c) {
+      Vector3D corner((c & 1) ? object_bb.max.x : object_bb.min.x,
+                      (c & 2) ? object_bb.max.y : object_bb.min.y,
+                      (c & 4) ? object_bb.max.z : object_bb.min.z);
+      bb.expand((transform * Vector4D(corner, 1.0)).projectTo3D());
+    }
+    return bb;
+  }
+
+  Ray BVHInstance::to_object(const Ray& r) const {
+    Ray ray = r.transform_by(inverse);
+    ray.min_t = r.min_t;
+    ray.max_t = r.max_t;
+    ray.depth = r.depth;
+    return ray;
+  }
+
+  bool BVHInstance::intersect(const Ray& r) const {
+    return accel->intersect(to_object(r));
+  }
+
+  bool BVHInstance::intersect(const Ray& r, Intersection* i) const {
+
+    Ray ray = to_object(r);
+    if (!accel->intersect(ray, i)) return false;
+    r.max_t = ray.max_t;
+
+    // normals transform by the inverse transpose, which keeps them facing
+    // against the ray
+    Vector4D n = inverse.T() * Vector4D(i->n, 0.0);
+    i->n = n.to3D().unit();
+    return true;
+  }
+
 }  // namespace StaticScene
 }  // namespace CMU462
@@ -5,19 +5,28 @@
 #include "static_scene/aggregate.h"
 
 #include <vector>
+#include <string>
+#include <algorithm>
+#include <stdint.h>
 
 namespace CMU462 { namespace StaticScene {
 
+  // Size of the traversal stacks. The builder keeps every tree shallower.
+  static const size_t BVH_STACK_SIZE = 128;
+
+  // Rays traced through the tree together by the packet traversal at most.
+  static const size_t BVH_PACKET_SIZE = 16;
 
   /**
-   * A node in the BVH accelerator aggregate.
+   * A node in the BVH accelerator aggregate while it is being built.
    * The accelerator uses a "flat tree" structure where all the primitives are
    * stored in one vector. A node in the data structure stores only the starting
    * index and the number of primitives in the node and uses this information to
    * index into the primitive vector for actual data. In this implementation all
    * primitives (index + range) are stored on leaf nodes. A leaf node has no child
    * node and its range should be no greater than the maximum leaf size used when
-   * constructing the BVH.
+   * constructing the BVH. Once built, the tree is converted to LinearBVHNodes
+   * and these nodes are freed.
    */
   struct BVHNode {
 
@@ -33,6 +42,102 @@ namespace CMU462 { namespace StaticScene {
     BVHNode* r;     ///< right child node
   };
 
+  /**
+   * A node of the compact BVH representation used for traversal.
+   * Nodes are stored in one array in depth-first order, so the left child of
+   * an interior node immediately follows it and only the index of the right
+   * child needs to be stored. The bounds are stored in single precision,
+   * rounded outwards so that they still enclose the primitives, which brings
+   * a node down to 32 bytes: two nodes per 64 byte cache line.
+   */
+  struct LinearBVHNode {
+
+    inline bool isLeaf() const { return leaf != 0; }
+
+    /**
+     * Get the bounding box of the node (in double precision).
+     */
+    BBox bbox() const {
+      return BBox(min[0], min[1], min[2], max[0], max[1], max[2]);
+    }
+
+    float min[3];     ///< min corner of the bounding box
+    float max[3];     ///< max corner of the bounding box
+    uint32_t offset;  ///< first primitive (leaf) or right child (interior)
+    uint16_t count;   ///< number of primitives (leaf)
+    uint16_t leaf;    ///< nonzero if the node is a leaf
+  };
+
+  /**
+   * A node of a wide BVH, which has up to W children instead of two.
+   * Wide BVHs are collapsed from the binary tree for SIMD traversal: the
+   * bounds of all children are stored as structure of arrays so that one ray
+   * can be tested against all of them with a single W-wide slab test.
+   * bounds[0] holds the min corners and bounds[1] the max corners, so the
+   * near plane along an axis is bounds[ray.sign[axis]][axis].
+   */
+  template <int W>
+  struct WideBVHNode {
+
+    float bounds[2][3][W];  ///< child bounds [min/max][axis][child]
+    int32_t child[W];       ///< child node, first primitive or -1 if empty
+    uint32_t count[W];      ///< primitive count of leaf children, else 0
+  };
+
+  /**
+   * Four triangles of the aggregate, precomputed for intersection.
+   * Each triangle is stored as one vertex and the two edges leaving it, in
+   * single precision, as structure of arrays so that a ray is tested against
+   * all four at once. Block b holds primitives 4b to 4b + 3 of the aggregate.
+   * Lanes holding other primitives (or none) are NaN and never report a hit.
+   * The longest edge of a triangle sizes the slack of the test on its
+   * barycentric coordinates.
+   */
+  struct TriangleBlock {
+
+    float p[3][4];   ///< first vertex [axis][lane]
+    float e1[3][4];  ///< edge from the first to the second vertex
+    float e2[3][4];  ///< edge from the first to the third vertex
+    float size[4];   ///< length of the longest edge
+  };
+
+  /**
+   * Statistics collected while building a BVH.
+   * The SAH cost is the expected cost of tracing a random ray through the
+   * tree, measured in units of primitive intersection tests and normalized by
+   * the surface area of the root node.
+   */
+  struct BVHStats {
+
+    BVHStats() : num_nodes(0), num_leaves(0), max_depth(0), sah_cost(0),
+      build_sah_cost(0), bounds_time(0), top_time(0), subtree_time(0),
+      cached(false), num_triangles(0), triangle_bytes(0) { }
+
+    /**
+     * Accumulate the tree statistics of an independently built subtree.
+     */
+    void merge(const BVHStats& other) {
+      num_nodes += other.num_nodes;
+      num_leaves += other.num_leaves;
+      max_depth = std::max(max_depth, other.max_depth);
+      sah_cost += other.sah_cost;
+    }
+
+    size_t num_nodes;     ///< total number of nodes (interior and leaf)
+    size_t num_leaves;    ///< number of leaf nodes
+    size_t max_depth;     ///< depth of the deepest leaf (root has depth 0)
+    double sah_cost;      ///< surface area heuristic cost of the whole tree
+    double build_sah_cost;  ///< SAH cost right after the last full build
+
+    double bounds_time;   ///< seconds spent computing primitive bounds
+    double top_time;      ///< seconds spent splitting the top levels
+    double subtree_time;  ///< seconds spent building independent subtrees
+    bool cached;          ///< whether the tree was loaded from the BVH cache
+
+    size_t num_triangles;   ///< number of triangles in the triangle store
+    size_t triangle_bytes;  ///< size of the triangle store in bytes
+  };
+
   /**
    * Bounding Volume Hierarchy for fast Ray - Primitive intersection.
    * Note that the BVHAccel is an Aggregate (A Primitive itself) that contains
@@ -50,10 +155,30 @@ namespace CMU462 { namespace StaticScene {
        * Create BVH from a list of primitives. Note that the BVHAccel Aggregate
        * stores pointers to the primitives and thus the primitives need be kept
        * in memory for the aggregate to function properly.
+       * The tree is built top-down using the surface area heuristic (SAH),
+       * evaluated over a fixed number of equally sized bins of primitive
+       * centroids along each axis. A node holding more than max_leaf_size
+       * primitives is always split, even if the SAH would prefer a leaf.
+       * With more than one thread, the top levels of the tree are split with
+       * centroid binning spread over all threads, and the subtrees below them
+       * are then built independently, one per thread at a time.
+       * The binary tree can be collapsed into a 4-wide (SSE) or 8-wide
+       * (AVX2) tree for traversal. If the CPU lacks the instructions for the
+       * requested width, the widest supported one is used instead.
+       * If a cache directory is given, the tree is saved there after it is
+       * built, keyed by a hash of the primitive bounds and build parameters,
+       * and loaded from there instead of built when the key matches.
        * \param primitives primitives to build from
        * \param max_leaf_size maximum number of primitives to be stored in leaves
+       * \param num_bins number of centroid bins per axis for SAH evaluation
+       * \param num_threads number of threads to build with
+       * \param width branching factor used for traversal (2, 4 or 8)
+       * \param cache_dir directory of the BVH cache, empty for none
        */
-      BVHAccel(const std::vector<Primitive*>& primitives, size_t max_leaf_size = 4);
+      BVHAccel(const std::vector<Primitive*>& primitives,
+               size_t max_leaf_size = 4, size_t num_bins = 16,
+               size_t num_threads = 1, size_t width = 2,
+               const std::string& cache_dir = "");
 
       /**
        * Destructor.
@@ -93,6 +218,49 @@ namespace CMU462 { namespace StaticScene {
        */
       bool intersect(const Ray& r, Intersection* i) const;
 
+      /**
+       * Ray packet - Aggregate intersection. Intersects n rays as intersect
+       * does, but traces coherent rays, such as the camera rays of
+       * neighbouring pixels, through the binary tree together: a node is
+       * culled against the frustum of the whole packet with interval
+       * arithmetic before the rays still active are tested against it one by
+       * one. Rays that do not share their direction signs are traced one at
+       * a time, and so are the rays of a packet left in a subtree once only
+       * a few of them remain active. Packets of more than BVH_PACKET_SIZE
+       * rays are split.
+       * \param rays rays to test intersection with
+       * \param n number of rays
+       * \param isects intersection info of each ray
+       * \param hits whether each ray intersects with the aggregate
+       */
+      void intersect_packet(const Ray* rays, size_t n, Intersection* isects,
+                            bool* hits) const;
+
+      /**
+       * Ray packet - Aggregate occlusion test, as intersect_packet for
+       * intersect without intersection info, such as for shadow rays from a
+       * point towards the samples of an area light. A ray leaves the packet
+       * once it hits anything.
+       * \param rays rays to test intersection with
+       * \param n number of rays
+       * \param occluded whether each ray intersects with the aggregate
+       */
+      void occluded_packet(const Ray* rays, size_t n, bool* occluded) const;
+
+      /**
+       * Update the aggregate for a new set of primitives that correspond one
+       * to one, in the same order, to those it was built from (such as the
+       * next frame of an animation). The tree topology is kept and only its
+       * bounds are recomputed, bottom-up. If that raises the SAH cost above
+       * max_cost_ratio times its cost after the last full build, or if the
+       * number of primitives differs, the tree is rebuilt instead.
+       * \param primitives primitives to update to
+       * \param max_cost_ratio SAH degradation that triggers a rebuild
+       * \return true if the tree was refit, false if it was rebuilt
+       */
+      bool refit(const std::vector<Primitive*>& primitives,
+                 double max_cost_ratio);
+
       /**
        * Get BSDF of the surface material
        * Note that this does not make sense for the BVHAccel aggregate
@@ -104,7 +272,45 @@ namespace CMU462 { namespace StaticScene {
       /**
        * Get entry point (root) - used in visualizer
        */
-      BVHNode* get_root() const { return root; }
+      size_t get_root() const { return 0; }
+
+      /**
+       * Get a node by index - used in visualizer
+       */
+      const LinearBVHNode& get_node(size_t node) const { return nodes[node]; }
+
+      /**
+       * Get the index of the left child of an interior node
+       */
+      size_t get_left(size_t node) const { return node + 1; }
+
+      /**
+       * Get the index of the right child of an interior node
+       */
+      size_t get_right(size_t node) const { return nodes[node].offset; }
+
+      /**
+       * Get the range of primitives enclosed by a node - used in visualizer.
+       * Interior nodes do not store their range, so it is found from the
+       * leftmost and rightmost leaves below the node.
+       */
+      void get_range(size_t node, size_t* start, size_t* range) const;
+
+      /**
+       * Get statistics of the last build
+       */
+      const BVHStats& get_stats() const { return stats; }
+
+      /**
+       * Get the branching factor used for traversal
+       */
+      size_t get_width() const { return width; }
+
+      /**
+       * Get the widest branching factor the CPU can traverse with SIMD
+       * instructions: 8 with AVX2, 4 with SSE and 2 (scalar) otherwise.
+       */
+      static size_t max_supported_width();
 
       /**
        * Draw the BVH with OpenGL - used in visualizer
@@ -117,9 +323,243 @@ namespace CMU462 { namespace StaticScene {
       void drawOutline(const Color& c) const { }
 
     private:
-      BVHNode* root; ///< root node of the BVH
+
+      struct BuildTask;
+
+      /**
+       * Per-primitive data cached for the duration of a build so that
+       * bounding boxes are computed only once per primitive.
+       */
+      struct BuildPrimitive {
+        BBox bb;            ///< bounding box of the primitive
+        Vector3D centroid;  ///< centroid of the bounding box
+        Primitive* prim;    ///< the primitive itself
+        uint32_t index;     ///< position of the primitive in the input list
+      };
+
+      /**
+       * Build the tree (and the structures derived from it) from scratch.
+       */
+      void construct(const std::vector<Primitive*>& primitives);
+
+      /**
+       * Build the tree over build_prims (the top levels in parallel, then
+       * the subtrees below them), flatten it, and record the leaf order of
+       * the primitives in order.
+       */
+      void build_tree(std::vector<BuildPrimitive>& build_prims);
+
+      /**
+       * Hash the primitive bounds and build parameters into the cache key.
+       */
+      uint64_t cache_key(const std::vector<BuildPrimitive>& build_prims) const;
+
+      /**
+       * Path of the cache file for the given key.
+       */
+      std::string cache_path(uint64_t key) const;
+
+      /**
+       * Load the nodes, primitive order and tree statistics from the cache
+       * file for the given key. Returns false, leaving the tree empty, if
+       * there is no such file or it does not hold a valid tree enclosing
+       * the bounds of build_prims.
+       */
+      bool load_cache(uint64_t key, const std::vector<BuildPrimitive>& build_prims);
+
+      /**
+       * Write the tree to the cache file for the given key.
+       */
+      void save_cache(uint64_t key) const;
+
+      /**
+       * Compute the bounds of the primitives in build[start, end) and of
+       * their centroids, using up to num_threads threads.
+       */
+      static void bound(const std::vector<BuildPrimitive>& build,
+                        size_t start, size_t end, size_t num_threads,
+                        BBox& bb, BBox& centroid_bb);
+
+      /**
+       * Decide whether the node over build[start, end) becomes a leaf. If it
+       * does not, partition its primitives at the best SAH split (binned
+       * using up to num_threads threads) and return the split index in mid.
+       */
+      bool split(std::vector<BuildPrimitive>& build,
+                 size_t start, size_t end, size_t depth, size_t num_threads,
+                 const BBox& bb, const BBox& centroid_bb, size_t& mid) const;
+
+      /**
+       * Recursively build the subtree over build[start, end) and return its
+       * root. On return the entries in that range are ordered so that every
+       * node covers a contiguous range of them.
+       */
+      BVHNode* build(std::vector<BuildPrimitive>& build,
+                     size_t start, size_t end, size_t depth,
+                     BVHStats& stats) const;
+
+      /**
+       * Build the top levels of the tree over build[start, end) using all
+       * threads for each split. Ranges of at most task_size primitives are
+       * not built but recorded in tasks, to be built independently later.
+       */
+      BVHNode* build_top(std::vector<BuildPrimitive>& build,
+                         size_t start, size_t end, size_t depth,
+                         size_t task_size, std::vector<BuildTask>& tasks);
+
+      /**
+       * Append the subtree rooted at the given node to the linear node array
+       * in depth-first order and return the index of its root.
+       */
+      size_t flatten(const BVHNode* node);
+
+      /**
+       * Free the subtree rooted at the given node.
+       */
+      static void destroy(BVHNode* node);
+
+      /**
+       * Append a W-wide node collapsed from the binary subtree rooted at the
+       * given linear node, and recursively its children, to wide_nodes.
+       * Return the index of the appended node.
+       */
+      template <int W>
+      size_t collapse(size_t node, std::vector<WideBVHNode<W> >& wide_nodes);
+
+      /**
+       * Fill the triangle store from the primitives, which must already be
+       * in leaf order.
+       */
+      void precompute_triangles();
+
+      /**
+       * Ray - Leaf intersection with primitives [start, start + count).
+       * Triangles are first tested in single precision against the triangle
+       * store, with some slack, and only the candidates found are tested
+       * exactly through the Primitive interface, which also fills in i.
+       * Other primitives are always tested exactly. If i is NULL, returns on
+       * the first hit found.
+       */
+      bool intersect_leaf(size_t start, size_t count,
+                          const Ray& r, Intersection* i) const;
+
+      /**
+       * Ray - Subtree intersection over the binary tree, from the given
+       * node. If i is NULL, returns on the first hit found.
+       */
+      bool intersect_subtree(size_t root, const Ray& r, Intersection* i) const;
+
+      /**
+       * Ray - Subtree intersection over the binary tree, from the given
+       * node, finding the closest hit.
+       */
+      bool intersect_closest(size_t root, const Ray& r, Intersection* i) const;
+
+      /**
+       * Packet traversal of intersect_packet and occluded_packet, for at
+       * most BVH_PACKET_SIZE rays. If isects is NULL, every ray stops at the
+       * first hit found.
+       */
+      void traverse_packet(const Ray* rays, size_t n, Intersection* isects,
+                           bool* hits) const;
+
+      /**
+       * Ray - Aggregate intersection over a W-wide tree, intersecting the ray
+       * with all children of a node at once. If i is NULL, returns on the
+       * first hit found.
+       */
+      template <int W>
+      bool intersect_wide(const std::vector<WideBVHNode<W> >& wide_nodes,
+                          const Ray& r, Intersection* i) const;
+
+      std::vector<WideBVHNode<4> > nodes4;  ///< 4-wide nodes if width is 4
+      std::vector<WideBVHNode<8> > nodes8;  ///< 8-wide nodes if width is 8
+
+      std::vector<TriangleBlock> triangles;  ///< triangle store, by block
+      std::vector<uint8_t> others;   ///< lanes of each block not in the store
+      float triangle_scale;          ///< largest coordinate in the store
+
+      std::vector<LinearBVHNode> nodes;  ///< nodes in depth-first order
+      std::vector<uint32_t> order;  ///< input index of each primitive
+      size_t max_leaf_size;  ///< maximum number of primitives in a leaf
+      size_t num_bins;       ///< number of SAH bins per axis
+      size_t num_threads;    ///< number of threads used for building
+      size_t width;          ///< branching factor used for traversal
+      std::string cache_dir;  ///< directory of the BVH cache, or empty
+      BVHStats stats;        ///< statistics of the last build
+  };
+
+  /**
+   * A BVH placed in the world by a transform, used as a primitive of a top
+   * level BVH to build two-level acceleration structures: the instanced BVH
+   * is built once over a mesh in object space, and moving the instance only
+   * requires updating the top level. Rays are transformed into object space
+   * without renormalizing their direction, so that hit times are the same
+   * in both spaces.
+   */
+  class BVHInstance : public Primitive {
+    public:
+
+      /**
+       * Constructor.
+       * \param accel the instanced BVH (not owned)
+       * \param transform object to world space transform
+       */
+      BVHInstance(const BVHAccel* accel, const Matrix4x4& transform);
+
+      /**
+       * Get the world space bounding box of the instance.
+       */
+      BBox get_bbox() const;
+
+      /**
+       * Ray - Instance intersection.
+       */
+      bool intersect(const Ray& r) const;
+
+      /**
+       * Ray - Instance intersection 2. On a hit the normal in i is
+       * transformed back to world space.
+       */
+      bool intersect(const Ray& r, Intersection* i) const;
+
+      /**
+       * Get BSDF. An instance has no material of its own, the intersected
+       * primitive of the instanced BVH provides it.
+       */
+      BSDF* get_bsdf() const { return NULL; }
+
+      /**
+       * Draw with OpenGL - used in visualizer
+       */
+      void draw(const Color& c) const { }
+
+      /**
+       * Draw outline with OpenGL - used in visualizer
+       */
+      void drawOutline(const Color& c) const { }
+
+    private:
+
+      /**
+       * Transform a world space ray into object space.
+       */
+      Ray to_object(const Ray& r) const;
+
+      const BVHAccel* accel;  ///< the instanced BVH
+      Matrix4x4 transform;    ///< object to world space transform
+      Matrix4x4 inverse;      ///< world to object space transform
   };
 
+  /**
+   * Check that BVH leaves, which test triangles in single precision first,
+   * find the same hits as Triangle::intersect, on rays aimed at or just
+   * past the edges of triangles of meshes of several sizes, near and far
+   * from the origin. Prints a table of the mismatches to stdout and returns
+   * true if there are none.
+   */
+  bool check_triangle_leaves();
+
 } // namespace StaticScene
 } // namespace CMU462
 
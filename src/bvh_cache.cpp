@@ -0,0 +1,263 @@
+#include "bvh.h"
+
+#include "CMU462/CMU462.h"
+
+#include <cstdio>
+#include <cstring>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#else
+#include <process.h>
+#define getpid _getpid
+#endif
+
+using namespace std;
+
+namespace CMU462 { namespace StaticScene {
+
+  // Bump whenever the layout of the cache file or of LinearBVHNode changes,
+  // or the builder changes the trees it makes.
+  static const uint32_t BVH_CACHE_VERSION = 1;
+
+  /**
+   * Header of a BVH cache file. It is followed by the nodes and then by the
+   * input index of each primitive in leaf order.
+   */
+  struct BVHCacheHeader {
+    char magic[8];            ///< "S3DBVH" followed by zeros
+    uint32_t version;         ///< BVH_CACHE_VERSION
+    uint32_t node_size;       ///< sizeof(LinearBVHNode)
+    uint64_t key;             ///< hash of primitive bounds and build parameters
+    uint64_t num_primitives;  ///< number of primitives in the tree
+    uint64_t num_nodes;       ///< number of nodes in the tree
+    uint64_t num_leaves;      ///< number of leaf nodes
+    uint64_t max_depth;       ///< depth of the deepest leaf
+    double sah_cost;          ///< SAH cost of the tree
+  };
+
+  static const char BVH_CACHE_MAGIC[8] = { 'S', '3', 'D', 'B', 'V', 'H', 0, 0 };
+
+  /**
+   * Mix one 64 bit word into a hash (splitmix64 finalizer, then FNV-1a
+   * style combination).
+   */
+  static inline uint64_t hash_word(uint64_t h, uint64_t w) {
+    w ^= w >> 30; w *= 0xbf58476d1ce4e5b9ULL;
+    w ^= w >> 27; w *= 0x94d049bb133111ebULL;
+    w ^= w >> 31;
+    return (h ^ w) * 0x100000001b3ULL;
+  }
+
+  static inline uint64_t hash_double(uint64_t h, double d) {
+    uint64_t w;
+    memcpy(&w, &d, sizeof(w));
+    return hash_word(h, w);
+  }
+
+  uint64_t BVHAccel::cache_key(const vector<BuildPrimitive>& build_prims) const {
+
+    // The build only looks at the primitive bounds, so those and the build
+    // parameters determine the tree.
+    uint64_t h = 0xcbf29ce484222325ULL;
+    h = hash_word(h, BVH_CACHE_VERSION);
+    h = hash_word(h, max_leaf_size);
+    h = hash_word(h, num_bins);
+    h = hash_word(h, build_prims.size());
+    for (const BuildPrimitive& p : build_prims) {
+      for (int a = 0; a < 3; ++a) {
+        h = hash_double(h, p.bb.min[a]);
+        h = hash_double(h, p.bb.max[a]);
+      }
+    }
+    return h;
+  }
+
+  string BVHAccel::cache_path(uint64_t key) const {
+    char name[32];
+    snprintf(name, sizeof(name), "bvh_%016llx.bin", (unsigned long long) key);
+    return cache_dir + "/" + name;
+  }
+
+  /**
+   * Whether the single precision bounds of a node enclose a box.
+   */
+  static bool encloses(const LinearBVHNode& node, const BBox& bb) {
+    for (int a = 0; a < 3; ++a) {
+      if (node.min[a] > bb.min[a] || node.max[a] < bb.max[a]) return false;
+    }
+    return true;
+  }
+
+  bool BVHAccel::load_cache(uint64_t key,
+      const vector<BuildPrimitive>& build_prims) {
+
+    string path = cache_path(key);
+    size_t n = build_prims.size();
+
+    // map the file (or read it where mmap is not available)
+    const char* data = NULL;
+    size_t size = 0;
+#ifndef _WIN32
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+    struct stat st;
+    void* mapped = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+      size = st.st_size;
+      mapped = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (mapped == MAP_FAILED) return false;
+    data = (const char*) mapped;
+#else
+    FILE* file = fopen(path.c_str(), "rb");
+    if (!file) return false;
+    vector<char> buffer;
+    fseek(file, 0, SEEK_END);
+    long length = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    if (length > 0) {
+      buffer.resize(length);
+      if (fread(&buffer[0], 1, length, file) != (size_t) length) buffer.clear();
+    }
+    fclose(file);
+    size = buffer.size();
+    data = size ? &buffer[0] : NULL;
+#endif
+
+    bool valid = false;
+    BVHCacheHeader header;
+    if (size >= sizeof(header)) {
+      memcpy(&header, data, sizeof(header));
+      valid = memcmp(header.magic, BVH_CACHE_MAGIC, sizeof(header.magic)) == 0 &&
+              header.version == BVH_CACHE_VERSION &&
+              header.node_size == sizeof(LinearBVHNode) &&
+              header.key == key && header.num_primitives == n &&
+              header.num_nodes > 0 &&
+              size == sizeof(header) +
+                      header.num_nodes * sizeof(LinearBVHNode) +
+                      n * sizeof(uint32_t);
+    }
+
+    if (valid) {
+      const char* p = data + sizeof(header);
+      nodes.resize(header.num_nodes);
+      memcpy(&nodes[0], p, header.num_nodes * sizeof(LinearBVHNode));
+      p += header.num_nodes * sizeof(LinearBVHNode);
+      order.resize(n);
+      if (n) memcpy(&order[0], p, n * sizeof(uint32_t));
+    }
+
+#ifndef _WIN32
+    munmap(mapped, size);
+#endif
+
+    // A hash collision or a damaged file must not produce a broken tree:
+    // check that every index is in range, that the nodes form a tree no
+    // deeper than the traversal stacks allow, that its leaves hold every
+    // primitive once, and that every node encloses its children or
+    // primitives, which is all traversal relies on. Children come after
+    // their parent, so the depth of a node is known when it is reached.
+    vector<uint32_t> depth(valid ? nodes.size() : 0, 0);
+    vector<bool> has_parent(depth.size(), false);
+    vector<bool> slot_used(valid ? n : 0, false);
+    vector<bool> prim_used(valid ? n : 0, false);
+    size_t num_slots = 0;
+    for (size_t k = 0; valid && k < nodes.size(); ++k) {
+      const LinearBVHNode& node = nodes[k];
+      valid = (k == 0 || has_parent[k]) &&
+              depth[k] < BVH_STACK_SIZE && depth[k] <= header.max_depth;
+      if (!valid) break;
+
+      if (node.isLeaf()) {
+        valid = (size_t) node.offset + node.count <= n;
+        for (size_t i = node.offset; valid && i < node.offset + node.count; ++i) {
+          valid = !slot_used[i] && order[i] < n && !prim_used[order[i]] &&
+                  encloses(node, build_prims[order[i]].bb);
+          if (!valid) break;
+          slot_used[i] = true;
+          prim_used[order[i]] = true;
+          num_slots++;
+        }
+      } else {
+        valid = k + 1 < nodes.size() && node.offset > k + 1 &&
+                node.offset < nodes.size() &&
+                !has_parent[k + 1] && !has_parent[node.offset] &&
+                encloses(node, nodes[k + 1].bbox()) &&
+                encloses(node, nodes[node.offset].bbox());
+        if (!valid) break;
+        has_parent[k + 1] = has_parent[node.offset] = true;
+        depth[k + 1] = depth[node.offset] = depth[k] + 1;
+      }
+    }
+    valid = valid && num_slots == n;
+
+    if (!valid) {
+      nodes.clear();
+      order.clear();
+      return false;
+    }
+
+    stats.num_nodes = header.num_nodes;
+    stats.num_leaves = header.num_leaves;
+    stats.max_depth = header.max_depth;
+    stats.sah_cost = header.sah_cost;
+    stats.build_sah_cost = header.sah_cost;
+    stats.cached = true;
+    return true;
+  }
+
+  void BVHAccel::save_cache(uint64_t key) const {
+
+    BVHCacheHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, BVH_CACHE_MAGIC, sizeof(header.magic));
+    header.version = BVH_CACHE_VERSION;
+    header.node_size = sizeof(LinearBVHNode);
+    header.key = key;
+    header.num_primitives = order.size();
+    header.num_nodes = nodes.size();
+    header.num_leaves = stats.num_leaves;
+    header.max_depth = stats.max_depth;
+    header.sah_cost = stats.sah_cost;
+
+    // Write to a temporary file and rename it into place, so that other
+    // processes never map a partially written file. The name of the
+    // temporary file is unique to the process and the BVH, as processes
+    // rendering the same scene write the same cache file.
+    string path = cache_path(key);
+    char suffix[32];
+    snprintf(suffix, sizeof(suffix), ".%ld.%p.tmp", (long) getpid(),
+             (const void*) this);
+    string tmp_path = path + suffix;
+
+    FILE* file = fopen(tmp_path.c_str(), "wb");
+    if (!file) {
+      fprintf(stderr, "[PathTracer] Cannot write BVH cache file %s\n",
+              tmp_path.c_str());
+      return;
+    }
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+              fwrite(&nodes[0], sizeof(LinearBVHNode), nodes.size(), file) ==
+                nodes.size() &&
+              (order.empty() ||
+               fwrite(&order[0], sizeof(uint32_t), order.size(), file) ==
+                 order.size());
+    ok = fclose(file) == 0 && ok;
+
+#ifdef _WIN32
+    remove(path.c_str());
+#endif
+    if (!ok || rename(tmp_path.c_str(), path.c_str()) != 0) {
+      fprintf(stderr, "[PathTracer] Cannot write BVH cache file %s\n",
+              path.c_str());
+      remove(tmp_path.c_str());
+    }
+  }
+
+}  // namespace StaticScene
+}  // namespace CMU462
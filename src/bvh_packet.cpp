@@ -0,0 +1,261 @@
+#include "bvh.h"
+#include "bvh_simd.h"
+
+#include "CMU462/CMU462.h"
+
+#include <algorithm>
+#include <cmath>
+
+using namespace std;
+
+namespace CMU462 { namespace StaticScene {
+
+  // A packet goes on with the rays that hit a node only while more than
+  // this many do. Fewer share too little of the traversal to make up for
+  // testing every node against the whole packet, so each of them traces the
+  // subtree on its own.
+  static const size_t BVH_PACKET_MIN_ACTIVE = BVH_PACKET_SIZE / 4;
+
+  /**
+   * The rays of a packet, converted to single precision as structure of
+   * arrays so that the slab test of a node runs over all of them at once.
+   * Lanes without a ray have an empty segment and never hit anything. The
+   * bounds of the origins and inverse directions of all rays are kept in
+   * double precision for the frustum test.
+   */
+  struct RayPacket {
+    float o[3][BVH_PACKET_SIZE];      ///< origins [axis][ray]
+    float inv_d[3][BVH_PACKET_SIZE];  ///< inverse directions
+    float t0[BVH_PACKET_SIZE];        ///< start of the segments
+    float t1[BVH_PACKET_SIZE];        ///< end of the segments (max_t)
+    int sign[3];                      ///< direction signs, shared by all rays
+
+    bool frustum;        ///< the bounds below are finite
+    double o_min[3];     ///< min corner of the origins
+    double o_max[3];     ///< max corner of the origins
+    double inv_min[3];   ///< smallest inverse direction per axis
+    double inv_max[3];   ///< largest inverse direction per axis
+    double t_min;        ///< earliest start of the segments
+    double t_max;        ///< latest end of the segments
+
+    Vector3D d_sum;      ///< sum of the directions, to order children by
+  };
+
+  /**
+   * Convert n rays to a packet. Returns false if they do not all share the
+   * signs of their directions, and so do not form a frustum.
+   */
+  static bool make_packet(const Ray* rays, size_t n, RayPacket& p) {
+
+    for (int a = 0; a < 3; ++a) {
+      p.sign[a] = rays[0].sign[a];
+      p.o_min[a] = p.inv_min[a] = INF_D;
+      p.o_max[a] = p.inv_max[a] = -INF_D;
+    }
+    p.t_min = INF_D;
+    p.t_max = -INF_D;
+    p.d_sum = Vector3D(0, 0, 0);
+
+    for (size_t k = 0; k < BVH_PACKET_SIZE; ++k) {
+      if (k >= n) {
+        for (int a = 0; a < 3; ++a) p.o[a][k] = p.inv_d[a][k] = 0;
+        p.t0[k] = INF_F;
+        p.t1[k] = -INF_F;
+        continue;
+      }
+
+      const Ray& r = rays[k];
+      for (int a = 0; a < 3; ++a) {
+        if (r.sign[a] != p.sign[a]) return false;
+        p.o[a][k] = r.o[a];
+        p.inv_d[a][k] = r.inv_d[a];
+        p.o_min[a] = std::min(p.o_min[a], r.o[a]);
+        p.o_max[a] = std::max(p.o_max[a], r.o[a]);
+        p.inv_min[a] = std::min(p.inv_min[a], r.inv_d[a]);
+        p.inv_max[a] = std::max(p.inv_max[a], r.inv_d[a]);
+      }
+      p.t0[k] = r.min_t;
+      p.t1[k] = r.max_t;
+      p.t_min = std::min(p.t_min, r.min_t);
+      p.t_max = std::max(p.t_max, r.max_t);
+      p.d_sum += r.d;
+    }
+
+    // a direction parallel to an axis has an infinite inverse, whose
+    // products the interval arithmetic below cannot bound
+    p.frustum = true;
+    for (int a = 0; a < 3; ++a) {
+      if (!std::isfinite(p.inv_min[a]) || !std::isfinite(p.inv_max[a])) {
+        p.frustum = false;
+      }
+    }
+    return true;
+  }
+
+  /**
+   * Frustum - node bounding box test. Bounds the entry and exit times of
+   * all rays of the packet with interval arithmetic on the bounds of their
+   * origins and inverse directions, and returns false only if no ray of the
+   * packet can hit the box.
+   */
+  static bool frustum_test(const LinearBVHNode& node, const RayPacket& p) {
+
+    double near = p.t_min, far = p.t_max;
+    for (int a = 0; a < 3; ++a) {
+      double near_plane = p.sign[a] ? node.max[a] : node.min[a];
+      double far_plane = p.sign[a] ? node.min[a] : node.max[a];
+
+      // the product of two intervals is bounded by those of their ends
+      double n0 = (near_plane - p.o_min[a]) * p.inv_min[a];
+      double n1 = (near_plane - p.o_min[a]) * p.inv_max[a];
+      double n2 = (near_plane - p.o_max[a]) * p.inv_min[a];
+      double n3 = (near_plane - p.o_max[a]) * p.inv_max[a];
+      near = std::max(near, std::min(std::min(n0, n1), std::min(n2, n3)));
+
+      double f0 = (far_plane - p.o_min[a]) * p.inv_min[a];
+      double f1 = (far_plane - p.o_min[a]) * p.inv_max[a];
+      double f2 = (far_plane - p.o_max[a]) * p.inv_min[a];
+      double f3 = (far_plane - p.o_max[a]) * p.inv_max[a];
+      far = std::min(far, std::max(std::max(f0, f1), std::max(f2, f3)));
+
+      if (near > far) return false;
+    }
+    return true;
+  }
+
+  /**
+   * Ray - node bounding box slab test for every ray of the packet. Returns
+   * a bit mask of the rays that hit the box within their segment.
+   */
+  static uint32_t slab_test(const LinearBVHNode& node, const RayPacket& p) {
+
+    float near_plane[3], far_plane[3];
+    for (int a = 0; a < 3; ++a) {
+      near_plane[a] = p.sign[a] ? node.max[a] : node.min[a];
+      far_plane[a] = p.sign[a] ? node.min[a] : node.max[a];
+    }
+
+    // the same operations on every lane, which the compiler vectorizes
+    float near[BVH_PACKET_SIZE], far[BVH_PACKET_SIZE];
+    for (size_t k = 0; k < BVH_PACKET_SIZE; ++k) {
+      near[k] = p.t0[k];
+      far[k] = p.t1[k];
+    }
+    for (int a = 0; a < 3; ++a) {
+      for (size_t k = 0; k < BVH_PACKET_SIZE; ++k) {
+        float ta = (near_plane[a] - p.o[a][k]) * p.inv_d[a][k];
+        float tb = (far_plane[a] - p.o[a][k]) * p.inv_d[a][k];
+        near[k] = std::max(near[k], ta);
+        far[k] = std::min(far[k], tb * BVH_WIDE_PAD);
+      }
+    }
+
+    uint32_t mask = 0;
+    for (size_t k = 0; k < BVH_PACKET_SIZE; ++k) {
+      if (near[k] <= far[k]) mask |= 1u << k;
+    }
+    return mask;
+  }
+
+  void BVHAccel::intersect_packet(const Ray* rays, size_t n,
+      Intersection* isects, bool* hits) const {
+
+    for (size_t k = 0; k < n; k += BVH_PACKET_SIZE) {
+      traverse_packet(rays + k, std::min(n - k, BVH_PACKET_SIZE),
+                      isects + k, hits + k);
+    }
+  }
+
+  void BVHAccel::occluded_packet(const Ray* rays, size_t n,
+      bool* occluded) const {
+
+    for (size_t k = 0; k < n; k += BVH_PACKET_SIZE) {
+      traverse_packet(rays + k, std::min(n - k, BVH_PACKET_SIZE),
+                      NULL, occluded + k);
+    }
+  }
+
+  void BVHAccel::traverse_packet(const Ray* rays, size_t n,
+      Intersection* isects, bool* hits) const {
+
+    // Rays that diverge from the start are traced one at a time, through
+    // the wide tree if there is one.
+    RayPacket p;
+    if (n < 2 || nodes.empty() || !make_packet(rays, n, p)) {
+      for (size_t k = 0; k < n; ++k) {
+        hits[k] = isects ? intersect(rays[k], &isects[k])
+                         : intersect(rays[k]);
+      }
+      return;
+    }
+
+    for (size_t k = 0; k < n; ++k) hits[k] = false;
+
+    // Every entry holds the rays of the packet that hit the parent of the
+    // node. Rays that hit something leave an occlusion test for good.
+    struct StackEntry {
+      uint32_t node;
+      uint32_t mask;
+    };
+
+    StackEntry todo[BVH_STACK_SIZE];
+    size_t todo_size = 0;
+    todo[todo_size].node = 0;
+    todo[todo_size].mask = (1u << n) - 1;
+    todo_size++;
+
+    uint32_t done = 0;
+    while (todo_size > 0) {
+      StackEntry entry = todo[--todo_size];
+      const LinearBVHNode& node = nodes[entry.node];
+      if (p.frustum && !frustum_test(node, p)) continue;
+      uint32_t mask = entry.mask & ~done & slab_test(node, p);
+      if (!mask) continue;
+
+      size_t active = 0;
+      for (size_t k = 0; k < n; ++k) active += (mask >> k) & 1;
+
+      if (node.isLeaf() || active <= BVH_PACKET_MIN_ACTIVE) {
+        for (size_t k = 0; k < n; ++k) {
+          if (!(mask & (1u << k))) continue;
+          Intersection* i = isects ? &isects[k] : NULL;
+          bool hit = node.isLeaf() ?
+            intersect_leaf(node.offset, node.count, rays[k], i) :
+            intersect_subtree(entry.node, rays[k], i);
+          if (!hit) continue;
+          hits[k] = true;
+          if (!isects) {
+            done |= 1u << k;
+            p.t1[k] = -INF_F;
+          } else {
+            p.t1[k] = rays[k].max_t;
+          }
+        }
+        if (!isects && done == (1u << n) - 1) return;
+
+        // the frustum ends where the longest segment left does
+        p.t_max = -INF_D;
+        for (size_t k = 0; k < n; ++k) {
+          if (!(done & (1u << k))) p.t_max = std::max(p.t_max, rays[k].max_t);
+        }
+        continue;
+      }
+
+      // Visit the child nearer along the mean direction first, so that
+      // hits in it cut the segments of the rays short before the other.
+      uint32_t first = entry.node + 1, second = node.offset;
+      const LinearBVHNode& l = nodes[first];
+      const LinearBVHNode& r = nodes[second];
+      double ahead = 0;
+      for (int a = 0; a < 3; ++a) {
+        ahead += (r.min[a] + r.max[a] - l.min[a] - l.max[a]) * p.d_sum[a];
+      }
+      if (ahead < 0) std::swap(first, second);
+
+      todo[todo_size].node = second; todo[todo_size].mask = mask; todo_size++;
+      todo[todo_size].node = first;  todo[todo_size].mask = mask; todo_size++;
+    }
+  }
+
+}  // namespace StaticScene
+}  // namespace CMU462
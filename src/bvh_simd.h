@@ -0,0 +1,31 @@
+#ifndef CMU462_BVH_SIMD_H
+#define CMU462_BVH_SIMD_H
+
+// SIMD support shared by the BVH traversal kernels.
+
+#include <cfloat>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define BVH_X86 1
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+// Functions using AVX2 are compiled for it individually, so that the rest of
+// the program still runs on CPUs without it. MSVC needs no annotation.
+#if defined(BVH_X86) && (defined(__GNUC__) || defined(__clang__))
+#define BVH_TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define BVH_TARGET_AVX2
+#endif
+
+// The wide trees and ray packets are traversed in single precision. Slab
+// exit distances are scaled up by this factor to make up for the rounding
+// error of the slab test (2 * gamma(3) in float), so that rounding never
+// makes a ray miss a box it touches.
+static const float BVH_WIDE_PAD = 1.f + 2.f * (3.f * 0.5f * FLT_EPSILON) /
+                                         (1.f - 3.f * 0.5f * FLT_EPSILON);
+
+#endif // CMU462_BVH_SIMD_H
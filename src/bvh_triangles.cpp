@@ -0,0 +1,327 @@
+#include "bvh.h"
+#include "bvh_simd.h"
+#include "halfEdgeMesh.h"
+#include "rng.h"
+#include "static_scene/triangle.h"
+
+#include "CMU462/CMU462.h"
+
+#include <cmath>
+#include <cstdio>
+#include <limits>
+
+using namespace std;
+
+namespace CMU462 { namespace StaticScene {
+
+  // Relative slack of the hit times accepted by the single precision
+  // triangle test. It only has to cover the rounding error of the test (and
+  // of the stored vertices), since every candidate is tested again in double
+  // precision; a larger slack just makes a few more rays take the exact test.
+  static const float BVH_TRIANGLE_SLACK = 1e-3f;
+
+  // Distance from its edges, relative to the largest coordinate involved,
+  // at which a ray still counts as hitting a triangle in single precision.
+  // A barycentric coordinate is a distance from an edge times the length of
+  // an edge over the determinant of the test, so its rounding error is
+  // bounded likewise, and grows for small triangles and rays that graze
+  // them: a fixed slack would be too little for those and far too much for
+  // large triangles.
+  static const float BVH_TRIANGLE_EDGE_SLACK = 1e-5f;
+
+  /**
+   * A ray converted to single precision once per leaf, with the bounds of
+   * the hit times the single precision test accepts.
+   */
+  struct TriangleRay {
+    float o[3];  ///< origin
+    float d[3];  ///< direction
+    float t0;    ///< smallest hit time accepted
+    float t1;    ///< largest hit time accepted
+    float edge;  ///< distance from the edges accepted
+  };
+
+  /**
+   * Ray - triangle block test (Moller-Trumbore, as Triangle::test). Returns
+   * a bit mask of the lanes hit within [r.t0, r.t1] and within r.edge of
+   * the triangle.
+   */
+  static inline int triangle_test(const TriangleBlock& b, const TriangleRay& r) {
+
+#ifdef BVH_X86
+    __m128 dx = _mm_set1_ps(r.d[0]);
+    __m128 dy = _mm_set1_ps(r.d[1]);
+    __m128 dz = _mm_set1_ps(r.d[2]);
+
+    __m128 e1x = _mm_loadu_ps(b.e1[0]);
+    __m128 e1y = _mm_loadu_ps(b.e1[1]);
+    __m128 e1z = _mm_loadu_ps(b.e1[2]);
+    __m128 e2x = _mm_loadu_ps(b.e2[0]);
+    __m128 e2y = _mm_loadu_ps(b.e2[1]);
+    __m128 e2z = _mm_loadu_ps(b.e2[2]);
+
+    __m128 sx = _mm_sub_ps(_mm_set1_ps(r.o[0]), _mm_loadu_ps(b.p[0]));
+    __m128 sy = _mm_sub_ps(_mm_set1_ps(r.o[1]), _mm_loadu_ps(b.p[1]));
+    __m128 sz = _mm_sub_ps(_mm_set1_ps(r.o[2]), _mm_loadu_ps(b.p[2]));
+
+    // s1 = d x e2
+    __m128 s1x = _mm_sub_ps(_mm_mul_ps(dy, e2z), _mm_mul_ps(dz, e2y));
+    __m128 s1y = _mm_sub_ps(_mm_mul_ps(dz, e2x), _mm_mul_ps(dx, e2z));
+    __m128 s1z = _mm_sub_ps(_mm_mul_ps(dx, e2y), _mm_mul_ps(dy, e2x));
+
+    // s2 = s x e1
+    __m128 s2x = _mm_sub_ps(_mm_mul_ps(sy, e1z), _mm_mul_ps(sz, e1y));
+    __m128 s2y = _mm_sub_ps(_mm_mul_ps(sz, e1x), _mm_mul_ps(sx, e1z));
+    __m128 s2z = _mm_sub_ps(_mm_mul_ps(sx, e1y), _mm_mul_ps(sy, e1x));
+
+    __m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(s1x, e1x),
+          _mm_mul_ps(s1y, e1y)), _mm_mul_ps(s1z, e1z));
+    __m128 inv_det = _mm_div_ps(_mm_set1_ps(1.f), det);
+
+    __m128 u = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(s1x, sx),
+          _mm_mul_ps(s1y, sy)), _mm_mul_ps(s1z, sz)), inv_det);
+    __m128 v = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(s2x, dx),
+          _mm_mul_ps(s2y, dy)), _mm_mul_ps(s2z, dz)), inv_det);
+    __m128 t = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(s2x, e2x),
+          _mm_mul_ps(s2y, e2y)), _mm_mul_ps(s2z, e2z)), inv_det);
+
+    // NaN lanes (a zero determinant or an empty lane) fail every compare
+    __m128 abs_inv_det = _mm_andnot_ps(_mm_set1_ps(-0.f), inv_det);
+    __m128 eps = _mm_mul_ps(_mm_mul_ps(_mm_set1_ps(r.edge),
+          _mm_loadu_ps(b.size)), abs_inv_det);
+    __m128 lo = _mm_sub_ps(_mm_setzero_ps(), eps);
+    __m128 hi = _mm_add_ps(_mm_set1_ps(1.f), _mm_add_ps(eps, eps));
+    __m128 in = _mm_and_ps(_mm_cmpge_ps(u, lo), _mm_cmpge_ps(v, lo));
+    in = _mm_and_ps(in, _mm_cmple_ps(_mm_add_ps(u, v), hi));
+    in = _mm_and_ps(in, _mm_cmpge_ps(t, _mm_set1_ps(r.t0)));
+    in = _mm_and_ps(in, _mm_cmple_ps(t, _mm_set1_ps(r.t1)));
+    return _mm_movemask_ps(in);
+#else
+    int mask = 0;
+    for (int l = 0; l < 4; ++l) {
+      float e1[3] = { b.e1[0][l], b.e1[1][l], b.e1[2][l] };
+      float e2[3] = { b.e2[0][l], b.e2[1][l], b.e2[2][l] };
+      float s[3] = { r.o[0] - b.p[0][l], r.o[1] - b.p[1][l], r.o[2] - b.p[2][l] };
+
+      float s1[3] = { r.d[1] * e2[2] - r.d[2] * e2[1],
+                      r.d[2] * e2[0] - r.d[0] * e2[2],
+                      r.d[0] * e2[1] - r.d[1] * e2[0] };
+      float s2[3] = { s[1] * e1[2] - s[2] * e1[1],
+                      s[2] * e1[0] - s[0] * e1[2],
+                      s[0] * e1[1] - s[1] * e1[0] };
+
+      float inv_det = 1.f / (s1[0] * e1[0] + s1[1] * e1[1] + s1[2] * e1[2]);
+      float u = (s1[0] * s[0] + s1[1] * s[1] + s1[2] * s[2]) * inv_det;
+      float v = (s2[0] * r.d[0] + s2[1] * r.d[1] + s2[2] * r.d[2]) * inv_det;
+      float t = (s2[0] * e2[0] + s2[1] * e2[1] + s2[2] * e2[2]) * inv_det;
+
+      float eps = r.edge * b.size[l] * fabsf(inv_det);
+      if (u >= -eps && v >= -eps && u + v <= 1.f + 2 * eps &&
+          t >= r.t0 && t <= r.t1) {
+        mask |= 1 << l;
+      }
+    }
+    return mask;
+#endif
+  }
+
+  void BVHAccel::precompute_triangles() {
+
+    const float nan = numeric_limits<float>::quiet_NaN();
+
+    size_t num_blocks = (primitives.size() + 3) / 4;
+    triangles.assign(num_blocks, TriangleBlock());
+    others.assign(num_blocks, 0);
+    triangle_scale = 0;
+    stats.num_triangles = 0;
+
+    for (size_t b = 0; b < num_blocks; ++b) {
+      for (size_t l = 0; l < 4; ++l) {
+        size_t p = 4 * b + l;
+        const Triangle* tri = p < primitives.size() ?
+          dynamic_cast<const Triangle*>(primitives[p]) : NULL;
+
+        if (!tri) {
+          if (p < primitives.size()) others[b] |= 1 << l;
+          for (int a = 0; a < 3; ++a) {
+            triangles[b].p[a][l] = nan;
+            triangles[b].e1[a][l] = nan;
+            triangles[b].e2[a][l] = nan;
+          }
+          triangles[b].size[l] = nan;
+          continue;
+        }
+
+        Vector3D p1, p2, p3;
+        tri->get_vertices(p1, p2, p3);
+        Vector3D e1 = p2 - p1;
+        Vector3D e2 = p3 - p1;
+        for (int a = 0; a < 3; ++a) {
+          triangles[b].p[a][l] = p1[a];
+          triangles[b].e1[a][l] = e1[a];
+          triangles[b].e2[a][l] = e2[a];
+          triangle_scale = std::max(triangle_scale, (float) fabs(p1[a]));
+          triangle_scale = std::max(triangle_scale, (float) fabs(p2[a]));
+          triangle_scale = std::max(triangle_scale, (float) fabs(p3[a]));
+        }
+        triangles[b].size[l] = std::max(std::max(e1.norm(), e2.norm()),
+                                        (p3 - p2).norm());
+        stats.num_triangles++;
+      }
+    }
+
+    stats.triangle_bytes = triangles.size() * sizeof(TriangleBlock) +
+                           others.size() * sizeof(uint8_t);
+  }
+
+  bool BVHAccel::intersect_leaf(size_t start, size_t count,
+      const Ray& ray, Intersection* i) const {
+
+    // The hit time computed in single precision is off by about the
+    // rounding error of the coordinates involved, relative to the largest
+    // of them.
+    TriangleRay r;
+    float scale = triangle_scale;
+    for (int a = 0; a < 3; ++a) {
+      r.o[a] = ray.o[a];
+      r.d[a] = ray.d[a];
+      scale = std::max(scale, (float) fabs(ray.o[a]));
+    }
+    float tol = BVH_TRIANGLE_SLACK * scale;
+    r.t0 = ray.min_t * (1.f - BVH_TRIANGLE_SLACK) - tol;
+    r.t1 = ray.max_t * (1.f + BVH_TRIANGLE_SLACK) + tol;
+    r.edge = BVH_TRIANGLE_EDGE_SLACK * scale;
+
+    bool hit = false;
+    size_t end = start + count;
+    for (size_t b = start / 4; 4 * b < end; ++b) {
+
+      // lanes of this block within the leaf
+      int lanes = 0;
+      for (size_t l = 0; l < 4; ++l) {
+        if (4 * b + l >= start && 4 * b + l < end) lanes |= 1 << l;
+      }
+
+      int candidates = lanes & others[b];
+      if (lanes & ~others[b]) {
+        candidates |= lanes & triangle_test(triangles[b], r);
+      }
+
+      for (size_t l = 0; l < 4; ++l) {
+        if (!(candidates & (1 << l))) continue;
+        const Primitive* prim = primitives[4 * b + l];
+        if (!i) {
+          if (prim->intersect(ray)) return true;
+        } else if (prim->intersect(ray, i)) {
+          hit = true;
+        }
+      }
+    }
+
+    return hit;
+  }
+
+  bool check_triangle_leaves() {
+
+    static const size_t grid = 24;          // quads per side of a mesh
+    static const size_t num_rays = 50000;   // per mesh
+    static const double scales[] = { 1e-3, 1, 1e3 };
+    static const double offsets[] = { 0, 1e-9, 1e-7, 1e-5 };  // from edges
+
+    RNG rng(5);
+    bool ok = true;
+    printf("Ray - triangle leaf test against Triangle::intersect, on rays "
+           "aimed at triangle edges\n");
+    printf("%10s %10s %10s %10s %12s\n", "scale", "origin", "rays", "hits",
+           "mismatches");
+
+    for (double scale : scales) {
+      for (double origin : { 0.0, 100 * scale }) {
+
+        // A bumpy grid of triangles of a wide range of shapes, whose edges
+        // are shared by two triangles each.
+        std::vector<Vector3D> positions;
+        std::vector<std::vector<size_t> > polygons;
+        for (size_t j = 0; j <= grid; ++j) {
+          for (size_t i = 0; i <= grid; ++i) {
+            double x = i + 0.4 * rng.next_double() - 0.2;
+            double z = j + 0.4 * rng.next_double() - 0.2;
+            Vector3D p(x, 0.5 * rng.next_double(), z);
+            positions.push_back(p * (scale / grid) + Vector3D(origin));
+          }
+        }
+        for (size_t j = 0; j < grid; ++j) {
+          for (size_t i = 0; i < grid; ++i) {
+            size_t a = j * (grid + 1) + i, b = a + 1;
+            size_t c = a + grid + 1, d = c + 1;
+            polygons.push_back({ a, c, b });
+            polygons.push_back({ b, c, d });
+          }
+        }
+        HalfedgeMesh halfedges;
+        halfedges.build(polygons, positions);
+        Mesh mesh(halfedges, NULL);
+        std::vector<Primitive*> primitives = mesh.get_primitives();
+        BVHAccel bvh(primitives);
+
+        size_t hits = 0, mismatches = 0;
+        for (size_t k = 0; k < num_rays; ++k) {
+
+          // a point on an edge of a random triangle, moved a little off it
+          // within the plane of the triangle, seen from a random point
+          const Triangle* tri = (const Triangle*)
+            primitives[rng.next_uint() % primitives.size()];
+          Vector3D p[3];
+          tri->get_vertices(p[0], p[1], p[2]);
+          int e = rng.next_uint() % 3;
+          Vector3D a = p[e], b = p[(e + 1) % 3], c = p[(e + 2) % 3];
+          Vector3D n = cross(b - a, c - a).unit();
+          Vector3D away = cross(b - a, n).unit();
+          if (dot(away, c - a) > 0) away = -away;
+          double offset = offsets[rng.next_uint() % 4] * scale *
+                          (rng.next_double() < 0.5 ? -1 : 1);
+          Vector3D target = a + (b - a) * rng.next_double() + away * offset;
+
+          Vector3D dir(rng.next_double() - 0.5, rng.next_double(),
+                       rng.next_double() - 0.5);
+          Vector3D o = target + dir.unit() * (scale * (0.1 + rng.next_double()));
+          Ray ray(o, (target - o).unit());
+
+          // the closest hit over all triangles, in double precision
+          Ray exact_ray = ray;
+          Intersection exact;
+          bool exact_hit = false;
+          for (Primitive* prim : primitives) {
+            exact_hit |= prim->intersect(exact_ray, &exact);
+          }
+
+          Intersection isect;
+          bool hit = bvh.intersect(ray, &isect);
+          bool any = bvh.intersect(Ray(o, (target - o).unit()));
+          hits += exact_hit;
+
+          // Where two triangles are hit at the same time, either is right.
+          bool same = hit == exact_hit && any == exact_hit;
+          if (same && hit) {
+            Ray check(o, (target - o).unit());
+            Intersection other;
+            same = isect.t == exact.t &&
+                   isect.primitive->intersect(check, &other) &&
+                   other.t == exact.t;
+          }
+          if (!same) mismatches++;
+        }
+
+        printf("%10g %10g %10zu %10zu %12zu\n", scale, origin, num_rays,
+               hits, mismatches);
+        if (mismatches) ok = false;
+        for (Primitive* prim : primitives) delete prim;
+      }
+    }
+
+    printf(ok ? "All rays agree\n" : "MISMATCHES FOUND\n");
+    return ok;
+  }
+
+}  // namespace StaticScene
+}  // namespace CMU462
@@ -0,0 +1,253 @@
+#include "bvh.h"
+#include "bvh_simd.h"
+
+#include "CMU462/CMU462.h"
+
+#include <algorithm>
+
+using namespace std;
+
+namespace CMU462 { namespace StaticScene {
+
+  /**
+   * A ray converted to single precision once per traversal.
+   */
+  struct WideRay {
+    float o[3];      ///< origin
+    float inv_d[3];  ///< component wise inverse direction
+    int sign[3];     ///< which of the bounds is the near plane on each axis
+  };
+
+  /**
+   * Ray - children slab test of a wide node. Returns a bit mask of the
+   * children hit within [t0, t1] and writes their entry times to tmin.
+   * The generic version is scalar, the 4 and 8 wide ones use SSE and AVX2.
+   */
+  template <int W>
+  static int slab_test(const WideBVHNode<W>& node, const WideRay& r,
+      float t0, float t1, float* tmin) {
+
+    int mask = 0;
+    for (int c = 0; c < W; ++c) {
+      float near = t0, far = t1;
+      for (int a = 0; a < 3; ++a) {
+        float ta = (node.bounds[r.sign[a]][a][c] - r.o[a]) * r.inv_d[a];
+        float tb = (node.bounds[1 - r.sign[a]][a][c] - r.o[a]) * r.inv_d[a];
+        near = std::max(near, ta);
+        far = std::min(far, tb * BVH_WIDE_PAD);
+      }
+      tmin[c] = near;
+      if (near <= far) mask |= 1 << c;
+    }
+    return mask;
+  }
+
+#ifdef BVH_X86
+
+  template <>
+  int slab_test<4>(const WideBVHNode<4>& node, const WideRay& r,
+      float t0, float t1, float* tmin) {
+
+    __m128 near = _mm_set1_ps(t0);
+    __m128 far = _mm_set1_ps(t1);
+    for (int a = 0; a < 3; ++a) {
+      __m128 o = _mm_set1_ps(r.o[a]);
+      __m128 inv_d = _mm_set1_ps(r.inv_d[a]);
+      __m128 ta = _mm_mul_ps(_mm_sub_ps(
+            _mm_loadu_ps(node.bounds[r.sign[a]][a]), o), inv_d);
+      __m128 tb = _mm_mul_ps(_mm_sub_ps(
+            _mm_loadu_ps(node.bounds[1 - r.sign[a]][a]), o), inv_d);
+      near = _mm_max_ps(ta, near);
+      far = _mm_min_ps(_mm_mul_ps(tb, _mm_set1_ps(BVH_WIDE_PAD)), far);
+    }
+    _mm_storeu_ps(tmin, near);
+    return _mm_movemask_ps(_mm_cmple_ps(near, far));
+  }
+
+  BVH_TARGET_AVX2
+  static int slab_test_avx2(const WideBVHNode<8>& node, const WideRay& r,
+      float t0, float t1, float* tmin) {
+
+    __m256 near = _mm256_set1_ps(t0);
+    __m256 far = _mm256_set1_ps(t1);
+    for (int a = 0; a < 3; ++a) {
+      __m256 o = _mm256_set1_ps(r.o[a]);
+      __m256 inv_d = _mm256_set1_ps(r.inv_d[a]);
+      __m256 ta = _mm256_mul_ps(_mm256_sub_ps(
+            _mm256_loadu_ps(node.bounds[r.sign[a]][a]), o), inv_d);
+      __m256 tb = _mm256_mul_ps(_mm256_sub_ps(
+            _mm256_loadu_ps(node.bounds[1 - r.sign[a]][a]), o), inv_d);
+      near = _mm256_max_ps(ta, near);
+      far = _mm256_min_ps(_mm256_mul_ps(tb, _mm256_set1_ps(BVH_WIDE_PAD)), far);
+    }
+    _mm256_storeu_ps(tmin, near);
+    return _mm256_movemask_ps(_mm256_cmp_ps(near, far, _CMP_LE_OQ));
+  }
+
+  template <>
+  int slab_test<8>(const WideBVHNode<8>& node, const WideRay& r,
+      float t0, float t1, float* tmin) {
+    return slab_test_avx2(node, r, t0, t1, tmin);
+  }
+
+#endif // BVH_X86
+
+  size_t BVHAccel::max_supported_width() {
+#if defined(BVH_X86) && (defined(__GNUC__) || defined(__clang__))
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2") ? 8 : 4;
+#elif defined(BVH_X86) && defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 0);
+    if (info[0] < 7) return 4;
+    __cpuid(info, 1);
+    bool os_saves_ymm = (info[2] & (1 << 27)) &&           // OSXSAVE
+                        (_xgetbv(0) & 0x6) == 0x6;         // XMM and YMM state
+    __cpuidex(info, 7, 0);
+    return os_saves_ymm && (info[1] & (1 << 5)) ? 8 : 4;   // AVX2
+#else
+    return 2;
+#endif
+  }
+
+  template <int W>
+  size_t BVHAccel::collapse(size_t node, vector<WideBVHNode<W> >& wide_nodes) {
+
+    size_t index = wide_nodes.size();
+    wide_nodes.push_back(WideBVHNode<W>());
+
+    // Pull in grandchildren until the node is full, always opening the
+    // interior child with the largest surface area, which is the one most
+    // likely to be hit.
+    size_t children[W];
+    size_t num_children = 0;
+    if (nodes[node].isLeaf()) {
+      children[num_children++] = node;
+    } else {
+      children[num_children++] = get_left(node);
+      children[num_children++] = get_right(node);
+    }
+
+    while (num_children < W) {
+      int largest = -1;
+      double largest_area = -1;
+      for (size_t c = 0; c < num_children; ++c) {
+        if (nodes[children[c]].isLeaf()) continue;
+        double area = nodes[children[c]].bbox().surface_area();
+        if (area > largest_area) {
+          largest = c;
+          largest_area = area;
+        }
+      }
+      if (largest < 0) break;
+
+      size_t opened = children[largest];
+      children[largest] = get_left(opened);
+      children[num_children++] = get_right(opened);
+    }
+
+    // empty slots have inverted bounds, which no ray can hit
+    for (size_t c = 0; c < W; ++c) {
+      const LinearBVHNode* child = c < num_children ? &nodes[children[c]] : NULL;
+      for (int a = 0; a < 3; ++a) {
+        wide_nodes[index].bounds[0][a][c] = child ? child->min[a] : INF_F;
+        wide_nodes[index].bounds[1][a][c] = child ? child->max[a] : -INF_F;
+      }
+      if (!child) {
+        wide_nodes[index].child[c] = -1;
+        wide_nodes[index].count[c] = 0;
+      } else if (child->isLeaf()) {
+        wide_nodes[index].child[c] = child->offset;
+        wide_nodes[index].count[c] = child->count;
+      } else {
+        // push_back may move wide_nodes, so do not hold on to a reference
+        int32_t wide_child = collapse<W>(children[c], wide_nodes);
+        wide_nodes[index].child[c] = wide_child;
+        wide_nodes[index].count[c] = 0;
+      }
+    }
+
+    return index;
+  }
+
+  template <int W>
+  bool BVHAccel::intersect_wide(const vector<WideBVHNode<W> >& wide_nodes,
+      const Ray& ray, Intersection* i) const {
+
+    // Same traversal as the binary tree, but every node tests all of its
+    // children at once. Leaf children are pushed like interior ones and
+    // told apart by their primitive count. Without an intersection record
+    // the first hit ends the traversal, as for shadow rays.
+    WideRay r;
+    for (int a = 0; a < 3; ++a) {
+      r.o[a] = ray.o[a];
+      r.inv_d[a] = ray.inv_d[a];
+      r.sign[a] = ray.sign[a];
+    }
+
+    struct StackEntry {
+      int32_t node;
+      uint32_t count;
+      float t;
+    };
+
+    // every level pushes at most W - 1 more entries than it pops
+    StackEntry todo[BVH_STACK_SIZE * (W - 1) + 1];
+    size_t todo_size = 0;
+    todo[todo_size].node = 0;
+    todo[todo_size].count = 0;
+    todo[todo_size].t = ray.min_t;
+    todo_size++;
+
+    bool hit = false;
+    while (todo_size > 0) {
+      StackEntry entry = todo[--todo_size];
+      if (entry.t > ray.max_t) continue;
+
+      if (entry.count > 0) {
+        if (intersect_leaf(entry.node, entry.count, ray, i)) {
+          if (!i) return true;
+          hit = true;
+        }
+        continue;
+      }
+
+      const WideBVHNode<W>& node = wide_nodes[entry.node];
+      float tmin[W];
+      int mask = slab_test<W>(node, r, ray.min_t, ray.max_t, tmin);
+
+      // order the children hit by entry time and push them far to near
+      int order[W];
+      int num_hit = 0;
+      for (int c = 0; c < W; ++c) {
+        if (!(mask & (1 << c))) continue;
+        int k = num_hit++;
+        while (k > 0 && tmin[order[k - 1]] < tmin[c]) {
+          order[k] = order[k - 1];
+          --k;
+        }
+        order[k] = c;
+      }
+
+      for (int k = 0; k < num_hit; ++k) {
+        int c = order[k];
+        todo[todo_size].node = node.child[c];
+        todo[todo_size].count = node.count[c];
+        todo[todo_size].t = tmin[c];
+        todo_size++;
+      }
+    }
+
+    return hit;
+  }
+
+  template size_t BVHAccel::collapse<4>(size_t, vector<WideBVHNode<4> >&);
+  template size_t BVHAccel::collapse<8>(size_t, vector<WideBVHNode<8> >&);
+
+  template bool BVHAccel::intersect_wide<4>(const vector<WideBVHNode<4> >&,
+                                            const Ray&, Intersection*) const;
+  template bool BVHAccel::intersect_wide<8>(const vector<WideBVHNode<8> >&,
+                                            const Ray&, Intersection*) const;
+
+}  // namespace StaticScene
+}  // namespace CMU462
@@ -0,0 +1,287 @@
+#include "pathtracer.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+
+using namespace std;
+using namespace CMU462::StaticScene;
+
+namespace CMU462 {
+
+  // Bump whenever the layout of the checkpoint file changes, or the render
+  // changes the samples it takes.
+  static const uint32_t CHECKPOINT_VERSION = 2;
+
+  /**
+   * Header of a checkpoint file. It is followed by the sample buffer, the
+   * number of samples per pixel taken in each tile and, with adaptive
+   * sampling, the statistics of each pixel.
+   *
+   * The random numbers of a pixel only depend on the seed, the pixel and
+   * the samples taken so far, so these also restore the state of the random
+   * number generators.
+   */
+  struct CheckpointHeader {
+    char magic[8];            ///< "S3DCKPT" followed by a zero
+    uint32_t version;         ///< CHECKPOINT_VERSION
+    uint32_t spectrum_size;   ///< sizeof(Spectrum)
+    uint32_t stats_size;      ///< sizeof(PixelStats)
+    uint32_t tile_size;       ///< width and height of the tiles
+    uint64_t width;           ///< width of the image
+    uint64_t height;          ///< height of the image
+    uint64_t num_tiles;       ///< number of entries of tile_samples
+    uint64_t num_stats;       ///< number of pixel statistics, 0 if none
+    uint64_t random_seed;     ///< seed of the render
+    double camera[9];         ///< camera position, view point and up direction
+    uint64_t scene_hash;      ///< PathTracer::scene_hash() of the scene
+    uint64_t ns_aa;           ///< samples per pixel
+    uint64_t samples_per_pass;  ///< camera rays per pixel in a pass
+    uint64_t max_ray_depth;   ///< maximum ray depth
+    uint64_t ns_area_light;   ///< samples per area light
+    char pixel_sampler[16];   ///< name of the pixel sampler
+    char light_sampler[16];   ///< name of the light sampler
+  };
+
+  static const char CHECKPOINT_MAGIC[8] = { 'S', '3', 'D', 'C', 'K', 'P', 'T', 0 };
+
+  /**
+   * Mix the bytes of a value into a hash (FNV-1a).
+   */
+  template <typename T>
+  static void hash_bytes(uint64_t* h, const T& value) {
+    const unsigned char* bytes = (const unsigned char*) &value;
+    for (size_t i = 0; i < sizeof(T); ++i) {
+      *h = (*h ^ bytes[i]) * 0x100000001b3ULL;
+    }
+  }
+
+  /**
+   * Fill in the header of a checkpoint of the current render, except for
+   * the settings of the path tracer.
+   */
+  static void make_header(CheckpointHeader* header, size_t w, size_t h,
+                          size_t tile_size, size_t num_tiles, size_t num_stats,
+                          uint64_t random_seed, const Camera* camera) {
+    memset(header, 0, sizeof(*header));
+    memcpy(header->magic, CHECKPOINT_MAGIC, sizeof(header->magic));
+    header->version = CHECKPOINT_VERSION;
+    header->spectrum_size = sizeof(Spectrum);
+    header->stats_size = sizeof(PixelStats);
+    header->tile_size = tile_size;
+    header->width = w;
+    header->height = h;
+    header->num_tiles = num_tiles;
+    header->num_stats = num_stats;
+    header->random_seed = random_seed;
+    Vector3D vectors[3] = {
+      camera->position(), camera->view_point(), camera->up_dir()
+    };
+    for (int i = 0; i < 3; ++i) {
+      for (int a = 0; a < 3; ++a) header->camera[3 * i + a] = vectors[i][a];
+    }
+  }
+
+  void PathTracer::set_checkpoint_settings(CheckpointHeader* h) const {
+    h->scene_hash = checkpointSceneHash;
+    h->ns_aa = ns_aa;
+    h->samples_per_pass = samplesPerPass;
+    h->max_ray_depth = max_ray_depth;
+    h->ns_area_light = ns_area_light;
+    strncpy(h->pixel_sampler, pixelSamplerName.c_str(),
+            sizeof(h->pixel_sampler) - 1);
+    strncpy(h->light_sampler, lightSamplerName.c_str(),
+            sizeof(h->light_sampler) - 1);
+  }
+
+  uint64_t PathTracer::scene_hash() const {
+
+    // The meshes by their triangles and transforms, other objects by the
+    // bounds of their primitives, and the lights by their power.
+    uint64_t h = 0xcbf29ce484222325ULL;
+    hash_bytes(&h, scene->objects.size());
+    for (SceneObject* obj : scene->objects) {
+      MeshInstance* instance = dynamic_cast<MeshInstance*>(obj);
+      if (instance) {
+        const Mesh* mesh = instance->get_mesh();
+        for (size_t index : mesh->get_indices()) {
+          hash_bytes(&h, mesh->positions[index]);
+        }
+        const Matrix4x4& transform = instance->get_transform();
+        for (int i = 0; i < 4; ++i) {
+          for (int j = 0; j < 4; ++j) hash_bytes(&h, transform(i, j));
+        }
+        continue;
+      }
+      for (Primitive* prim : obj->get_primitives()) {
+        hash_bytes(&h, prim->get_bbox());
+        delete prim;
+      }
+    }
+    hash_bytes(&h, scene->lights.size());
+    for (SceneLight* light : scene->lights) hash_bytes(&h, light->power(1));
+    return h;
+  }
+
+  void PathTracer::snapshot_checkpoint() {
+
+    size_t w = sampleBuffer.w;
+    size_t h = sampleBuffer.h;
+    vector<Spectrum> scratch(imageTileSize * imageTileSize);
+    vector<PixelStats> stats;
+    for (size_t ty = 0; ty < num_tiles_h; ++ty) {
+      for (size_t tx = 0; tx < num_tiles_w; ++tx) {
+        size_t tile = tx + ty * num_tiles_w;
+        size_t x0 = tx * imageTileSize, x1 = std::min(x0 + imageTileSize, w);
+        size_t y0 = ty * imageTileSize, y1 = std::min(y0 + imageTileSize, h);
+        if (x0 >= x1 || y0 >= y1) continue;
+
+        // Copy the tile into scratch space and keep the copy only if no
+        // worker wrote to the tile meanwhile (a sequence lock).
+        uint32_t v = tileVersions[tile].load(std::memory_order_acquire);
+        if (v & 1) continue;
+        for (size_t y = y0; y < y1; ++y) {
+          memcpy(&scratch[(y - y0) * imageTileSize], &sampleBuffer.data[x0 + y * w],
+                 (x1 - x0) * sizeof(Spectrum));
+        }
+        stats.clear();
+        if (!pixelStats.empty()) {
+          for (size_t y = y0; y < y1; ++y) {
+            stats.insert(stats.end(), pixelStats.begin() + x0 + y * w,
+                         pixelStats.begin() + x1 + y * w);
+          }
+        }
+        int num_samples = tile_samples[tile];
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (tileVersions[tile].load(std::memory_order_relaxed) != v) continue;
+
+        for (size_t y = y0; y < y1; ++y) {
+          memcpy(&checkpointBuffer.data[x0 + y * w], &scratch[(y - y0) * imageTileSize],
+                 (x1 - x0) * sizeof(Spectrum));
+          if (!stats.empty()) {
+            std::copy(stats.begin() + (y - y0) * (x1 - x0),
+                      stats.begin() + (y - y0 + 1) * (x1 - x0),
+                      checkpointPixelStats.begin() + x0 + y * w);
+          }
+        }
+        checkpointTileSamples[tile] = num_samples;
+      }
+    }
+  }
+
+  void PathTracer::save_checkpoint() {
+
+    CheckpointHeader header;
+    make_header(&header, checkpointBuffer.w, checkpointBuffer.h, imageTileSize,
+                checkpointTileSamples.size(), checkpointPixelStats.size(),
+                randomSeed, camera);
+    set_checkpoint_settings(&header);
+
+    // Write to a temporary file and rename it into place, so that a render
+    // stopped while writing still leaves the previous checkpoint.
+    string tmp_path = checkpointPath + ".tmp";
+    FILE* file = fopen(tmp_path.c_str(), "wb");
+    if (!file) {
+      fprintf(stderr, "[PathTracer] Cannot write checkpoint file %s\n",
+              tmp_path.c_str());
+      return;
+    }
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+              fwrite(&checkpointBuffer.data[0], sizeof(Spectrum),
+                     checkpointBuffer.data.size(), file) ==
+                checkpointBuffer.data.size() &&
+              fwrite(&checkpointTileSamples[0], sizeof(int),
+                     checkpointTileSamples.size(), file) ==
+                checkpointTileSamples.size() &&
+              (checkpointPixelStats.empty() ||
+               fwrite(&checkpointPixelStats[0], sizeof(PixelStats),
+                      checkpointPixelStats.size(), file) ==
+                 checkpointPixelStats.size());
+    ok = fclose(file) == 0 && ok;
+
+#ifdef _WIN32
+    remove(checkpointPath.c_str());
+#endif
+    if (!ok || rename(tmp_path.c_str(), checkpointPath.c_str()) != 0) {
+      fprintf(stderr, "[PathTracer] Cannot write checkpoint file %s\n",
+              checkpointPath.c_str());
+      remove(tmp_path.c_str());
+    }
+  }
+
+  bool PathTracer::load_checkpoint() {
+
+    FILE* file = fopen(checkpointPath.c_str(), "rb");
+    if (!file) {
+      fprintf(stderr, "[PathTracer] Cannot read checkpoint file %s, "
+              "starting over\n", checkpointPath.c_str());
+      return false;
+    }
+
+    // The checkpoint must be of the same image, rendered the same way.
+    CheckpointHeader expected, header;
+    make_header(&expected, sampleBuffer.w, sampleBuffer.h, imageTileSize,
+                tile_samples.size(), pixelStats.size(), randomSeed, camera);
+    set_checkpoint_settings(&expected);
+    bool ok = fread(&header, sizeof(header), 1, file) == 1 &&
+              !memcmp(&header, &expected, sizeof(header));
+    if (!ok) {
+      fclose(file);
+      bool same_scene = header.scene_hash == expected.scene_hash;
+      fprintf(stderr, "[PathTracer] Checkpoint %s is of another %s, "
+              "starting over\n", checkpointPath.c_str(),
+              same_scene ? "render" : "scene");
+      return false;
+    }
+
+    HDRImageBuffer buffer(sampleBuffer.w, sampleBuffer.h);
+    vector<int> samples(tile_samples.size());
+    vector<PixelStats> stats(pixelStats.size());
+    ok = fread(&buffer.data[0], sizeof(Spectrum), buffer.data.size(), file) ==
+           buffer.data.size() &&
+         fread(&samples[0], sizeof(int), samples.size(), file) ==
+           samples.size() &&
+         (stats.empty() ||
+          fread(&stats[0], sizeof(PixelStats), stats.size(), file) ==
+            stats.size());
+    fclose(file);
+    if (!ok) {
+      fprintf(stderr, "[PathTracer] Checkpoint %s is truncated, "
+              "starting over\n", checkpointPath.c_str());
+      return false;
+    }
+
+    sampleBuffer.data.swap(buffer.data);
+    tile_samples.swap(samples);
+    pixelStats.swap(stats);
+    fprintf(stdout, "[PathTracer] Resuming the render of checkpoint %s\n",
+            checkpointPath.c_str());
+    return true;
+  }
+
+  void PathTracer::checkpoint_thread() {
+
+    std::unique_lock<std::mutex> lock(checkpointMutex);
+    auto interval = std::chrono::duration<double>(checkpointInterval);
+    while (!checkpointCond.wait_for(lock, interval,
+                                    [this] { return checkpointStop; })) {
+      lock.unlock();
+      snapshot_checkpoint();
+      save_checkpoint();
+      lock.lock();
+    }
+    lock.unlock();
+
+    // all workers are done, so every tile is up to date
+    snapshot_checkpoint();
+    save_checkpoint();
+  }
+
+  void PathTracer::join_checkpoint_thread() {
+    if (!checkpointThread) return;
+    checkpointThread->join();
+    delete checkpointThread;
+    checkpointThread = NULL;
+  }
+
+}  // namespace CMU462
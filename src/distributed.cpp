@@ -0,0 +1,549 @@
+#include "pathtracer.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+
+#ifndef _WIN32
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+namespace CMU462 {
+
+  // Bump whenever the messages between coordinator and workers change.
+  static const uint32_t REMOTE_PROTOCOL_VERSION = 1;
+
+  // Milliseconds the coordinator waits for results before it looks for new
+  // remote workers and checks whether the render is over.
+  static const int COORDINATOR_POLL_MS = 10;
+
+  // Seconds a remote worker waits for its coordinator to start listening.
+  static const int COORDINATOR_WAIT_SECONDS = 60;
+
+  // A remote worker that takes this many times longer for a pass than the
+  // median pass (per camera ray) is presumed stalled: its tile goes to the
+  // other workers and its result is ignored if it comes after all.
+  static const double REMOTE_DEADLINE_FACTOR = 8;
+
+  // Seconds any pass may take, and a pass may take before any came back.
+  static const double REMOTE_MIN_DEADLINE = 2;
+  static const double REMOTE_FIRST_DEADLINE = 60;
+
+  // Most recent passes the median pass time is taken over.
+  static const size_t REMOTE_TIMED_PASSES = 255;
+
+  /**
+   * Sent by the coordinator to every remote worker that connects. Workers
+   * render the same scene file with the same options, but the image size
+   * and seed come from the coordinator.
+   */
+  struct RemoteHello {
+    char magic[8];            ///< "S3DDIST" followed by a zero
+    uint32_t version;         ///< REMOTE_PROTOCOL_VERSION
+    uint32_t spectrum_size;   ///< sizeof(Spectrum)
+    uint64_t width;           ///< width of the image
+    uint64_t height;          ///< height of the image
+    uint64_t random_seed;     ///< seed of the render
+  };
+
+  /**
+   * A pass over a tile, sent by the coordinator. The worker sends it back
+   * followed by the average of each pixel of the tile in the pass, row by
+   * row, as Spectrums.
+   */
+  struct RemoteJob {
+    uint32_t tile_x, tile_y;  ///< corner of the tile
+    uint32_t tile_w, tile_h;  ///< size of the tile
+    uint64_t first_sample;    ///< camera rays per pixel before this pass
+    uint64_t num_samples;     ///< camera rays per pixel, 0 if no more work
+  };
+
+  static const char REMOTE_MAGIC[8] = { 'S', '3', 'D', 'D', 'I', 'S', 'T', 0 };
+
+  void PathTracer::raytrace_tile_pass(int tile_x, int tile_y,
+      int tile_w, int tile_h, size_t first_sample, size_t num_samples,
+      vector<Spectrum>& pass) {
+
+    size_t w = sampleBuffer.w;
+    size_t h = sampleBuffer.h;
+    size_t x1 = std::min<size_t>(tile_x + tile_w, w);
+    size_t y1 = std::min<size_t>(tile_y + tile_h, h);
+
+    pass.clear();
+    for (size_t y = tile_y; y < y1; y++) {
+      for (size_t x = tile_x; x < x1; x++) {
+        // the same random numbers as raytrace_tile, so that a remote pass
+        // gives the same result as a local one
+        RNG rng(randomSeed + ((uint64_t) first_sample << 32), x + y * w);
+        pass.push_back(raytrace_pixel(x, y, num_samples, rng));
+      }
+    }
+  }
+
+  size_t PathTracer::add_remote_pass(const WorkItem& work, size_t first_sample,
+      size_t num_samples, const Spectrum* pass) {
+
+    size_t w = sampleBuffer.w;
+    size_t h = sampleBuffer.h;
+    size_t x0 = work.tile_x, x1 = std::min<size_t>(x0 + work.tile_w, w);
+    size_t y0 = work.tile_y, y1 = std::min<size_t>(y0 + work.tile_h, h);
+    size_t tile = x0 / imageTileSize + (y0 / imageTileSize) * num_tiles_w;
+    float weight = (float) num_samples / (first_sample + num_samples);
+
+    // odd while writing, as in raytrace_tile
+    std::atomic<uint32_t>& version = tileVersions[tile];
+    uint32_t v = version.load(std::memory_order_relaxed);
+    version.store(v + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    for (size_t y = y0; y < y1; y++) {
+      for (size_t x = x0; x < x1; x++) {
+        sampleBuffer.update_pixel(*pass++, x, y, weight);
+      }
+    }
+    tile_samples[tile] = first_sample + num_samples;
+    version.store(v + 2, std::memory_order_release);
+    sampleBuffer.toColor(frameBuffer, x0, y0, x1, y1);
+
+    size_t num_pixels = (x1 - x0) * (y1 - y0);
+    samplesTaken += num_samples * num_pixels;
+    return tile_finished(first_sample + num_samples) ? 0 : num_pixels;
+  }
+
+#ifndef _WIN32
+
+  static bool send_all(int socket, const void* data, size_t size) {
+#ifdef MSG_NOSIGNAL
+    int flags = MSG_NOSIGNAL;  // a worker that is gone is not fatal
+#else
+    int flags = 0;
+#endif
+    const char* p = (const char*) data;
+    while (size) {
+      ssize_t n = send(socket, p, size, flags);
+      if (n < 0 && errno == EINTR) continue;
+      if (n <= 0) return false;
+      p += n;
+      size -= n;
+    }
+    return true;
+  }
+
+  static bool recv_all(int socket, void* data, size_t size) {
+    char* p = (char*) data;
+    while (size) {
+      ssize_t n = recv(socket, p, size, 0);
+      if (n < 0 && errno == EINTR) continue;
+      if (n <= 0) return false;
+      p += n;
+      size -= n;
+    }
+    return true;
+  }
+
+  /**
+   * Send small messages right away, notice peers that vanished, and do not
+   * raise SIGPIPE for them where the platform needs a socket option.
+   */
+  static void configure_socket(int socket) {
+    int on = 1;
+    setsockopt(socket, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    setsockopt(socket, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on));
+#ifdef SO_NOSIGPIPE
+    setsockopt(socket, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+  }
+
+  /**
+   * Connect to host:port. Returns the socket, or -1.
+   */
+  static int connect_to(const string& address) {
+    size_t colon = address.rfind(':');
+    if (colon == string::npos) return -1;
+    string host = address.substr(0, colon);
+    string port = address.substr(colon + 1);
+
+    addrinfo hints, *addresses;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host.c_str(), port.c_str(), &hints, &addresses) != 0) {
+      return -1;
+    }
+    int s = -1;
+    for (addrinfo* a = addresses; a; a = a->ai_next) {
+      s = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+      if (s < 0) continue;
+      if (connect(s, a->ai_addr, a->ai_addrlen) == 0) break;
+      close(s);
+      s = -1;
+    }
+    freeaddrinfo(addresses);
+    if (s >= 0) configure_socket(s);
+    return s;
+  }
+
+  /**
+   * Connect to the coordinator, trying once a second for the given number of
+   * seconds, and check that it speaks our protocol. Returns the socket, or -1.
+   */
+  static int connect_to_coordinator(const string& address, RemoteHello* hello,
+                                    int wait_seconds = 0) {
+    int s = connect_to(address);
+    for (int i = 0; i < wait_seconds && s < 0; i++) {
+      sleep(1);
+      s = connect_to(address);
+    }
+    if (s < 0) {
+      fprintf(stderr, "[PathTracer] Cannot connect to coordinator %s\n",
+              address.c_str());
+      return -1;
+    }
+    if (!recv_all(s, hello, sizeof(*hello)) ||
+        memcmp(hello->magic, REMOTE_MAGIC, sizeof(hello->magic)) ||
+        hello->version != REMOTE_PROTOCOL_VERSION ||
+        hello->spectrum_size != sizeof(Spectrum)) {
+      fprintf(stderr, "[PathTracer] %s is not a compatible coordinator\n",
+              address.c_str());
+      close(s);
+      return -1;
+    }
+    return s;
+  }
+
+  bool PathTracer::listen_for_workers() {
+
+    if (listenSocket >= 0) return true;
+
+    int s = socket(AF_INET, SOCK_STREAM, 0);
+    int on = 1;
+    sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_ANY);
+    address.sin_port = htons(listenPort);
+    if (s < 0 ||
+        setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) != 0 ||
+        bind(s, (sockaddr*) &address, sizeof(address)) != 0 ||
+        listen(s, MAX_REMOTE_WORKERS) != 0) {
+      fprintf(stderr, "[PathTracer] Cannot listen for remote workers on "
+              "port %d, rendering locally\n", listenPort);
+      if (s >= 0) close(s);
+      return false;
+    }
+
+    listenSocket = s;
+    fprintf(stdout, "[PathTracer] Taking remote workers on port %d\n",
+            listenPort);
+    return true;
+  }
+
+  void PathTracer::coordinator_thread() {
+
+    Timer timer;
+    timer.start();
+
+    // A remote worker has the deque of workQueue after those of the worker
+    // threads, and renders one pass over a tile at a time.
+    struct Remote {
+      int socket;
+      bool busy;            ///< rendering the item below
+      bool late;            ///< past its deadline, the item was handed on
+      size_t index;         ///< item in workQueue
+      size_t first_sample;  ///< camera rays per pixel before the pass
+      size_t num_samples;   ///< camera rays per pixel in the pass
+      size_t num_rays;      ///< camera rays in the pass
+      Timer timer;          ///< started when the pass was sent
+    };
+    vector<Remote> remotes(MAX_REMOTE_WORKERS);
+    for (Remote& remote : remotes) {
+      remote.socket = -1;
+      remote.busy = false;
+      remote.late = false;
+    }
+
+    // seconds per camera ray of the latest passes that came back, and
+    // their median
+    vector<double> ray_times, sorted_times;
+    size_t num_timed = 0;
+    double median_ray_time = 0;
+
+    // Tiles that take more passes go back to the queue with the priority
+    // worker_thread gives them: under a time budget, fewest samples first.
+    auto put_back = [&](size_t r, size_t num_samples_tile) {
+      size_t slot = numWorkerThreads + r;
+      if (adaptiveTolerance <= 0 && timeBudget > 0) {
+        workQueue.put_back(slot, remotes[r].index, -(double) num_samples_tile);
+      } else {
+        workQueue.put_back(slot, remotes[r].index);
+      }
+    };
+
+    // A remote worker that fails hands its tiles back to the others.
+    auto drop = [&](size_t r) {
+      Remote& remote = remotes[r];
+      size_t slot = numWorkerThreads + r;
+      if (remote.busy && !remote.late) put_back(r, remote.first_sample);
+      workQueue.flush(slot);
+      close(remote.socket);
+      remote.socket = -1;
+      remote.busy = false;
+      remote.late = false;
+      fprintf(stderr, "[PathTracer] Lost remote worker %zu, handing its "
+              "tiles to the other workers\n", r);
+    };
+
+    vector<Spectrum> pass;
+    vector<pollfd> fds;
+    vector<size_t> polled;
+    while (continueRaytracing && workQueue.num_pending()) {
+
+      // hand out passes to the idle remote workers
+      for (size_t r = 0; r < remotes.size(); r++) {
+        Remote& remote = remotes[r];
+        size_t index;
+        if (remote.socket < 0 || remote.busy ||
+            !workQueue.try_get_work(numWorkerThreads + r, &index)) {
+          continue;
+        }
+        const WorkItem& work = workQueue.get_item(index);
+        size_t tile = work.tile_x / imageTileSize +
+                      (work.tile_y / imageTileSize) * num_tiles_w;
+        remote.index = index;
+        remote.first_sample = tile_samples[tile];
+        remote.num_samples = pass_samples(remote.first_sample);
+        if (!remote.num_samples) {
+          // ahead of the budget estimate, which may still grow, as in
+          // raytrace_tile
+          if (tile_finished(remote.first_sample)) {
+            workQueue.done();
+          } else {
+            put_back(r, remote.first_sample);
+          }
+          continue;
+        }
+        RemoteJob job = { (uint32_t) work.tile_x, (uint32_t) work.tile_y,
+                          (uint32_t) work.tile_w, (uint32_t) work.tile_h,
+                          remote.first_sample, remote.num_samples };
+        size_t x1 = std::min<size_t>(work.tile_x + work.tile_w, sampleBuffer.w);
+        size_t y1 = std::min<size_t>(work.tile_y + work.tile_h, sampleBuffer.h);
+        remote.num_rays = remote.num_samples *
+                          (x1 - work.tile_x) * (y1 - work.tile_y);
+        remote.busy = true;
+        remote.timer.start();
+        if (!send_all(remote.socket, &job, sizeof(job))) drop(r);
+      }
+
+      // hand the passes of stalled remote workers to the other workers
+      for (size_t r = 0; r < remotes.size(); r++) {
+        Remote& remote = remotes[r];
+        if (!remote.busy || remote.late) continue;
+        double deadline = REMOTE_FIRST_DEADLINE;
+        if (median_ray_time > 0) {
+          deadline = std::max(REMOTE_MIN_DEADLINE, REMOTE_DEADLINE_FACTOR *
+                              median_ray_time * remote.num_rays);
+        }
+        Timer now = remote.timer;
+        now.stop();
+        if (now.duration() < deadline) continue;
+        put_back(r, remote.first_sample);
+        workQueue.flush(numWorkerThreads + r);
+        remote.late = true;
+        fprintf(stderr, "[PathTracer] Remote worker %zu is late with its pass "
+                "(%.1fs), handing the tile to the other workers\n", r,
+                now.duration());
+      }
+
+      // wait for results and for new remote workers
+      fds.clear();
+      polled.clear();
+      pollfd listen_fd = { listenSocket, POLLIN, 0 };
+      fds.push_back(listen_fd);
+      for (size_t r = 0; r < remotes.size(); r++) {
+        if (!remotes[r].busy) continue;
+        pollfd fd = { remotes[r].socket, POLLIN, 0 };
+        fds.push_back(fd);
+        polled.push_back(r);
+      }
+      if (poll(&fds[0], fds.size(), COORDINATOR_POLL_MS) <= 0) continue;
+
+      for (size_t i = 1; i < fds.size(); i++) {
+        if (!fds[i].revents) continue;
+        size_t r = polled[i - 1];
+        Remote& remote = remotes[r];
+        const WorkItem& work = workQueue.get_item(remote.index);
+        size_t x1 = std::min<size_t>(work.tile_x + work.tile_w, sampleBuffer.w);
+        size_t y1 = std::min<size_t>(work.tile_y + work.tile_h, sampleBuffer.h);
+        pass.resize((x1 - work.tile_x) * (y1 - work.tile_y));
+
+        RemoteJob job;
+        if (!recv_all(remote.socket, &job, sizeof(job)) ||
+            job.tile_x != (uint32_t) work.tile_x ||
+            job.tile_y != (uint32_t) work.tile_y ||
+            job.first_sample != remote.first_sample ||
+            job.num_samples != remote.num_samples ||
+            !recv_all(remote.socket, &pass[0], pass.size() * sizeof(Spectrum))) {
+          drop(r);
+          continue;
+        }
+        remote.busy = false;
+        if (remote.late) {
+          // the tile went to another worker
+          remote.late = false;
+          continue;
+        }
+        remote.timer.stop();
+        double ray_time = remote.timer.duration() / remote.num_rays;
+        if (ray_times.size() < REMOTE_TIMED_PASSES) {
+          ray_times.push_back(ray_time);
+        } else {
+          ray_times[num_timed % REMOTE_TIMED_PASSES] = ray_time;
+        }
+        num_timed++;
+        sorted_times = ray_times;
+        std::nth_element(sorted_times.begin(),
+                         sorted_times.begin() + sorted_times.size() / 2,
+                         sorted_times.end());
+        median_ray_time = sorted_times[sorted_times.size() / 2];
+        if (add_remote_pass(work, remote.first_sample, remote.num_samples,
+                            &pass[0])) {
+          put_back(r, remote.first_sample + remote.num_samples);
+        } else {
+          workQueue.done();
+        }
+      }
+
+      if (fds[0].revents & POLLIN) {
+        int s = accept(listenSocket, NULL, NULL);
+        if (s < 0) continue;
+        size_t r = 0;
+        while (r < remotes.size() && remotes[r].socket >= 0) r++;
+        if (r == remotes.size()) {
+          fprintf(stderr, "[PathTracer] Turning away a remote worker, there "
+                  "are %zu already\n", remotes.size());
+          close(s);
+          continue;
+        }
+        configure_socket(s);
+        RemoteHello hello;
+        memset(&hello, 0, sizeof(hello));
+        memcpy(hello.magic, REMOTE_MAGIC, sizeof(hello.magic));
+        hello.version = REMOTE_PROTOCOL_VERSION;
+        hello.spectrum_size = sizeof(Spectrum);
+        hello.width = sampleBuffer.w;
+        hello.height = sampleBuffer.h;
+        hello.random_seed = randomSeed;
+        if (!send_all(s, &hello, sizeof(hello))) {
+          close(s);
+          continue;
+        }
+        remotes[r].socket = s;
+        fprintf(stdout, "[PathTracer] Remote worker %zu connected\n", r);
+      }
+    }
+
+    // the render is over: let the remote workers go
+    RemoteJob finished;
+    memset(&finished, 0, sizeof(finished));
+    for (Remote& remote : remotes) {
+      if (remote.socket < 0) continue;
+      if (!remote.busy) send_all(remote.socket, &finished, sizeof(finished));
+      close(remote.socket);
+    }
+
+    worker_done(timer);
+  }
+
+  bool PathTracer::connect_coordinator(const string& address,
+                                       size_t* width, size_t* height) {
+
+    // the coordinator may still be loading its scene
+    RemoteHello hello;
+    int s = connect_to_coordinator(address, &hello, COORDINATOR_WAIT_SECONDS);
+    if (s < 0) return false;
+
+    coordinatorAddress = address;
+    coordinatorSockets.assign(1, s);
+    randomSeed = hello.random_seed;
+    *width = hello.width;
+    *height = hello.height;
+    return true;
+  }
+
+  void PathTracer::serve_coordinator() {
+
+    if (state != READY || coordinatorSockets.empty()) return;
+
+    // one connection per worker thread, for the same render
+    for (size_t i = 1; i < numWorkerThreads; i++) {
+      RemoteHello hello;
+      int s = connect_to_coordinator(coordinatorAddress, &hello);
+      if (s < 0) break;
+      if (hello.width != sampleBuffer.w || hello.height != sampleBuffer.h ||
+          hello.random_seed != randomSeed) {
+        close(s);
+        break;
+      }
+      coordinatorSockets.push_back(s);
+    }
+
+    fprintf(stdout, "[PathTracer] Rendering for coordinator %s on %zu "
+            "threads... ", coordinatorAddress.c_str(),
+            coordinatorSockets.size());
+    fflush(stdout);
+    vector<std::thread> threads;
+    for (int s : coordinatorSockets) {
+      threads.push_back(std::thread(&PathTracer::remote_worker_thread, this, s));
+    }
+    for (std::thread& t : threads) t.join();
+    coordinatorSockets.clear();
+    fprintf(stdout, "Done!\n");
+  }
+
+  void PathTracer::remote_worker_thread(int socket) {
+
+    RemoteJob job;
+    vector<Spectrum> pass;
+    while (recv_all(socket, &job, sizeof(job)) && job.num_samples) {
+      raytrace_tile_pass(job.tile_x, job.tile_y, job.tile_w, job.tile_h,
+                         job.first_sample, job.num_samples, pass);
+      if (!send_all(socket, &job, sizeof(job)) ||
+          !send_all(socket, &pass[0], pass.size() * sizeof(Spectrum))) {
+        break;
+      }
+    }
+    close(socket);
+  }
+
+#else  // _WIN32
+
+  bool PathTracer::listen_for_workers() {
+    fprintf(stderr, "[PathTracer] Remote workers are not supported on this "
+            "platform, rendering locally\n");
+    return false;
+  }
+
+  void PathTracer::coordinator_thread() { }
+
+  bool PathTracer::connect_coordinator(const string& address,
+                                       size_t* width, size_t* height) {
+    fprintf(stderr, "[PathTracer] Remote workers are not supported on this "
+            "platform\n");
+    return false;
+  }
+
+  void PathTracer::serve_coordinator() { }
+
+  void PathTracer::remote_worker_thread(int socket) { }
+
+#endif  // _WIN32
+
+}  // namespace CMU462
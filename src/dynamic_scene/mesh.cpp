@@ -759,8 +759,6 @@ Matrix3x3 rotateMatrix(float ux, float uy, float uz, float theta) {
 }
 
 StaticScene::SceneObject *Mesh::get_transformed_static_object(double t) {
-  vector<Vector3D> originalPositions;
-
   Vector3D position = positions(t);
   Vector3D rotate = rotations(t);
   Vector3D scale = scales(t);
@@ -784,20 +782,46 @@ StaticScene::SceneObject *Mesh::get_transformed_static_object(double t) {
 
   Matrix4x4 transform = T * R_homogeneous * S;
 
+  // The object space positions only change if the vertices moved since the
+  // last frame, otherwise the object space mesh of that frame is reused.
+  vector<Vector3D> objectPositions;
   for (VertexIter v = mesh.verticesBegin(); v != mesh.verticesEnd(); v++) {
-    originalPositions.push_back(v->position);
-    Vector4D tmp = Vector4D(v->position + v->offset * v->normal(), 1.0);
-    v->position = (transform * tmp).to3D();
+    objectPositions.push_back(v->position + v->offset * v->normal());
   }
 
-  StaticScene::SceneObject *output = new StaticScene::Mesh(mesh, bsdf);
+  bool moved = instanceMesh == nullptr ||
+               objectPositions.size() != instancePositions.size();
+  for (size_t i = 0; !moved && i < objectPositions.size(); i++) {
+    moved = objectPositions[i].x != instancePositions[i].x ||
+            objectPositions[i].y != instancePositions[i].y ||
+            objectPositions[i].z != instancePositions[i].z;
+  }
 
-  int i = 0;
-  for (VertexIter v = mesh.verticesBegin(); v != mesh.verticesEnd(); v++) {
-    v->position = originalPositions[i++];
+  if (moved) {
+    vector<Vector3D> originalPositions;
+    int i = 0;
+    for (VertexIter v = mesh.verticesBegin(); v != mesh.verticesEnd(); v++) {
+      originalPositions.push_back(v->position);
+      v->position = objectPositions[i++];
+    }
+
+    // scenes of earlier frames may still be rendered with the last mesh,
+    // which their instances hold on to
+    instanceMesh.reset(new StaticScene::Mesh(mesh, bsdf));
+    instancePositions.swap(objectPositions);
+
+    i = 0;
+    for (VertexIter v = mesh.verticesBegin(); v != mesh.verticesEnd(); v++) {
+      v->position = originalPositions[i++];
+    }
   }
 
-  return output;
+  return new StaticScene::MeshInstance(instanceMesh, transform);
+}
+
+void Mesh::resetInstanceMesh() {
+  instanceMesh.reset();
+  instancePositions.clear();
 }
 
 } // namespace DynamicScene
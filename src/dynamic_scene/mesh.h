@@ -9,6 +9,9 @@
 #include "skeleton.h"
 
 #include <map>
+#include <memory>
+
+namespace CMU462 { namespace StaticScene { class Mesh; } }
 
 namespace CMU462 { namespace DynamicScene {
 
@@ -34,8 +37,22 @@ class Mesh : public SceneObject {
 
   void draw_pretty() override;
 
+  /**
+   * Returns an instance of the mesh, in object space, under its transform at
+   * time t. The object space mesh is reused by the following frames for as
+   * long as the vertices do not move relative to each other (e.g. by
+   * skinning or waves), so that rigid animations only need to update the
+   * instance transform.
+   */
   StaticScene::SceneObject *get_transformed_static_object(double t) override;
 
+  /**
+   * Forget the object space mesh kept for instancing. Must be called before
+   * the topology of the mesh is edited. The mesh is freed once the static
+   * scenes that instance it are.
+   */
+  void resetInstanceMesh();
+
   BBox get_bbox();
 
   virtual Info getInfo();
@@ -118,6 +135,11 @@ class Mesh : public SceneObject {
 
   // material
   BSDF* bsdf;
+
+  // object space mesh shared by the instances of successive frames, and the
+  // vertex positions it was built from
+  std::shared_ptr<const StaticScene::Mesh> instanceMesh;
+  vector<Vector3D> instancePositions;
 };
 
 } // namespace DynamicScene
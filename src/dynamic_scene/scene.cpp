@@ -97,7 +97,7 @@ void Scene::render_in_opengl()
    }
 }
 
-void Scene::render_splines_at(double time, bool pretty, bool useCapsuleRadius)
+void Scene::pose_at(double time, bool useCapsuleRadius)
 {
   // Update splines
   for (SceneObject *obj : objects)
@@ -116,7 +116,12 @@ void Scene::render_splines_at(double time, bool pretty, bool useCapsuleRadius)
       mesh->linearBlendSkinning(useCapsuleRadius);
     }
   }
-  
+}
+
+void Scene::render_splines_at(double time, bool pretty, bool useCapsuleRadius)
+{
+  pose_at(time, useCapsuleRadius);
+
   // draw the scene twice using alpha test
   for (SceneObject *obj : objects)
   {
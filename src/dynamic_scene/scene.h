@@ -229,6 +229,13 @@ class Scene {
    */
   void render_in_opengl();
 
+  /**
+   * Moves the objects to their positions at the given time, according to
+   * the splines specified in the animator, and skins the meshes. Makes no
+   * OpenGL calls.
+   */
+  void pose_at(double time, bool useCapsuleRadius);
+
   /**
    * Renders the scene at the given time in OpenGL, according to the
    * splines specified in the animator.
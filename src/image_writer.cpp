@@ -0,0 +1,335 @@
+#include "image_writer.h"
+
+#include "CMU462/lodepng.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+using namespace std;
+
+namespace CMU462 {
+
+  // Images queued per encoding thread at most, besides the one it encodes.
+  static const size_t QUEUED_PER_THREAD = 2;
+
+  // Filter type of the Paeth predictor in a png row.
+  static const unsigned char PNG_FILTER_PAETH = 4;
+
+  // OpenEXR pixel types and compression methods.
+  static const int32_t EXR_HALF = 1;
+  static const int32_t EXR_FLOAT = 2;
+  static const unsigned char EXR_NO_COMPRESSION = 0;
+  static const unsigned char EXR_ZIP_COMPRESSION = 3;
+
+  // Scanlines per block of a zip compressed OpenEXR file.
+  static const size_t EXR_ZIP_LINES = 16;
+
+  ImageWriter::ImageWriter(size_t num_threads, bool fast_compression,
+                           bool exr_half, bool exr_zip)
+    : fastCompression(fast_compression), exrHalf(exr_half), exrZip(exr_zip),
+      maxQueued(QUEUED_PER_THREAD * num_threads), numWriting(0),
+      stopping(false) {
+    for (size_t i = 0; i < num_threads; ++i) {
+      threads.push_back(std::thread(&ImageWriter::writer_thread, this));
+    }
+  }
+
+  ImageWriter::~ImageWriter() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stopping = true;
+    }
+    queued.notify_all();
+    for (std::thread& t : threads) t.join();
+  }
+
+  void ImageWriter::write_png(const string& filename, vector<uint32_t>&& pixels,
+                              size_t w, size_t h, bool flip) {
+
+    if (threads.empty()) {
+      encode_png(filename, pixels, w, h, flip, fastCompression);
+      return;
+    }
+
+    Job job;
+    job.filename = filename;
+    job.pixels.swap(pixels);
+    job.w = w;
+    job.h = h;
+    job.flip = flip;
+    push(job);
+  }
+
+  void ImageWriter::write_exr(const string& filename, vector<Spectrum>&& pixels,
+                              size_t w, size_t h, bool flip) {
+
+    if (threads.empty()) {
+      encode_exr(filename, &pixels[0], w, h, flip, exrHalf, exrZip);
+      return;
+    }
+
+    Job job;
+    job.filename = filename;
+    job.spectra.swap(pixels);
+    job.w = w;
+    job.h = h;
+    job.flip = flip;
+    push(job);
+  }
+
+  void ImageWriter::push(Job& job) {
+    std::unique_lock<std::mutex> lock(mutex);
+    written.wait(lock, [this] { return jobs.size() < maxQueued; });
+    jobs.push_back(std::move(job));
+    lock.unlock();
+    queued.notify_one();
+  }
+
+  void ImageWriter::wait() {
+    std::unique_lock<std::mutex> lock(mutex);
+    written.wait(lock, [this] { return jobs.empty() && !numWriting; });
+  }
+
+  void ImageWriter::writer_thread() {
+
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+      queued.wait(lock, [this] { return stopping || !jobs.empty(); });
+      // the queue is emptied before stopping, so no image is lost
+      if (jobs.empty()) break;
+      Job job = std::move(jobs.front());
+      jobs.pop_front();
+      numWriting++;
+      lock.unlock();
+      written.notify_all();
+
+      if (!job.spectra.empty()) {
+        encode_exr(job.filename, &job.spectra[0], job.w, job.h, job.flip,
+                   exrHalf, exrZip);
+      } else {
+        encode_png(job.filename, job.pixels, job.w, job.h, job.flip,
+                   fastCompression);
+      }
+
+      lock.lock();
+      numWriting--;
+      written.notify_all();
+    }
+  }
+
+  bool ImageWriter::encode_png(const string& filename, vector<uint32_t>& pixels,
+                               size_t w, size_t h, bool flip,
+                               bool fast_compression) {
+
+    // the pixels are ours, so flip them in place rather than in a copy
+    if (flip) {
+      for (size_t y = 0; y < h / 2; ++y) {
+        std::swap_ranges(pixels.begin() + y * w, pixels.begin() + (y + 1) * w,
+                         pixels.begin() + (h - y - 1) * w);
+      }
+    }
+
+    const unsigned char* in = (const unsigned char*) &pixels[0];
+    unsigned error;
+    if (fast_compression) {
+      // Picking the filter of every row and searching long LZ77 matches is
+      // what makes the default encoding slow. The Paeth filter on every row
+      // and a short search encode about twice as fast, and files grow by a
+      // few percent.
+      vector<unsigned char> filters(h, PNG_FILTER_PAETH);
+      lodepng::State state;
+      state.encoder.filter_palette_zero = 0;
+      state.encoder.filter_strategy = LFS_PREDEFINED;
+      state.encoder.predefined_filters = &filters[0];
+      state.encoder.zlibsettings.windowsize = 256;
+      state.encoder.zlibsettings.nicematch = 16;
+      state.encoder.zlibsettings.lazymatching = 0;
+      vector<unsigned char> png;
+      error = lodepng::encode(png, in, w, h, state);
+      if (!error) error = lodepng::save_file(png, filename);
+    } else {
+      error = lodepng::encode(filename, in, w, h);
+    }
+
+    if (error) {
+      fprintf(stderr, "[ImageWriter] Cannot write %s: %s\n", filename.c_str(),
+              lodepng_error_text(error));
+      return false;
+    }
+    return true;
+  }
+
+  /**
+   * Round a float to the nearest half float, as its bits.
+   */
+  static uint16_t float_to_half(float f) {
+
+    uint32_t x;
+    memcpy(&x, &f, sizeof(x));
+    uint32_t sign = (x >> 16) & 0x8000;
+    uint32_t abs = x & 0x7fffffff;
+
+    if (abs > 0x7f800000) return sign | 0x7e00;  // NaN
+    if (abs >= 0x47800000) return sign | 0x7c00;  // infinite or too large
+    if (abs < 0x38800000) {
+      // a denormal half: the mantissa with its leading one, shifted down
+      if (abs < 0x33000000) return sign;
+      uint32_t mantissa = (abs & 0x7fffff) | 0x800000;
+      uint32_t shift = 126 - (abs >> 23);
+      uint32_t half = mantissa >> shift;
+      uint32_t rest = mantissa & ((1u << shift) - 1);
+      uint32_t halfway = 1u << (shift - 1);
+      if (rest > halfway || (rest == halfway && (half & 1))) half++;
+      return sign | half;
+    }
+
+    // rebias the exponent and round the mantissa to 10 bits, to even
+    uint32_t half = (abs - 0x38000000) >> 13;
+    uint32_t rest = abs & 0x1fff;
+    if (rest > 0x1000 || (rest == 0x1000 && (half & 1))) half++;
+    return sign | half;
+  }
+
+  /**
+   * Append an attribute to an OpenEXR header.
+   */
+  static void exr_attribute(vector<unsigned char>& header, const char* name,
+                            const char* type, const void* value, size_t size) {
+    header.insert(header.end(), name, name + strlen(name) + 1);
+    header.insert(header.end(), type, type + strlen(type) + 1);
+    int32_t size32 = size;
+    const unsigned char* size_bytes = (const unsigned char*) &size32;
+    header.insert(header.end(), size_bytes, size_bytes + sizeof(size32));
+    const unsigned char* bytes = (const unsigned char*) value;
+    header.insert(header.end(), bytes, bytes + size);
+  }
+
+  bool ImageWriter::encode_exr(const string& filename, const Spectrum* pixels,
+                               size_t w, size_t h, bool flip, bool half,
+                               bool zip) {
+
+    // OpenEXR files are little endian, like the platforms we run on.
+    vector<unsigned char> header = { 0x76, 0x2f, 0x31, 0x01, 2, 0, 0, 0 };
+
+    // channels in alphabetical order, each a name, pixel type, linear flag,
+    // three reserved bytes and the sampling rates along x and y
+    vector<unsigned char> channels;
+    int32_t channel[4] = { half ? EXR_HALF : EXR_FLOAT, 0, 1, 1 };
+    for (const char* name : { "B", "G", "R" }) {
+      channels.insert(channels.end(), name, name + 2);
+      const unsigned char* bytes = (const unsigned char*) channel;
+      channels.insert(channels.end(), bytes, bytes + sizeof(channel));
+    }
+    channels.push_back(0);
+    exr_attribute(header, "channels", "chlist", &channels[0], channels.size());
+
+    unsigned char compression = zip ? EXR_ZIP_COMPRESSION : EXR_NO_COMPRESSION;
+    exr_attribute(header, "compression", "compression", &compression, 1);
+    int32_t window[4] = { 0, 0, (int32_t) w - 1, (int32_t) h - 1 };
+    exr_attribute(header, "dataWindow", "box2i", window, sizeof(window));
+    exr_attribute(header, "displayWindow", "box2i", window, sizeof(window));
+    unsigned char line_order = 0;  // increasing y
+    exr_attribute(header, "lineOrder", "lineOrder", &line_order, 1);
+    float aspect_ratio = 1, center[2] = { 0, 0 }, width = 1;
+    exr_attribute(header, "pixelAspectRatio", "float", &aspect_ratio,
+                  sizeof(aspect_ratio));
+    exr_attribute(header, "screenWindowCenter", "v2f", center, sizeof(center));
+    exr_attribute(header, "screenWindowWidth", "float", &width, sizeof(width));
+    header.push_back(0);
+
+    FILE* file = fopen(filename.c_str(), "wb");
+    if (!file) {
+      fprintf(stderr, "[ImageWriter] Cannot write %s\n", filename.c_str());
+      return false;
+    }
+
+    // The offset table of the blocks comes before them, so it is written
+    // once they are, and their offsets are known.
+    size_t block_lines = zip ? EXR_ZIP_LINES : 1;
+    size_t num_blocks = (h + block_lines - 1) / block_lines;
+    vector<uint64_t> offsets(num_blocks);
+    bool ok = fwrite(&header[0], 1, header.size(), file) == header.size() &&
+              fwrite(&offsets[0], sizeof(uint64_t), num_blocks, file) ==
+                num_blocks;
+
+    size_t value_size = half ? sizeof(uint16_t) : sizeof(float);
+    vector<unsigned char> block(block_lines * 3 * w * value_size);
+    vector<unsigned char> shuffled(block.size());
+    uint64_t offset = header.size() + num_blocks * sizeof(uint64_t);
+    for (size_t i = 0; ok && i < num_blocks; ++i) {
+
+      // scanlines of the block, each the blue, green and red values of all
+      // its pixels in turn
+      size_t y0 = i * block_lines, y1 = min(y0 + block_lines, h);
+      unsigned char* out = &block[0];
+      for (size_t y = y0; y < y1; ++y) {
+        const Spectrum* row = pixels + (flip ? h - y - 1 : y) * w;
+        for (int c = 0; c < 3; ++c) {
+          for (size_t x = 0; x < w; ++x) {
+            float v = c == 0 ? row[x].b : c == 1 ? row[x].g : row[x].r;
+            if (half) {
+              uint16_t bits = float_to_half(v);
+              memcpy(out, &bits, sizeof(bits));
+            } else {
+              memcpy(out, &v, sizeof(v));
+            }
+            out += value_size;
+          }
+        }
+      }
+      size_t size = out - &block[0];
+
+      // Zip compression deflates the block with its even bytes ahead of its
+      // odd ones, each byte stored as the difference to the one before.
+      // Blocks it does not make smaller are stored as they are.
+      const unsigned char* data = &block[0];
+      unsigned char* compressed = NULL;
+      size_t compressed_size = 0;
+      if (zip) {
+        unsigned char* even = &shuffled[0];
+        unsigned char* odd = &shuffled[(size + 1) / 2];
+        for (size_t k = 0; k < size; ++k) {
+          (k & 1 ? *odd++ : *even++) = block[k];
+        }
+        for (size_t k = size - 1; k > 0; --k) {
+          shuffled[k] = (unsigned char) (shuffled[k] - shuffled[k - 1] + 128);
+        }
+        if (!lodepng_zlib_compress(&compressed, &compressed_size,
+                                   &shuffled[0], size,
+                                   &lodepng_default_compress_settings) &&
+            compressed_size < size) {
+          data = compressed;
+          size = compressed_size;
+        }
+      }
+
+      int32_t chunk[2] = { (int32_t) y0, (int32_t) size };
+      ok = fwrite(chunk, sizeof(chunk), 1, file) == 1 &&
+           fwrite(data, 1, size, file) == size;
+      free(compressed);
+      offsets[i] = offset;
+      offset += sizeof(chunk) + size;
+    }
+
+    ok = ok && fseek(file, header.size(), SEEK_SET) == 0 &&
+         fwrite(&offsets[0], sizeof(uint64_t), num_blocks, file) == num_blocks;
+    ok = fclose(file) == 0 && ok;
+    if (!ok) {
+      fprintf(stderr, "[ImageWriter] Cannot write %s\n", filename.c_str());
+      remove(filename.c_str());
+    }
+    return ok;
+  }
+
+  bool ImageWriter::is_exr(const string& filename) {
+    size_t dot = filename.rfind('.');
+    if (dot == string::npos) return false;
+    string extension = filename.substr(dot + 1);
+    for (char& c : extension) c = tolower(c);
+    return extension == "exr";
+  }
+
+}  // namespace CMU462
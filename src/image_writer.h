@@ -0,0 +1,123 @@
+#ifndef CMU462_IMAGE_WRITER_H
+#define CMU462_IMAGE_WRITER_H
+
+#include <stdint.h>
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "CMU462/spectrum.h"
+
+namespace CMU462 {
+
+  /**
+   * Encodes images to png or OpenEXR files on a pool of background threads,
+   * so that the thread that renders an image does not wait for its
+   * compression. The queue of images waiting to be encoded is bounded:
+   * write_png and write_exr block while it is full, so a sequence of frames
+   * is written as fast as it is rendered, but never piles up in memory.
+   */
+  class ImageWriter {
+    public:
+
+      /**
+       * Start the given number of encoding threads. With none, images are
+       * encoded on the calling thread. Fast compression trades png file
+       * size for encoding time. OpenEXR files store half or float pixels,
+       * zip compressed or not.
+       */
+      ImageWriter(size_t num_threads = 2, bool fast_compression = false,
+                  bool exr_half = true, bool exr_zip = true);
+
+      /**
+       * Waits for all images to be written.
+       */
+      ~ImageWriter();
+
+      /**
+       * Queue an image for writing to a png file. Takes the pixels, RGBA
+       * with 8 bits per channel, over rather than copying them. With flip,
+       * the rows are stored bottom to top, as OpenGL reads them.
+       */
+      void write_png(const std::string& filename,
+                     std::vector<uint32_t>&& pixels, size_t w, size_t h,
+                     bool flip);
+
+      /**
+       * Queue a high dynamic range image for writing to an OpenEXR file, in
+       * the format given to the constructor. Takes the pixels over rather
+       * than copying them. With flip, the rows are stored bottom to top.
+       */
+      void write_exr(const std::string& filename,
+                     std::vector<Spectrum>&& pixels, size_t w, size_t h,
+                     bool flip);
+
+      /**
+       * Block until all images queued so far are written.
+       */
+      void wait();
+
+      /**
+       * Encode an image to a png file on the calling thread, flipping it in
+       * place if asked to. Returns whether the file was written.
+       */
+      static bool encode_png(const std::string& filename,
+                             std::vector<uint32_t>& pixels, size_t w, size_t h,
+                             bool flip, bool fast_compression);
+
+      /**
+       * Write an image to an OpenEXR file on the calling thread, with R, G
+       * and B channels of half or float pixels, zip compressed or not. The
+       * image is converted and written a block of scanlines at a time, so
+       * it is never copied as a whole. Returns whether the file was written.
+       */
+      static bool encode_exr(const std::string& filename,
+                             const Spectrum* pixels, size_t w, size_t h,
+                             bool flip, bool half, bool zip);
+
+      /**
+       * Whether a file name has the extension of OpenEXR files.
+       */
+      static bool is_exr(const std::string& filename);
+
+    private:
+
+      struct Job {
+        std::string filename;
+        std::vector<uint32_t> pixels;   ///< of a png file
+        std::vector<Spectrum> spectra;  ///< of an OpenEXR file
+        size_t w, h;
+        bool flip;
+      };
+
+      /**
+       * Queue a job, once there is room for it.
+       */
+      void push(Job& job);
+
+      /**
+       * Encode the queued images until the writer is destroyed.
+       */
+      void writer_thread();
+
+      bool fastCompression;           ///< compress png fast rather than small
+      bool exrHalf;                   ///< OpenEXR pixels are half, not float
+      bool exrZip;                    ///< OpenEXR files are zip compressed
+      size_t maxQueued;               ///< images queued at most
+      std::deque<Job> jobs;           ///< images waiting to be encoded
+      size_t numWriting;              ///< images being encoded
+      bool stopping;                  ///< the threads should exit
+      std::mutex mutex;               ///< guards the above
+      std::condition_variable queued; ///< an image was queued, or stopping
+      std::condition_variable written;  ///< an image left the queue or
+                                        ///< was written
+      std::vector<std::thread> threads;  ///< encoding threads
+  };
+
+}  // namespace CMU462
+
+#endif  // CMU462_IMAGE_WRITER_H
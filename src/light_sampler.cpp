@@ -0,0 +1,688 @@
+#include "light_sampler.h"
+
+#include "CMU462/timer.h"
+#include "bvh.h"
+#include "static_scene/light.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+
+namespace CMU462 { namespace StaticScene {
+
+  // Number of bins the centroids of the lights are sorted into along an axis
+  // when looking for the best split of a node of the light BVH.
+  static const size_t LIGHT_BVH_BINS = 12;
+
+  // Radius of the sphere around the scene bounds that lights infinitely
+  // far away count as lighting.
+  static double scene_radius(const BBox& bounds) {
+    return bounds.empty() ? 1 : bounds.extent.norm() / 2;
+  }
+
+  // Lights of the scene that emit anything.
+  static std::vector<SceneLight*> emitting(const std::vector<SceneLight*>& lights,
+                                           const BBox& sceneBounds) {
+    double radius = scene_radius(sceneBounds);
+    std::vector<SceneLight*> result;
+    for (SceneLight* light : lights) {
+      if (light->power(radius) > 0) result.push_back(light);
+    }
+    return result;
+  }
+
+  // Uniform Light Sampler //
+
+  UniformLightSampler::UniformLightSampler(const std::vector<SceneLight*>& lights,
+                                           const BBox& sceneBounds)
+      : lights(emitting(lights, sceneBounds)) { }
+
+  SceneLight* UniformLightSampler::sample(const Vector3D& p, const Vector3D& n,
+                                          double u, float* pmf) const {
+    if (lights.empty()) {
+      *pmf = 0;
+      return NULL;
+    }
+    *pmf = 1.f / lights.size();
+    return lights[std::min((size_t) (u * lights.size()), lights.size() - 1)];
+  }
+
+  float UniformLightSampler::pmf(const Vector3D& p, const Vector3D& n,
+                                 const SceneLight* light) const {
+    if (std::find(lights.begin(), lights.end(), light) == lights.end()) {
+      return 0;
+    }
+    return 1.f / lights.size();
+  }
+
+  // Power Light Sampler //
+
+  PowerLightSampler::PowerLightSampler(const std::vector<SceneLight*>& lights,
+                                       const BBox& sceneBounds)
+      : lights(emitting(lights, sceneBounds)) {
+    double radius = scene_radius(sceneBounds);
+    std::vector<float> powers;
+    for (size_t i = 0; i < this->lights.size(); ++i) {
+      powers.push_back(this->lights[i]->power(radius));
+      indices[this->lights[i]] = i;
+    }
+    table.build(powers);
+  }
+
+  SceneLight* PowerLightSampler::sample(const Vector3D& p, const Vector3D& n,
+                                        double u, float* pmf) const {
+    if (lights.empty()) {
+      *pmf = 0;
+      return NULL;
+    }
+    size_t i = table.sample(u);
+    *pmf = table.pmf(i);
+    return lights[i];
+  }
+
+  float PowerLightSampler::pmf(const Vector3D& p, const Vector3D& n,
+                               const SceneLight* light) const {
+    auto it = indices.find(light);
+    return it == indices.end() ? 0 : table.pmf(it->second);
+  }
+
+  // BVH Light Sampler //
+
+  // Bounds of the lights of two bounds: the union of their boxes, and a
+  // cone of axes around both of their cones.
+  static LightBounds union_bounds(const LightBounds& a, const LightBounds& b) {
+    if (a.power == 0) return b;
+    if (b.power == 0) return a;
+
+    LightBounds u;
+    u.bb = a.bb;
+    u.bb.expand(b.bb);
+    u.power = a.power + b.power;
+    u.cosTheta_e = std::min(a.cosTheta_e, b.cosTheta_e);
+
+    // Let a be the wider cone. If it already holds b, or b holds it, that is
+    // the union. Otherwise the union spans from the far side of a to the far
+    // side of b, and its axis is the axis of a turned towards b by the
+    // difference of its spread and the spread of a.
+    const LightBounds& wide = a.cosTheta_o <= b.cosTheta_o ? a : b;
+    const LightBounds& narrow = a.cosTheta_o <= b.cosTheta_o ? b : a;
+    double theta_w = acos(clamp(wide.cosTheta_o, -1.f, 1.f));
+    double theta_n = acos(clamp(narrow.cosTheta_o, -1.f, 1.f));
+    double theta_d = acos(clamp(dot(wide.axis, narrow.axis), -1.0, 1.0));
+    if (std::min(theta_d + theta_n, PI) <= theta_w) {
+      u.axis = wide.axis;
+      u.cosTheta_o = wide.cosTheta_o;
+      return u;
+    }
+    double theta_o = (theta_w + theta_d + theta_n) / 2;
+    Vector3D turn = cross(wide.axis, narrow.axis);
+    if (theta_o >= PI || turn.norm2() == 0) {
+      u.axis = wide.axis;
+      u.cosTheta_o = -1;
+      return u;
+    }
+    double theta_r = theta_o - theta_w;
+    turn.normalize();
+    u.axis = wide.axis * cos(theta_r) + cross(turn, wide.axis) * sin(theta_r);
+    u.cosTheta_o = cos(theta_o);
+    return u;
+  }
+
+  // cos(a - b), or 1 if a < b.
+  static double cos_sub_clamped(double sin_a, double cos_a,
+                                double sin_b, double cos_b) {
+    if (cos_a > cos_b) return 1;
+    return cos_a * cos_b + sin_a * sin_b;
+  }
+
+  // sin(a - b), or 0 if a < b.
+  static double sin_sub_clamped(double sin_a, double cos_a,
+                                double sin_b, double cos_b) {
+    if (cos_a > cos_b) return 0;
+    return sin_a * cos_b - cos_a * sin_b;
+  }
+
+  // An upper bound on how much of the power of the lights of the bounds
+  // reaches p, from an upper bound on the cos of the angle at which they
+  // can emit towards p, and on the cos of the angle to the normal n at p
+  // (if n is not zero) it can arrive at, divided by the squared distance.
+  // (Conty Estevez and Kulla 2018, as refined in pbrt-v4.)
+  static double importance(const LightBounds& b, const Vector3D& p,
+                           const Vector3D& n) {
+    Vector3D center = b.bb.centroid();
+    double radius2 = b.bb.extent.norm2() / 4;
+    Vector3D d = p - center;
+    double d2 = d.norm2();
+
+    // Angles are bounded by the cone of directions to p from within the
+    // sphere around the box, which is everything from inside it.
+    double cos_b = -1;
+    if (d2 > radius2) cos_b = sqrt(1 - radius2 / d2);
+    double sin_b = sqrt(std::max(0.0, 1 - cos_b * cos_b));
+    d2 = std::max(d2, radius2);
+    if (d2 == 0) return b.power;  // p is at a point light
+    Vector3D wi = d / sqrt(d.norm2() > 0 ? d.norm2() : 1);
+
+    // Angle between the axis and p, minus the spread of the axes and the
+    // spread of the directions to p, against the spread about an axis.
+    double cos_w = dot(b.axis, wi);
+    double sin_w = sqrt(std::max(0.0, 1 - cos_w * cos_w));
+    double sin_o = sqrt(std::max(0.0, 1 - (double) b.cosTheta_o * b.cosTheta_o));
+    double cos_x = cos_sub_clamped(sin_w, cos_w, sin_o, b.cosTheta_o);
+    double sin_x = sin_sub_clamped(sin_w, cos_w, sin_o, b.cosTheta_o);
+    double cos_p = cos_sub_clamped(sin_x, cos_x, sin_b, cos_b);
+    if (cos_p <= b.cosTheta_e) return 0;
+    double result = b.power * cos_p / d2;
+
+    if (n.norm2() > 0) {
+      // either side of the surface, since light may pass through it
+      double cos_i = fabs(dot(wi, n));
+      double sin_i = sqrt(std::max(0.0, 1 - cos_i * cos_i));
+      result *= cos_sub_clamped(sin_i, cos_i, sin_b, cos_b);
+    }
+    return std::max(result, 0.0);
+  }
+
+  // Measure of the directions the lights of the bounds emit in, for the cost
+  // of a split.
+  static double orientation_measure(const LightBounds& b) {
+    double theta_o = acos(clamp(b.cosTheta_o, -1.f, 1.f));
+    double theta_e = acos(clamp(b.cosTheta_e, -1.f, 1.f));
+    double theta_w = std::min(theta_o + theta_e, PI);
+    double sin_o = sin(theta_o);
+    return 2 * PI * (1 - cos(theta_o)) +
+           PI / 2 * (2 * theta_w * sin_o - cos(theta_o - 2 * theta_w) -
+                     2 * theta_o * sin_o + cos(theta_o));
+  }
+
+  // Cost of a child node with the given bounds: how often it is expected
+  // to be walked through, from how much power it has, in how many
+  // directions, over how much area.
+  static double split_cost(const LightBounds& b) {
+    if (b.power == 0) return 0;
+    return b.power * orientation_measure(b) * b.bb.surface_area();
+  }
+
+  BVHLightSampler::BVHLightSampler(const std::vector<SceneLight*>& lights,
+                                   const BBox& sceneBounds) {
+
+    std::vector<LightBounds> bounds;
+    for (SceneLight* light : emitting(lights, sceneBounds)) {
+      LightBounds b;
+      if (!light->get_bounds(&b)) {
+        infiniteLights.push_back(light);
+      } else if (b.power > 0) {
+        boundedLights.push_back(light);
+        bounds.push_back(b);
+      }
+    }
+    if (boundedLights.empty()) return;
+
+    std::vector<uint32_t> order(boundedLights.size());
+    for (size_t i = 0; i < order.size(); ++i) order[i] = i;
+    nodes.reserve(2 * order.size() - 1);
+    build(bounds, order, 0, order.size(), 0);
+  }
+
+  uint32_t BVHLightSampler::build(std::vector<LightBounds>& bounds,
+                                  std::vector<uint32_t>& order,
+                                  size_t start, size_t end, uint32_t parent) {
+
+    uint32_t index = nodes.size();
+    nodes.push_back(Node());
+    nodes[index].parent = parent;
+    if (end - start == 1) {
+      nodes[index].bounds = bounds[start];
+      nodes[index].index = order[start];
+      nodes[index].leaf = true;
+      leaves[boundedLights[order[start]]] = index;
+      return index;
+    }
+
+    LightBounds all = bounds[start];
+    BBox centroids(bounds[start].bb.centroid());
+    for (size_t i = start + 1; i < end; ++i) {
+      all = union_bounds(all, bounds[i]);
+      centroids.expand(bounds[i].bb.centroid());
+    }
+
+    // Bin the lights by their centroids along every axis, and split where
+    // the power, directions and area on both sides cost the least.
+    double best_cost = INF_D;
+    int best_axis = -1;
+    size_t best_bin = 0;
+    double max_extent = std::max(all.bb.extent.x,
+                                 std::max(all.bb.extent.y, all.bb.extent.z));
+    for (int axis = 0; axis < 3; ++axis) {
+      double lo = centroids.min[axis], extent = centroids.extent[axis];
+      if (extent <= 0) continue;
+      // Splits across the short sides of a long node are penalized, as
+      // their children still overlap along the long side.
+      double stretch = max_extent / all.bb.extent[axis];
+      LightBounds bins[LIGHT_BVH_BINS];
+      for (size_t b = 0; b < LIGHT_BVH_BINS; ++b) bins[b].power = 0;
+      for (size_t i = start; i < end; ++i) {
+        size_t b = std::min(LIGHT_BVH_BINS - 1, (size_t) (LIGHT_BVH_BINS *
+            (bounds[i].bb.centroid()[axis] - lo) / extent));
+        bins[b] = union_bounds(bins[b], bounds[i]);
+      }
+      for (size_t split = 1; split < LIGHT_BVH_BINS; ++split) {
+        LightBounds left, right;
+        left.power = right.power = 0;
+        for (size_t b = 0; b < split; ++b) left = union_bounds(left, bins[b]);
+        for (size_t b = split; b < LIGHT_BVH_BINS; ++b) {
+          right = union_bounds(right, bins[b]);
+        }
+        double cost = stretch * (split_cost(left) + split_cost(right));
+        if (cost < best_cost) {
+          best_cost = cost;
+          best_axis = axis;
+          best_bin = split;
+        }
+      }
+    }
+
+    size_t mid = start;
+    if (best_axis >= 0) {
+      double lo = centroids.min[best_axis];
+      double extent = centroids.extent[best_axis];
+      std::vector<LightBounds> sorted_bounds;
+      std::vector<uint32_t> sorted_order;
+      for (int side = 0; side < 2; ++side) {
+        for (size_t i = start; i < end; ++i) {
+          size_t b = std::min(LIGHT_BVH_BINS - 1, (size_t) (LIGHT_BVH_BINS *
+              (bounds[i].bb.centroid()[best_axis] - lo) / extent));
+          if ((b < best_bin) == (side == 0)) {
+            sorted_bounds.push_back(bounds[i]);
+            sorted_order.push_back(order[i]);
+          }
+        }
+        if (side == 0) mid = start + sorted_order.size();
+      }
+      std::copy(sorted_bounds.begin(), sorted_bounds.end(),
+                bounds.begin() + start);
+      std::copy(sorted_order.begin(), sorted_order.end(),
+                order.begin() + start);
+    }
+    if (mid == start || mid == end) {
+      // all centroids in one place: any split is as good
+      mid = (start + end) / 2;
+    }
+
+    build(bounds, order, start, mid, index);
+    uint32_t right = build(bounds, order, mid, end, index);
+    nodes[index].bounds = all;
+    nodes[index].index = right;
+    nodes[index].leaf = false;
+    return index;
+  }
+
+  SceneLight* BVHLightSampler::sample(const Vector3D& p, const Vector3D& n,
+                                      double u, float* pmf) const {
+
+    // every light infinitely far away is as likely as the whole tree
+    size_t num_infinite = infiniteLights.size();
+    double p_infinite = num_infinite ?
+        (double) num_infinite / (num_infinite + (nodes.empty() ? 0 : 1)) : 0;
+    if (u < p_infinite) {
+      size_t i = std::min((size_t) (u / p_infinite * num_infinite),
+                          num_infinite - 1);
+      *pmf = p_infinite / num_infinite;
+      return infiniteLights[i];
+    }
+    if (nodes.empty()) {
+      *pmf = 0;
+      return NULL;
+    }
+
+    // walk down the tree, reusing what is left of u for every choice
+    u = std::min((u - p_infinite) / (1 - p_infinite), 1 - 1e-12);
+    double node_pmf = 1 - p_infinite;
+    uint32_t index = 0;
+    while (!nodes[index].leaf) {
+      double left = importance(nodes[index + 1].bounds, p, n);
+      double right = importance(nodes[nodes[index].index].bounds, p, n);
+      if (left == 0 && right == 0) {
+        *pmf = 0;
+        return NULL;
+      }
+      double p_left = left / (left + right);
+      if (u < p_left) {
+        u = std::min(u / p_left, 1 - 1e-12);
+        node_pmf *= p_left;
+        index = index + 1;
+      } else {
+        u = std::min((u - p_left) / (1 - p_left), 1 - 1e-12);
+        node_pmf *= 1 - p_left;
+        index = nodes[index].index;
+      }
+    }
+    if (importance(nodes[index].bounds, p, n) == 0) {
+      *pmf = 0;
+      return NULL;
+    }
+    *pmf = node_pmf;
+    return boundedLights[nodes[index].index];
+  }
+
+  float BVHLightSampler::pmf(const Vector3D& p, const Vector3D& n,
+                             const SceneLight* light) const {
+
+    size_t num_infinite = infiniteLights.size();
+    double p_infinite = num_infinite ?
+        (double) num_infinite / (num_infinite + (nodes.empty() ? 0 : 1)) : 0;
+    auto it = leaves.find(light);
+    if (it == leaves.end()) {
+      bool infinite = std::find(infiniteLights.begin(), infiniteLights.end(),
+                                light) != infiniteLights.end();
+      return infinite ? p_infinite / num_infinite : 0;
+    }
+
+    // the choices on the way from the leaf up to the root
+    uint32_t index = it->second;
+    if (importance(nodes[index].bounds, p, n) == 0) return 0;
+    double result = 1 - p_infinite;
+    while (index != 0) {
+      uint32_t parent = nodes[index].parent;
+      double left = importance(nodes[parent + 1].bounds, p, n);
+      double right = importance(nodes[nodes[parent].index].bounds, p, n);
+      double mine = index == parent + 1 ? left : right;
+      if (mine == 0) return 0;
+      result *= mine / (left + right);
+      index = parent;
+    }
+    return result;
+  }
+
+  LightSampler* new_light_sampler(const std::string& name,
+                                  const std::vector<SceneLight*>& lights,
+                                  const BBox& sceneBounds) {
+    if (name == "uniform") return new UniformLightSampler(lights, sceneBounds);
+    if (name == "power") return new PowerLightSampler(lights, sceneBounds);
+    if (name == "bvh") return new BVHLightSampler(lights, sceneBounds);
+    return NULL;
+  }
+
+  // An axis aligned box that only blocks shadow rays, for the benchmark.
+  class Occluder : public Primitive {
+    public:
+      Occluder(const BBox& bb) : bb(bb) { }
+      BBox get_bbox() const { return bb; }
+      bool intersect(const Ray& r) const {
+        double t0 = r.min_t, t1 = r.max_t;
+        return bb.intersect(r, t0, t1);
+      }
+      bool intersect(const Ray& r, Intersection* i) const {
+        double t0 = r.min_t, t1 = std::min(r.max_t, i->t);
+        if (!bb.intersect(r, t0, t1)) return false;
+        i->t = t0;
+        i->primitive = this;
+        return true;
+      }
+      BSDF* get_bsdf() const { return NULL; }
+      void draw(const Color& c) const { }
+      void drawOutline(const Color& c) const { }
+    private:
+      BBox bb;
+  };
+
+  void benchmark_light_samplers() {
+
+    static const char* sampler_names[] = { "uniform", "power", "bvh" };
+    static const size_t num_lights = 500;
+    static const size_t num_occluders = 2000;
+    static const size_t num_points = 256;
+    static const size_t num_estimates = 1024;  // per point and sampler
+    static const size_t num_reference = 32;    // samples per light
+
+    // A 100x100 floor under lights of a wide range of sizes and brightness,
+    // facing down from heights of 2 to 10, with boxes standing on it.
+    RNG rng(1);
+    std::vector<SceneLight*> lights;
+    for (size_t i = 0; i < num_lights; ++i) {
+      Vector3D pos(100 * rng.next_double() - 50, 2 + 8 * rng.next_double(),
+                   100 * rng.next_double() - 50);
+      double size = 0.25 + 1.75 * rng.next_double();
+      double brightness = exp(4 * rng.next_double());
+      Spectrum rad(brightness, brightness * (0.5 + 0.5 * rng.next_double()),
+                   brightness * (0.5 + 0.5 * rng.next_double()));
+      lights.push_back(new AreaLight(rad, pos, Vector3D(0, -1, 0),
+                                     Vector3D(size, 0, 0),
+                                     Vector3D(0, 0, size)));
+    }
+    std::vector<Primitive*> occluders;
+    for (size_t i = 0; i < num_occluders; ++i) {
+      Vector3D base(100 * rng.next_double() - 50, 0,
+                    100 * rng.next_double() - 50);
+      Vector3D size(0.2 + rng.next_double(), 0.5 + 1.5 * rng.next_double(),
+                    0.2 + rng.next_double());
+      occluders.push_back(new Occluder(BBox(base, base + size)));
+    }
+    BVHAccel bvh(occluders);
+    BBox bounds(Vector3D(-50, 0, -50), Vector3D(50, 10, 50));
+    Vector3D n(0, 1, 0);
+    std::vector<Vector3D> points;
+    for (size_t i = 0; i < num_points; ++i) {
+      points.push_back(Vector3D(100 * rng.next_double() - 50, 0,
+                                100 * rng.next_double() - 50));
+    }
+
+    // Irradiance from a sample of one light, with its shadow ray.
+    auto estimate = [&n, &bvh](const SceneLight* light, const Vector3D& p,
+                               RNG& rng) {
+      Vector3D wi;
+      float dist, pdf;
+      Spectrum L = light->sample_L(p, &wi, &dist, &pdf, rng);
+      double cos_theta = dot(wi, n);
+      if (pdf <= 0 || cos_theta <= 0 || L.illum() == 0) return 0.0;
+      if (bvh.intersect(Ray(p + EPS_D * n, wi, dist - EPS_D))) return 0.0;
+      return L.illum() * cos_theta / pdf;
+    };
+
+    std::vector<double> reference(num_points);
+    double mean_reference = 0;
+    for (size_t i = 0; i < num_points; ++i) {
+      for (SceneLight* light : lights) {
+        for (size_t s = 0; s < num_reference; ++s) {
+          reference[i] += estimate(light, points[i], rng) / num_reference;
+        }
+      }
+      mean_reference += reference[i] / num_points;
+    }
+
+    printf("[LightSampler] Direct lighting of %zu points by %zu area lights, "
+           "among %zu boxes\n", num_points, num_lights, num_occluders);
+    printf("%10s  %10s  %11s  %13s  %10s\n", "sampler", "us/sample",
+           "rel. RMSE", "RMSE at 1 ms", "vs. all");
+
+    // RMSE of one estimate of a point, and of the average of the estimates
+    // that fit in 1 ms, relative to the mean irradiance of the points.
+    double all_rmse_ms = 0;
+    for (int s = -1; s < 3; ++s) {
+      LightSampler* sampler = s < 0 ? NULL :
+          new_light_sampler(sampler_names[s], lights, bounds);
+      size_t count = s < 0 ? num_estimates / 64 : num_estimates;
+      double sum_sq = 0;
+      Timer timer;
+      timer.start();
+      for (size_t i = 0; i < num_points; ++i) {
+        const Vector3D& p = points[i];
+        for (size_t k = 0; k < count; ++k) {
+          double value = 0;
+          if (!sampler) {
+            for (SceneLight* light : lights) value += estimate(light, p, rng);
+          } else {
+            float pmf;
+            SceneLight* light = sampler->sample(p, n, rng.next_double(), &pmf);
+            if (light) value = estimate(light, p, rng) / pmf;
+          }
+          double error = (value - reference[i]) / mean_reference;
+          sum_sq += error * error;
+        }
+      }
+      timer.stop();
+      double rmse = sqrt(sum_sq / (num_points * count));
+      double us = timer.duration() * 1e6 / (num_points * count);
+      double rmse_ms = rmse * sqrt(us / 1000);
+      if (s < 0) all_rmse_ms = rmse_ms;
+      double efficiency = (all_rmse_ms * all_rmse_ms) / (rmse_ms * rmse_ms);
+      printf("%10s  %10.3f  %11.4f  %13.5f  %9.2fx\n",
+             s < 0 ? "all lights" : sampler_names[s], us, rmse, rmse_ms,
+             efficiency);
+      delete sampler;
+    }
+    printf("vs. all: how many times less time the same noise takes\n");
+
+    for (SceneLight* light : lights) delete light;
+    for (Primitive* occluder : occluders) delete occluder;
+  }
+
+  bool check_light_samplers() {
+
+    static const char* sampler_names[] = { "uniform", "power", "bvh" };
+    static const size_t num_area_lights = 40;
+    static const size_t num_point_lights = 20;
+    static const size_t num_points = 64;
+    static const size_t num_picks = 100000;  // per point and sampler
+
+    // Lights of all kinds scattered through a 20x20x20 box, facing every
+    // way, with one that emits nothing and lights infinitely far away.
+    RNG rng(1);
+    auto random_point = [&rng]() {
+      return Vector3D(20 * rng.next_double() - 10, 20 * rng.next_double() - 10,
+                      20 * rng.next_double() - 10);
+    };
+    auto random_dir = [&rng]() {
+      double z = 1 - 2 * rng.next_double(), phi = 2 * PI * rng.next_double();
+      double r = sqrt(std::max(0.0, 1 - z * z));
+      return Vector3D(r * cos(phi), r * sin(phi), z);
+    };
+    std::vector<SceneLight*> lights;
+    for (size_t i = 0; i < num_area_lights; ++i) {
+      Vector3D dir = random_dir();
+      Vector3D dim_x = cross(dir, random_dir()).unit() *
+                       (0.25 + 2 * rng.next_double());
+      Vector3D dim_y = cross(dir, dim_x).unit() *
+                       (0.25 + 2 * rng.next_double());
+      double brightness = exp(4 * rng.next_double());
+      lights.push_back(new AreaLight(Spectrum(brightness, brightness,
+                                              brightness),
+                                     random_point(), dir, dim_x, dim_y));
+    }
+    for (size_t i = 0; i < num_point_lights; ++i) {
+      double brightness = exp(4 * rng.next_double());
+      lights.push_back(new PointLight(Spectrum(brightness, brightness,
+                                               brightness), random_point()));
+    }
+    lights.push_back(new SpotLight(Spectrum(10, 10, 10), random_point(),
+                                   random_dir(), PI / 4));
+    lights.push_back(new DirectionalLight(Spectrum(1, 1, 1), random_dir()));
+    SceneLight* dark = new AreaLight(Spectrum(), random_point(), random_dir(),
+                                     Vector3D(1, 0, 0), Vector3D(0, 1, 0));
+    lights.push_back(dark);
+    BBox bounds(Vector3D(-10, -10, -10), Vector3D(10, 10, 10));
+
+    // shading points inside the box and around it
+    std::vector<Vector3D> points, normals;
+    for (size_t i = 0; i < num_points; ++i) {
+      points.push_back(random_point() * (i % 4 ? 1 : 2));
+      normals.push_back(random_dir());
+    }
+
+    struct Check {
+      const char* sampler;
+      const char* property;
+      size_t failures;
+    };
+    std::vector<Check> checks;
+    std::vector<size_t> picks(lights.size());
+    for (const char* name : sampler_names) {
+      LightSampler* sampler = new_light_sampler(name, lights, bounds);
+      Check sums = { name, "pmfs sum to 1 - P(NULL)", 0 };
+      Check returned = { name, "sample returns the pmf", 0 };
+      Check darks = { name, "dark light never picked", 0 };
+      Check frequencies = { name, "picked as often as pmf", 0 };
+      Check unreached = { name, "pmf 0 only if unlit", 0 };
+      for (size_t i = 0; i < num_points; ++i) {
+        const Vector3D& p = points[i];
+        const Vector3D& n = normals[i];
+        std::vector<double> pmfs;
+        double sum = 0;
+        for (SceneLight* light : lights) {
+          pmfs.push_back(sampler->pmf(p, n, light));
+          sum += pmfs.back();
+        }
+        if (pmfs.back() != 0) darks.failures++;
+
+        std::fill(picks.begin(), picks.end(), 0);
+        size_t nulls = 0;
+        bool returned_ok = true, dark_ok = true;
+        for (size_t k = 0; k < num_picks; ++k) {
+          float pmf;
+          SceneLight* light = sampler->sample(p, n, rng.next_double(), &pmf);
+          if (!light) {
+            nulls++;
+            continue;
+          }
+          size_t l = std::find(lights.begin(), lights.end(), light) -
+                     lights.begin();
+          picks[l]++;
+          if (fabs(pmf - pmfs[l]) > 1e-4 * pmfs[l]) returned_ok = false;
+          if (light == dark) dark_ok = false;
+        }
+        if (!returned_ok) returned.failures++;
+        if (!dark_ok) darks.failures++;
+
+        // The counts are binomial, so allow 5 standard deviations. The BVH
+        // may walk into a node whose lights all face away from p and pick
+        // none, which is as likely as the pmfs fall short of 1.
+        auto unlikely = [](size_t count, double probability) {
+          double expected = probability * num_picks;
+          double sigma = sqrt(expected * std::max(0.0, 1 - probability));
+          return fabs(count - expected) > 5 * sigma + 1;
+        };
+        if (sum > 1 + 1e-4 || unlikely(nulls, 1 - sum)) sums.failures++;
+        bool frequencies_ok = true;
+        for (size_t l = 0; l < lights.size(); ++l) {
+          if (unlikely(picks[l], pmfs[l])) frequencies_ok = false;
+        }
+        if (!frequencies_ok) frequencies.failures++;
+
+        // lights that are never picked must not light p
+        bool unreached_ok = true;
+        for (size_t l = 0; l < lights.size(); ++l) {
+          if (pmfs[l] != 0) continue;
+          for (size_t k = 0; k < 16; ++k) {
+            Vector3D wi;
+            float dist, pdf;
+            Spectrum L = lights[l]->sample_L(p, &wi, &dist, &pdf, rng);
+            if (pdf > 0 && L.illum() > 0 && dot(wi, n) > 0) {
+              unreached_ok = false;
+            }
+          }
+        }
+        if (!unreached_ok) unreached.failures++;
+      }
+      checks.insert(checks.end(),
+                    { sums, returned, darks, frequencies, unreached });
+      delete sampler;
+    }
+
+    printf("[LightSampler] Probabilities of the light samplers (%zu lights, "
+           "%zu points, %zu picks per point)\n", lights.size(), num_points,
+           num_picks);
+    printf("%10s %26s %9s\n", "sampler", "property", "failures");
+    bool ok = true;
+    for (const Check& check : checks) {
+      printf("%10s %26s %9zu\n", check.sampler, check.property,
+             check.failures);
+      if (check.failures) ok = false;
+    }
+    printf(ok ? "All light sampler pmfs match\n" : "LIGHT SAMPLER FAILURES FOUND\n");
+
+    for (SceneLight* light : lights) delete light;
+    return ok;
+  }
+
+} // namespace StaticScene
+} // namespace CMU462
@@ -0,0 +1,169 @@
+#ifndef CMU462_LIGHT_SAMPLER_H
+#define CMU462_LIGHT_SAMPLER_H
+
+#include "sampler.h"
+#include "static_scene/scene.h"
+
+#include <stdint.h>
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace CMU462 { namespace StaticScene {
+
+  /**
+   * Picks one of the lights of a scene to sample for a shading point, so
+   * that direct lighting takes a shadow ray per sample rather than one per
+   * light. The contribution of a light picked with probability pmf, divided
+   * by pmf, estimates the contribution of all lights. Lights that emit
+   * nothing are never picked.
+   */
+  class LightSampler {
+    public:
+
+      /**
+       * Virtual destructor.
+       */
+      virtual ~LightSampler() { }
+
+      /**
+       * Pick a light for point p with surface normal n, with a uniform random
+       * number in [0, 1), and store the probability it was picked with.
+       * Returns NULL if no light reaches p.
+       */
+      virtual SceneLight* sample(const Vector3D& p, const Vector3D& n,
+                                 double u, float* pmf) const = 0;
+
+      /**
+       * Probability of sample picking the given light for p and n.
+       */
+      virtual float pmf(const Vector3D& p, const Vector3D& n,
+                        const SceneLight* light) const = 0;
+
+  }; // class LightSampler
+
+  /**
+   * A LightSampler that picks every light equally likely.
+   */
+  class UniformLightSampler : public LightSampler {
+    public:
+
+      UniformLightSampler(const std::vector<SceneLight*>& lights,
+                          const BBox& sceneBounds);
+
+      SceneLight* sample(const Vector3D& p, const Vector3D& n, double u,
+                         float* pmf) const;
+      float pmf(const Vector3D& p, const Vector3D& n,
+                const SceneLight* light) const;
+
+    private:
+      std::vector<SceneLight*> lights;  ///< lights that emit anything
+
+  }; // class UniformLightSampler
+
+  /**
+   * A LightSampler that picks lights in proportion to their power, from an
+   * alias table, regardless of where they are.
+   */
+  class PowerLightSampler : public LightSampler {
+    public:
+
+      PowerLightSampler(const std::vector<SceneLight*>& lights,
+                        const BBox& sceneBounds);
+
+      SceneLight* sample(const Vector3D& p, const Vector3D& n, double u,
+                         float* pmf) const;
+      float pmf(const Vector3D& p, const Vector3D& n,
+                const SceneLight* light) const;
+
+    private:
+      std::vector<SceneLight*> lights;  ///< lights that emit anything
+      AliasTable table;                 ///< picks one of lights
+      std::unordered_map<const SceneLight*, size_t> indices;  ///< in lights
+
+  }; // class PowerLightSampler
+
+  /**
+   * A LightSampler that picks lights in proportion to an estimate of how
+   * much of their power reaches a point, given their distance to it and the
+   * directions they emit in. The lights are the leaves of a BVH whose nodes
+   * bound the lights below them, and sampling walks down from the root,
+   * picking a child by the estimate for its bounds. Lights infinitely far
+   * away have no bounds, so they are picked uniformly instead, each as
+   * likely as the whole tree. The walk may end in a node whose lights all
+   * face away from the point, although the node as a whole does not, and
+   * then picks none: the pmfs of the lights sum to less than 1 there.
+   */
+  class BVHLightSampler : public LightSampler {
+    public:
+
+      BVHLightSampler(const std::vector<SceneLight*>& lights,
+                      const BBox& sceneBounds);
+
+      SceneLight* sample(const Vector3D& p, const Vector3D& n, double u,
+                         float* pmf) const;
+      float pmf(const Vector3D& p, const Vector3D& n,
+                const SceneLight* light) const;
+
+    private:
+
+      /**
+       * A node of the tree, in depth first order like LinearBVHNode: the
+       * left child of an interior node follows it.
+       */
+      struct Node {
+        LightBounds bounds;  ///< of all lights below the node
+        uint32_t index;      ///< of the right child, or of the light if leaf
+        uint32_t parent;     ///< index of the parent node
+        bool leaf;           ///< the node holds a single light
+      };
+
+      /**
+       * Build the subtree over the given lights, with bounds[i] the bounds
+       * of light order[i]. Returns the index of its root.
+       */
+      uint32_t build(std::vector<LightBounds>& bounds,
+                     std::vector<uint32_t>& order, size_t start, size_t end,
+                     uint32_t parent);
+
+      std::vector<SceneLight*> infiniteLights;  ///< lights without bounds
+      std::vector<SceneLight*> boundedLights;   ///< the leaves of the tree
+      std::vector<Node> nodes;                  ///< the tree
+      std::unordered_map<const SceneLight*, uint32_t> leaves;  ///< node of a
+                                                               ///< light
+
+  }; // class BVHLightSampler
+
+  /**
+   * Create the light sampler with the given name (uniform, power or bvh)
+   * for the given lights. Lights infinitely far away count as lighting a
+   * sphere around the scene bounds. Returns NULL for an unknown name.
+   */
+  LightSampler* new_light_sampler(const std::string& name,
+                                  const std::vector<SceneLight*>& lights,
+                                  const BBox& sceneBounds);
+
+  /**
+   * Measure the noise of direct lighting estimates, against the time they
+   * take, with one light picked by every light sampler and with all lights
+   * sampled, in a scene of 500 area lights of many sizes and brightnesses,
+   * and print a table of the results to stdout.
+   */
+  void benchmark_light_samplers();
+
+  /**
+   * Check the probabilities of every light sampler, for points all over a
+   * scene of area, point, spot and directional lights: that sample returns
+   * the pmf of the light it picks, that the lights are picked as often as
+   * their pmfs say, that the pmfs sum to 1 less the chance of picking no
+   * light, and that lights which are never picked do not light the point.
+   * Prints a table of the failures to stdout and returns true if there are
+   * none.
+   */
+  bool check_light_samplers();
+
+} // namespace StaticScene
+} // namespace CMU462
+
+#endif // CMU462_LIGHT_SAMPLER_H
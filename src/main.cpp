@@ -5,7 +5,11 @@
 #include "CMU462/tinyexr.h"
 
 #include "application.h"
+#include "bvh.h"
 #include "image.h"
+#include "work_queue.h"
+#include "sampler.h"
+#include "light_sampler.h"
 
 #include <iostream>
 
@@ -24,11 +28,62 @@ void usage(const char* binaryName) {
   printf("Usage: %s [options] <scenefile>\n", binaryName);
   printf("Program Options:\n");
   printf("  -s  <INT>        Number of camera rays per pixel\n");
+  printf("  -p  <INT>        Render progressively, in passes of this many\n"
+         "                   camera rays per pixel\n");
+  printf("  -a  <FLOAT>      Stop sampling a pixel once its 95%% confidence\n"
+         "                   interval is within this fraction of its value\n");
+  printf("  -g  <PATH>       Save a heatmap of the samples per pixel to PATH\n");
+  printf("  -z  <INT>        Seed of the random numbers of the render\n");
+  printf("  -u  <NAME>       Sampler of the camera rays in a pixel: random,\n"
+         "                   stratified, halton or sobol\n");
+  printf("  -y  <NAME>       How to pick the light of a shadow ray: uniform,\n"
+         "                   power (default) or bvh (by power, distance and\n"
+         "                   orientation)\n");
+  printf("  -E  <NAME>       Path tracing engine: recursive (default), or\n"
+         "                   wavefront, which traces the rays of a tile in\n"
+         "                   batches, a stage at a time\n");
+  printf("  -P               Trace camera and shadow rays one at a time,\n"
+         "                   rather than coherent ones in packets\n");
+  printf("  -d  <FLOAT>      Time budget of the render in seconds: take as\n"
+         "                   many camera rays per pixel as fit in it, up to\n"
+         "                   the number given with -s\n");
   printf("  -l  <INT>        Number of samples per area light\n");
   printf("  -t  <INT>        Number of render threads\n");
+  printf("  -b  <INT>        BVH branching factor (2, 4 or 8)\n");
+  printf("  -r  <FLOAT>      Rebuild the BVH of a video frame when refitting\n"
+         "                   degrades its SAH cost by more than this factor\n");
+  printf("  -c  <PATH>       Directory to cache BVHs in between runs\n");
   printf("  -m  <INT>        Maximum ray depth\n");
   printf("  -e  <PATH>       Path to environment map\n");
-  printf("  -h               Print this help message\n");
+  printf("  -k  <PATH>       Save checkpoints of the render to PATH\n");
+  printf("  -i  <FLOAT>      Seconds between checkpoints (default 60)\n");
+  printf("  --resume         Continue the render saved in the checkpoint\n");
+  printf("  -L  <PORT>       Take remote workers on PORT, and hand them passes\n"
+         "                   over tiles of the render\n");
+  printf("  -C  <HOST:PORT>  Render the passes of the coordinator at\n"
+         "                   HOST:PORT (started with -L) without opening a\n"
+         "                   window, then exit. Give the same scene and\n"
+         "                   render options as to the coordinator\n");
+  printf("  -o  <PATH>       Render the scene to PATH without opening a window,\n"
+         "                   as OpenEXR if PATH ends in .exr, else as png\n");
+  printf("  -V  <INT>        Render this many frames of the animation to\n"
+         "                   Video_<time>_<frame>.png without opening a window\n");
+  printf("  -w  <INT>        Width of the image rendered with -o or -V\n");
+  printf("  -h  <INT>        Height of the image rendered with -o or -V\n");
+  printf("  -W  <INT>        Number of threads that write png files in the\n"
+         "                   background (default 2, 0 to write them while\n"
+         "                   rendering)\n");
+  printf("  -f               Compress png files faster, but less\n");
+  printf("  -x  <TYPE>       Pixel type of OpenEXR files: half (default) or\n"
+         "                   float\n");
+  printf("  -X               Store OpenEXR files without zip compression\n");
+  printf("  -q  <NAME>       Run a benchmark and exit: queue (tile scheduler),\n"
+         "                   rng (random sampling), convergence (pixel\n"
+         "                   samplers) or lights (light samplers); or a\n"
+         "                   check, exiting with 1 if it fails: triangles\n"
+         "                   (single precision triangle test), strata\n"
+         "                   (stratification of the pixel samplers) or\n"
+         "                   lightpdf (probabilities of the light samplers)\n");
   printf("\n");
 }
 
@@ -75,31 +130,170 @@ int main( int argc, char** argv ) {
 
   // get the options
   AppConfig config; int opt;
-  while ( (opt = getopt(argc, argv, "s:l:t:m:e:h")) != -1 ) {  // for each option...
+
+  // getopt only knows short options, so take out the long ones first
+  int num_args = 0;
+  for (int i = 0; i < argc; i++) {
+    if (!strcmp(argv[i], "--resume")) {
+      config.pathtracer_resume = true;
+    } else {
+      argv[num_args++] = argv[i];
+    }
+  }
+  argc = num_args;
+
+  string outputPath;
+  string coordinatorAddress;
+  size_t videoFrames = 0;
+  size_t outputW = 960, outputH = 640;
+  while ( (opt = getopt(argc, argv, "s:p:a:g:z:u:y:E:Pd:k:i:L:C:l:t:b:r:c:m:e:o:V:w:h:W:fx:Xq:")) != -1 ) {  // for each option...
     switch ( opt ) {
       case 's':
         config.pathtracer_ns_aa = atoi(optarg);
         break;
+      case 'p':
+        config.pathtracer_samples_per_pass = atoi(optarg);
+        break;
+      case 'a':
+        config.pathtracer_adaptive_tolerance = atof(optarg);
+        break;
+      case 'g':
+        config.pathtracer_sample_heatmap = optarg;
+        break;
+      case 'z':
+        config.pathtracer_random_seed = strtoull(optarg, NULL, 10);
+        break;
+      case 'u': {
+        PixelSampler2D* sampler = new_pixel_sampler(optarg);
+        if (!sampler) {
+          usage(argv[0]);
+          return 1;
+        }
+        delete sampler;
+        config.pathtracer_pixel_sampler = optarg;
+        break;
+      }
+      case 'y': {
+        std::vector<StaticScene::SceneLight*> no_lights;
+        StaticScene::LightSampler* sampler =
+            StaticScene::new_light_sampler(optarg, no_lights, BBox());
+        if (!sampler) {
+          usage(argv[0]);
+          return 1;
+        }
+        delete sampler;
+        config.pathtracer_light_sampler = optarg;
+        break;
+      }
+      case 'E':
+        if (!strcmp(optarg, "recursive")) {
+          config.pathtracer_wavefront = false;
+        } else if (!strcmp(optarg, "wavefront")) {
+          config.pathtracer_wavefront = true;
+        } else {
+          usage(argv[0]);
+          return 1;
+        }
+        break;
+      case 'P':
+        config.pathtracer_ray_packets = false;
+        break;
+      case 'd':
+        config.pathtracer_time_budget = atof(optarg);
+        break;
+      case 'k':
+        config.pathtracer_checkpoint = optarg;
+        break;
+      case 'i':
+        config.pathtracer_checkpoint_interval = atof(optarg);
+        break;
+      case 'L':
+        config.pathtracer_listen_port = atoi(optarg);
+        break;
+      case 'C':
+        coordinatorAddress = optarg;
+        break;
       case 'l':
         config.pathtracer_ns_area_light = atoi(optarg);
         break;
       case 't':
         config.pathtracer_num_threads = atoi(optarg);
         break;
+      case 'b':
+        config.pathtracer_bvh_width = atoi(optarg);
+        break;
+      case 'r':
+        config.pathtracer_bvh_refit_ratio = atof(optarg);
+        break;
+      case 'c':
+        config.pathtracer_bvh_cache_dir = optarg;
+        break;
       case 'm':
         config.pathtracer_max_ray_depth = atoi(optarg);
         break;
       case 'e':
         config.pathtracer_envmap = load_exr(optarg);
         break;
+      case 'o':
+        outputPath = optarg;
+        break;
+      case 'V':
+        videoFrames = atoi(optarg);
+        break;
+      case 'w':
+        outputW = atoi(optarg);
+        break;
+      case 'h':
+        outputH = atoi(optarg);
+        break;
+      case 'W':
+        config.image_writer_threads = atoi(optarg);
+        break;
+      case 'f':
+        config.image_fast_compression = true;
+        break;
+      case 'x':
+        if (!strcmp(optarg, "half")) {
+          config.image_exr_half = true;
+        } else if (!strcmp(optarg, "float")) {
+          config.image_exr_half = false;
+        } else {
+          usage(argv[0]);
+          return 1;
+        }
+        break;
+      case 'X':
+        config.image_exr_zip = false;
+        break;
+      case 'q':
+        if (!strcmp(optarg, "queue")) {
+          benchmark_work_queue();
+        } else if (!strcmp(optarg, "rng")) {
+          benchmark_samplers();
+        } else if (!strcmp(optarg, "convergence")) {
+          benchmark_sampler_convergence();
+        } else if (!strcmp(optarg, "lights")) {
+          StaticScene::benchmark_light_samplers();
+        } else if (!strcmp(optarg, "triangles")) {
+          return StaticScene::check_triangle_leaves() ? 0 : 1;
+        } else if (!strcmp(optarg, "strata")) {
+          return check_pixel_samplers() ? 0 : 1;
+        } else if (!strcmp(optarg, "lightpdf")) {
+          return StaticScene::check_light_samplers() ? 0 : 1;
+        } else {
+          usage(argv[0]);
+          return 1;
+        }
+        return 0;
       default:
         usage(argv[0]);
         return 1;
     }
   }
 
-  // print usage if no argument given
-  if (optind >= argc) {
+  // print usage if no argument given, or nothing to resume
+  if (optind >= argc ||
+      (config.pathtracer_resume && config.pathtracer_checkpoint.empty())) {
     usage(argv[0]);
     return 1;
   }
@@ -116,6 +310,39 @@ int main( int argc, char** argv ) {
     exit(0);
   }
 
+  // render for a coordinator, without a window
+  if (!coordinatorAddress.empty()) {
+    Application app (config);
+    app.render_for_coordinator(sceneInfo, coordinatorAddress);
+    delete sceneInfo;
+    exit(EXIT_SUCCESS);
+  }
+
+  // render an animation without a window
+  if (videoFrames) {
+    if (outputW == 0 || outputH == 0) {
+      usage(argv[0]);
+      return 1;
+    }
+    Application app (config);
+    app.render_video_to_files(sceneInfo, sceneFilePath, outputW, outputH,
+                              videoFrames);
+    delete sceneInfo;
+    exit(EXIT_SUCCESS);
+  }
+
+  // render without a window
+  if (!outputPath.empty()) {
+    if (outputW == 0 || outputH == 0) {
+      usage(argv[0]);
+      return 1;
+    }
+    Application app (config);
+    app.render_to_file(sceneInfo, outputW, outputH, outputPath);
+    delete sceneInfo;
+    exit(EXIT_SUCCESS);
+  }
+
   // create viewer
   Viewer viewer = Viewer();
 
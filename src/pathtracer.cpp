@@ -2,6 +2,7 @@
 #include "bsdf.h"
 #include "ray.h"
 
+#include <chrono>
 #include <stack>
 #include <random>
 #include <algorithm>
@@ -9,7 +10,6 @@
 #include "CMU462/CMU462.h"
 #include "CMU462/vector3D.h"
 #include "CMU462/matrix3x3.h"
-#include "CMU462/lodepng.h"
 
 #include "GL/glew.h"
 
@@ -24,12 +24,43 @@ using std::max;
 
 namespace CMU462 {
 
+  // Rays traced by the calling worker thread during the current render.
+  static thread_local size_t raysTraced = 0;
+
+  // Shadow rays queued by shading the hits of the calling thread's path.
+  static thread_local std::vector<ShadowRay> shadowRays;
+
+  // Rays of the packets of the calling thread, as Ray has no default
+  // constructor to make arrays of.
+  static thread_local std::vector<Ray> packetRays;
+
+  // Tiles the calling worker thread got in a row without a sample to take.
+  static thread_local size_t idleVisits = 0;
+
+  // Side of the blocks of pixels whose camera rays are traced as packets.
+  static const size_t PACKET_BLOCK = 4;
+
+  // Camera rays per pixel between convergence tests of adaptive sampling,
+  // unless passes of a given size are requested.
+  static const size_t ADAPTIVE_BATCH_SIZE = 32;
+
+  // Passes a render with a time budget is split into, unless passes of a
+  // given size are requested. More passes track the deadline more closely.
+  static const size_t TIME_BUDGET_PASSES = 8;
+
   //#define ENABLE_RAY_LOGGING 1
 
   PathTracer::PathTracer(size_t ns_aa,
       size_t max_ray_depth, size_t ns_area_light,
       size_t ns_diff, size_t ns_glsy, size_t ns_refr,
-      size_t num_threads, HDRImageBuffer* envmap) {
+      size_t num_threads, HDRImageBuffer* envmap, size_t bvh_width,
+      double bvh_refit_ratio, const std::string& bvh_cache_dir,
+      size_t samples_per_pass, double adaptive_tolerance,
+      const std::string& sample_heatmap_path, uint64_t random_seed,
+      const std::string& pixel_sampler, const std::string& light_sampler,
+      bool wavefront, bool ray_packets, double time_budget,
+      const std::string& checkpoint_path, double checkpoint_interval,
+      bool resume, int listen_port) {
     state = INIT,
     this->ns_aa = ns_aa;
     this->max_ray_depth = max_ray_depth;
@@ -49,13 +80,50 @@ namespace CMU462 {
     camera = NULL;
 
     gridSampler = new UniformGridSampler2D();
+    pixelSamplerName = pixel_sampler;
+    pixelSampler = new_pixel_sampler(pixel_sampler);
+    if (!pixelSampler) {
+      fprintf(stderr, "[PathTracer] Unknown pixel sampler %s, using random\n",
+              pixel_sampler.c_str());
+      pixelSamplerName = "random";
+      pixelSampler = new RandomPixelSampler2D();
+    }
     hemisphereSampler = new UniformHemisphereSampler3D();
+    lightSampler = NULL;
+    lightSamplerName = light_sampler;
+    this->wavefront = wavefront;
+    rayPackets = ray_packets;
 
     show_rays = true;
 
     imageTileSize = 32;
     numWorkerThreads = num_threads;
     workerThreads.resize(numWorkerThreads);
+    bvhWidth = bvh_width;
+    bvhRefitRatio = bvh_refit_ratio;
+    bvhCacheDir = bvh_cache_dir;
+    samplesPerPass = samples_per_pass;
+    adaptiveTolerance = adaptive_tolerance;
+    sampleHeatmapPath = sample_heatmap_path;
+    imageWriter = NULL;
+    randomSeed = random_seed;
+    timeBudget = time_budget;
+    checkpointPath = checkpoint_path;
+    checkpointInterval = checkpoint_interval;
+    resumeCheckpoint = resume;
+    resumedSamples = 0;
+    checkpointThread = NULL;
+    checkpointStop = false;
+    listenPort = listen_port;
+    listenSocket = -1;
+    coordinating = false;
+    coordinatorThread = NULL;
+    if (listenPort && adaptiveTolerance > 0) {
+      // remote workers return pass averages, not the pixel statistics
+      fprintf(stderr, "[PathTracer] Adaptive sampling is not supported with "
+              "remote workers, disabling it\n");
+      adaptiveTolerance = 0;
+    }
 
     tm_gamma = 2.2f;
     tm_level = 1.0f;
@@ -67,7 +135,14 @@ namespace CMU462 {
   PathTracer::~PathTracer() {
 
     delete bvh;
+    vector<Primitive *> no_primitives;
+    vector<BVHInstance *> no_instances;
+    map<const StaticScene::Mesh *, MeshBVH> no_accels;
+    replace_instances(no_primitives, no_instances, no_accels);
+    delete_scene(scene);
+    delete lightSampler;
     delete gridSampler;
+    delete pixelSampler;
     delete hemisphereSampler;
 
   }
@@ -79,8 +154,12 @@ namespace CMU462 {
     }
 
     if (this->scene != nullptr) {
-      delete scene;
       delete bvh;
+      vector<Primitive *> no_primitives;
+      vector<BVHInstance *> no_instances;
+      map<const StaticScene::Mesh *, MeshBVH> no_accels;
+      replace_instances(no_primitives, no_instances, no_accels);
+      delete_scene(this->scene);
       selectionHistory.pop();
     }
 
@@ -96,6 +175,52 @@ namespace CMU462 {
     }
   }
 
+  void PathTracer::update_scene(Scene *scene) {
+
+    if (state != READY || this->scene == nullptr) {
+      return;
+    }
+
+    if (this->envLight != nullptr) {
+      scene->lights.push_back(this->envLight);
+    }
+
+    Scene* old_scene = this->scene;
+    this->scene = scene;
+
+    // Rigidly moved meshes keep their BVHs, so only the top level changes.
+    fprintf(stdout, "[PathTracer] Refitting BVH... "); fflush(stdout);
+    timer.start();
+    vector<Primitive *> primitives, object_primitives;
+    vector<BVHInstance *> new_instances;
+    map<const StaticScene::Mesh *, MeshBVH> new_accels;
+    size_t num_built = collect_primitives(primitives, object_primitives,
+                                          new_instances, new_accels);
+    bool refit = bvh->refit(primitives, bvhRefitRatio);
+    replace_instances(object_primitives, new_instances, new_accels);
+    delete_scene(old_scene);
+    timer.stop();
+    const BVHStats& stats = bvh->get_stats();
+    if (num_built) {
+      fprintf(stdout, "%zu mesh BVHs rebuilt, ", num_built);
+    }
+    if (refit) {
+      fprintf(stdout, "Done! (%.4f sec, SAH cost %.2f, %.2fx the last build)\n",
+          timer.duration(), stats.sah_cost,
+          stats.sah_cost / stats.build_sah_cost);
+    } else {
+      fprintf(stdout, "Rebuilt! (%.4f sec, %zu nodes, SAH cost %.2f)\n",
+          timer.duration(), stats.num_nodes, stats.sah_cost);
+
+      // the nodes selected in the old tree mean nothing in the new one
+      while (!selectionHistory.empty()) selectionHistory.pop();
+      selectionHistory.push(bvh->get_root());
+    }
+
+    // lights may have moved with the objects
+    build_light_sampler();
+  }
+
   void PathTracer::set_camera(Camera *camera) {
 
     if (state != INIT) {
@@ -158,11 +283,20 @@ namespace CMU462 {
         break;
       case RENDERING:
         continueRaytracing = false;
+        workQueue.stop();
       case DONE:
         for (int i=0; i<numWorkerThreads; i++) {
+          if (!workerThreads[i]) continue;
           workerThreads[i]->join();
           delete workerThreads[i];
+          workerThreads[i] = NULL;
+        }
+        if (coordinatorThread) {
+          coordinatorThread->join();
+          delete coordinatorThread;
+          coordinatorThread = NULL;
         }
+        join_checkpoint_thread();
         state = READY;
         break;
     }
@@ -172,6 +306,13 @@ namespace CMU462 {
     if (state != READY) return;
     delete bvh;
     bvh = NULL;
+    vector<Primitive *> no_primitives;
+    vector<BVHInstance *> no_instances;
+    map<const StaticScene::Mesh *, MeshBVH> no_accels;
+    replace_instances(no_primitives, no_instances, no_accels);
+    delete lightSampler;
+    lightSampler = NULL;
+    delete_scene(scene);
     scene = NULL;
     camera = NULL;
     selectionHistory.pop();
@@ -190,12 +331,28 @@ namespace CMU462 {
   void PathTracer::start_raytracing() {
     if (state != READY) return;
 
+    prepare_render();
+
+    // launch threads
+    fprintf(stdout, "[PathTracer] Rendering... "); fflush(stdout);
+    for (int i=0; i<numWorkerThreads; i++) {
+      workerThreads[i] = new std::thread(&PathTracer::worker_thread, this, i);
+    }
+    if (coordinating) {
+      coordinatorThread = new std::thread(&PathTracer::coordinator_thread, this);
+    }
+  }
+
+  void PathTracer::prepare_render() {
+
     rayLog.clear();
     workQueue.clear();
 
     state = RENDERING;
     continueRaytracing = true;
     workerDoneCount = 0;
+    renderFinished = false;
+    rayCount = 0;
 
     sampleBuffer.clear();
     frameBuffer.clear();
@@ -203,47 +360,205 @@ namespace CMU462 {
     num_tiles_h = sampleBuffer.h / imageTileSize + 1;
     tile_samples.resize(num_tiles_w * num_tiles_h);
     memset(&tile_samples[0], 0, num_tiles_w * num_tiles_h * sizeof(int));
+    pixelStats.assign(adaptiveTolerance > 0 ? sampleBuffer.w * sampleBuffer.h : 0,
+                      PixelStats());
+    samplesTaken = 0;
+    renderTimer.start();
+
+    // continue the render of the checkpoint, if asked to
+    resumedSamples = 0;
+    if (!checkpointPath.empty()) checkpointSceneHash = scene_hash();
+    if (resumeCheckpoint) {
+      resumeCheckpoint = false;
+      if (load_checkpoint()) {
+        sampleBuffer.toColor(frameBuffer, 0, 0, sampleBuffer.w, sampleBuffer.h);
+      }
+    }
 
-    // populate the tile work queue
+    // populate the tile work queue, center tiles first, leaving out the tiles
+    // a resumed render already finished
+    double center_x = 0.5 * sampleBuffer.w, center_y = 0.5 * sampleBuffer.h;
     for (size_t y = 0; y < sampleBuffer.h; y += imageTileSize) {
       for (size_t x = 0; x < sampleBuffer.w; x += imageTileSize) {
-        workQueue.put_work(WorkItem(x, y, imageTileSize, imageTileSize));
+        size_t x1 = std::min(x + imageTileSize, sampleBuffer.w);
+        size_t y1 = std::min(y + imageTileSize, sampleBuffer.h);
+        size_t num_samples_tile =
+          tile_samples[x / imageTileSize + (y / imageTileSize) * num_tiles_w];
+        resumedSamples += num_samples_tile * (x1 - x) * (y1 - y);
+        bool finished = num_samples_tile >= std::max<size_t>(ns_aa, 1);
+        if (!finished && !pixelStats.empty() && num_samples_tile) {
+          finished = true;
+          for (size_t py = y; py < y1; py++) {
+            for (size_t px = x; px < x1; px++) {
+              if (!pixelStats[px + py * sampleBuffer.w].converged) {
+                finished = false;
+              }
+            }
+          }
+        }
+        if (finished) continue;
+
+        double dx = x + 0.5 * imageTileSize - center_x;
+        double dy = y + 0.5 * imageTileSize - center_y;
+        workQueue.put_work(WorkItem(x, y, imageTileSize, imageTileSize),
+                           -(dx * dx + dy * dy));
       }
     }
+    coordinating = listenPort && listen_for_workers();
+    workQueue.start(numWorkerThreads + (coordinating ? MAX_REMOTE_WORKERS : 0));
+
+    // a checkpoint starts out as the state the render starts from
+    size_t num_tiles = num_tiles_w * num_tiles_h;
+    tileVersions.reset(new std::atomic<uint32_t>[num_tiles]);
+    for (size_t i = 0; i < num_tiles; i++) tileVersions[i] = 0;
+    if (!checkpointPath.empty()) {
+      checkpointBuffer = sampleBuffer;
+      checkpointTileSamples = tile_samples;
+      checkpointPixelStats = pixelStats;
+      checkpointStop = false;
+      checkpointThread = new std::thread(&PathTracer::checkpoint_thread, this);
+    }
+  }
 
-    // launch threads
-    fprintf(stdout, "[PathTracer] Rendering... "); fflush(stdout);
-    for (int i=0; i<numWorkerThreads; i++) {
-      workerThreads[i] = new std::thread(&PathTracer::worker_thread, this);
+
+  // Frees the BVH of a mesh with the triangles made for it, once no tracer
+  // holds on to it anymore.
+  static void delete_mesh_bvh(BVHAccel *accel) {
+    for (Primitive *prim : accel->primitives) delete prim;
+    delete accel;
+  }
+
+  size_t PathTracer::collect_primitives(vector<Primitive *>& primitives,
+      vector<Primitive *>& object_primitives,
+      vector<BVHInstance *>& instances,
+      map<const StaticScene::Mesh *, MeshBVH>& accels) {
+
+    size_t num_built = 0;
+    for (SceneObject *obj : scene->objects) {
+      MeshInstance *instance = dynamic_cast<MeshInstance *>(obj);
+      if (!instance) {
+        const vector<Primitive *> &obj_prims = obj->get_primitives();
+        primitives.reserve(primitives.size() + obj_prims.size());
+        primitives.insert(primitives.end(), obj_prims.begin(), obj_prims.end());
+        object_primitives.insert(object_primitives.end(), obj_prims.begin(),
+                                 obj_prims.end());
+        continue;
+      }
+
+      const StaticScene::Mesh *mesh = instance->get_mesh();
+      MeshBVH &entry = accels[mesh];
+      if (!entry.mesh && meshAccels.count(mesh)) {
+        entry = meshAccels[mesh];
+      } else if (!entry.mesh) {
+        entry.mesh = instance->get_shared_mesh();
+        entry.accel.reset(new BVHAccel(instance->get_primitives(), 4, 16,
+                                       numWorkerThreads, bvhWidth, bvhCacheDir),
+                          delete_mesh_bvh);
+        num_built++;
+      }
+
+      instances.push_back(new BVHInstance(entry.accel.get(),
+                                          instance->get_transform()));
+      primitives.push_back(instances.back());
     }
+    return num_built;
   }
 
+  void PathTracer::replace_instances(vector<Primitive *>& object_primitives,
+      vector<BVHInstance *>& instances,
+      map<const StaticScene::Mesh *, MeshBVH>& accels) {
+
+    for (Primitive *prim : objectPrimitives) delete prim;
+    for (BVHInstance *instance : this->instances) {
+      delete instance;
+    }
+    objectPrimitives.swap(object_primitives);
+    this->instances.swap(instances);
+    meshAccels.swap(accels);
+    object_primitives.clear();
+    instances.clear();
+    accels.clear();
+  }
+
+  void PathTracer::delete_scene(Scene *scene) {
+    if (!scene) return;
+    vector<SceneLight *> &lights = scene->lights;
+    lights.erase(std::remove(lights.begin(), lights.end(), envLight),
+                 lights.end());
+    delete scene;
+  }
 
   void PathTracer::build_accel() {
 
     // collect primitives //
     fprintf(stdout, "[PathTracer] Collecting primitives... "); fflush(stdout);
     timer.start();
-    vector<Primitive *> primitives;
-    for (SceneObject *obj : scene->objects) {
-      const vector<Primitive *> &obj_prims = obj->get_primitives();
-      primitives.reserve(primitives.size() + obj_prims.size());
-      primitives.insert(primitives.end(), obj_prims.begin(), obj_prims.end());
-    }
+    vector<Primitive *> primitives, object_primitives;
+    vector<BVHInstance *> new_instances;
+    map<const StaticScene::Mesh *, MeshBVH> new_accels;
+    size_t num_built = collect_primitives(primitives, object_primitives,
+                                          new_instances, new_accels);
+    replace_instances(object_primitives, new_instances, new_accels);
     timer.stop();
     fprintf(stdout, "Done! (%.4f sec)\n", timer.duration());
+    if (!instances.empty()) {
+      fprintf(stdout, "[PathTracer] %zu mesh instances, %zu mesh BVHs built\n",
+          instances.size(), num_built);
+    }
 
     // build BVH //
     fprintf(stdout, "[PathTracer] Building BVH... "); fflush(stdout);
     timer.start();
-    bvh = new BVHAccel(primitives);
+    bvh = new BVHAccel(primitives, 4, 16, numWorkerThreads, bvhWidth,
+                       bvhCacheDir);
     timer.stop();
-    fprintf(stdout, "Done! (%.4f sec)\n", timer.duration());
+    const BVHStats& stats = bvh->get_stats();
+    fprintf(stdout, "Done! (%.4f sec, %zu nodes, depth %zu, SAH cost %.2f)\n",
+        timer.duration(), stats.num_nodes, stats.max_depth, stats.sah_cost);
+    if (stats.cached) {
+      fprintf(stdout, "[PathTracer] BVH loaded from the cache in %s\n",
+          bvhCacheDir.c_str());
+    } else {
+      fprintf(stdout, "[PathTracer] BVH build on %zu threads: bounds %.4f sec, "
+          "top levels %.4f sec, subtrees %.4f sec\n", numWorkerThreads,
+          stats.bounds_time, stats.top_time, stats.subtree_time);
+    }
+    if (stats.num_triangles) {
+      fprintf(stdout, "[PathTracer] Triangle store: %zu triangles, %.1f bytes "
+          "per triangle (%.2f MB)\n", stats.num_triangles,
+          (double) stats.triangle_bytes / stats.num_triangles,
+          stats.triangle_bytes / (1024.0 * 1024.0));
+    }
+    if (bvh->get_width() != bvhWidth) {
+      fprintf(stdout, "[PathTracer] %zu-wide BVH not supported, using %zu-wide\n",
+          bvhWidth, bvh->get_width());
+    } else if (bvhWidth > 2) {
+      fprintf(stdout, "[PathTracer] Traversing a %zu-wide BVH\n", bvhWidth);
+    }
+
+    build_light_sampler();
+    if (!scene->objectLights.empty()) {
+      fprintf(stdout, "[PathTracer] %zu emissive objects light the scene\n",
+          scene->objectLights.size());
+    }
 
     // initial visualization //
     selectionHistory.push(bvh->get_root());
   }
 
+  void PathTracer::build_light_sampler() {
+    delete lightSampler;
+    lightSampler = new_light_sampler(lightSamplerName, scene->lights,
+                                     bvh->get_bbox());
+    if (!lightSampler) {
+      fprintf(stderr, "[PathTracer] Unknown light sampler %s, using power\n",
+              lightSamplerName.c_str());
+      lightSamplerName = "power";
+      lightSampler = new_light_sampler(lightSamplerName, scene->lights,
+                                       bvh->get_bbox());
+    }
+  }
+
   void PathTracer::log_ray_miss(const Ray& r) {
     rayLog.push_back(LoggedRay(r, -1.0));
   }
@@ -269,36 +584,36 @@ namespace CMU462 {
     Color cprim_hl_right = Color(.8, .8, 1., 1);
     Color cprim_hl_edges = Color(0., 0., 0., 0.5);
 
-    BVHNode *selected = selectionHistory.top();
+    size_t selected = selectionHistory.top();
+    const LinearBVHNode& selected_node = bvh->get_node(selected);
+    size_t start, range;
 
     // render solid geometry (with depth offset)
     glPolygonOffset(1.0, 1.0);
     glEnable(GL_POLYGON_OFFSET_FILL);
 
-    if (selected->isLeaf()) {
-      for (size_t i = 0; i < selected->range; ++i) {
-        bvh->primitives[selected->start + i]->draw(cprim_hl_left);
+    if (selected_node.isLeaf()) {
+      bvh->get_range(selected, &start, &range);
+      for (size_t i = 0; i < range; ++i) {
+        bvh->primitives[start + i]->draw(cprim_hl_left);
       }
     } else {
-      if (selected->l) {
-        BVHNode* child = selected->l;
-        for (size_t i = 0; i < child->range; ++i) {
-          bvh->primitives[child->start + i]->draw(cprim_hl_left);
-        }
+      bvh->get_range(bvh->get_left(selected), &start, &range);
+      for (size_t i = 0; i < range; ++i) {
+        bvh->primitives[start + i]->draw(cprim_hl_left);
       }
-      if (selected->r) {
-        BVHNode* child = selected->r;
-        for (size_t i = 0; i < child->range; ++i) {
-          bvh->primitives[child->start + i]->draw(cprim_hl_right);
-        }
+      bvh->get_range(bvh->get_right(selected), &start, &range);
+      for (size_t i = 0; i < range; ++i) {
+        bvh->primitives[start + i]->draw(cprim_hl_right);
       }
     }
 
     glDisable(GL_POLYGON_OFFSET_FILL);
 
     // draw geometry outline
-    for (size_t i = 0; i < selected->range; ++i) {
-      bvh->primitives[selected->start + i]->drawOutline(cprim_hl_edges);
+    bvh->get_range(selected, &start, &range);
+    for (size_t i = 0; i < range; ++i) {
+      bvh->primitives[start + i]->drawOutline(cprim_hl_edges);
     }
 
     // keep depth buffer check enabled so that mesh occluded bboxes, but
@@ -306,7 +621,7 @@ namespace CMU462 {
     glDepthMask(GL_FALSE);
 
     // create traversal stack
-    stack<BVHNode *> tstack;
+    stack<size_t> tstack;
 
     // push initial traversal data
     tstack.push(bvh->get_root());
@@ -314,20 +629,24 @@ namespace CMU462 {
     // draw all BVH bboxes with non-highlighted color
     while (!tstack.empty()) {
 
-      BVHNode *current = tstack.top();
+      size_t current = tstack.top();
       tstack.pop();
 
-      current->bb.draw(cnode);
-      if (current->l) tstack.push(current->l);
-      if (current->r) tstack.push(current->r);
+      bvh->get_node(current).bbox().draw(cnode);
+      if (!bvh->get_node(current).isLeaf()) {
+        tstack.push(bvh->get_left(current));
+        tstack.push(bvh->get_right(current));
+      }
     }
 
     // draw selected node bbox and primitives
-    if (selected->l) selected->l->bb.draw(cnode_hl_child);
-    if (selected->r) selected->r->bb.draw(cnode_hl_child);
+    if (!selected_node.isLeaf()) {
+      bvh->get_node(bvh->get_left(selected)).bbox().draw(cnode_hl_child);
+      bvh->get_node(bvh->get_right(selected)).bbox().draw(cnode_hl_child);
+    }
 
     glLineWidth(3.f);
-    selected->bb.draw(cnode_hl);
+    selected_node.bbox().draw(cnode_hl);
 
     // now perform visualization of the rays
     if (show_rays) {
@@ -362,7 +681,7 @@ namespace CMU462 {
 
   void PathTracer::key_press(int key) {
 
-    BVHNode *current = selectionHistory.top();
+    size_t current = selectionHistory.top();
     switch (key) {
       case ']':
         ns_aa *=2;
@@ -381,13 +700,13 @@ namespace CMU462 {
         }
         break;
       case KEYBOARD_LEFT: case '<':
-        if (current->l) {
-          selectionHistory.push(current->l);
+        if (!bvh->get_node(current).isLeaf()) {
+          selectionHistory.push(bvh->get_left(current));
         }
         break;
       case KEYBOARD_RIGHT: case '>':
-        if (current->l) {
-          selectionHistory.push(current->r);
+        if (!bvh->get_node(current).isLeaf()) {
+          selectionHistory.push(bvh->get_right(current));
         }
         break;
       case 's':
@@ -398,29 +717,96 @@ namespace CMU462 {
     }
   }
 
-  Spectrum PathTracer::trace_ray(const Ray &r) {
+  Spectrum PathTracer::trace_ray(const Ray &r, RNG& rng) {
 
+    raysTraced++;
     Intersection isect;
+    bool hit = bvh->intersect(r, &isect);
+    return trace_hit(r, hit ? &isect : NULL, rng);
+  }
+
+  Spectrum PathTracer::trace_hit(const Ray &r, const Intersection* isect,
+      RNG& rng) {
 
-    if (!bvh->intersect(r, &isect)) {
+    if (!isect) {
 
       // log ray miss
 #ifdef ENABLE_RAY_LOGGING
       log_ray_miss(r);
 #endif
 
-      // TODO:
-      // If you have an environment map, return the Spectrum this ray
-      // samples from the environment map. If you don't return black.
-
-      return Spectrum(0,0,0);
+      return escaped(r);
     }
 
     // log ray hit
 #ifdef ENABLE_RAY_LOGGING
-    log_ray_hit(r, isect.t);
+    log_ray_hit(r, isect->t);
 #endif
 
+    // Trace the shadow rays of this hit, then follow the path on. The hits
+    // further along it queue theirs after these, and remove them again.
+    std::vector<ShadowRay>& shadows = shadowRays;
+    size_t first_shadow = shadows.size();
+    Ray next(Vector3D(0, 0, 0), Vector3D(0, 0, 1));
+    Spectrum next_weight;
+    Spectrum L_out = shade(r, *isect, rng, shadows, &next, &next_weight);
+    if (shadows.size() > first_shadow) {
+      L_out += trace_shadows(&shadows[first_shadow],
+                             shadows.size() - first_shadow);
+    }
+    shadows.resize(first_shadow);
+
+    if (next_weight != Spectrum()) {
+      L_out += next_weight * trace_ray(next, rng);
+    }
+    return L_out;
+  }
+
+  Spectrum PathTracer::trace_shadows(const ShadowRay* shadows, size_t n) {
+
+    raysTraced += n;
+    Spectrum L;
+    if (!rayPackets) {
+      for (size_t i = 0; i < n; i++) {
+        if (!bvh->intersect(Ray(shadows[i].o, shadows[i].d, shadows[i].max_t))) {
+          L += shadows[i].L;
+        }
+      }
+      return L;
+    }
+
+    std::vector<Ray>& rays = packetRays;
+    bool occluded[BVH_PACKET_SIZE];
+    for (size_t i = 0; i < n; i += BVH_PACKET_SIZE) {
+      size_t count = std::min(n - i, BVH_PACKET_SIZE);
+      rays.clear();
+      for (size_t k = 0; k < count; k++) {
+        const ShadowRay& shadow = shadows[i + k];
+        rays.push_back(Ray(shadow.o, shadow.d, shadow.max_t));
+      }
+      bvh->occluded_packet(&rays[0], count, occluded);
+      for (size_t k = 0; k < count; k++) {
+        if (!occluded[k]) L += shadows[i + k].L;
+      }
+    }
+    return L;
+  }
+
+  Spectrum PathTracer::escaped(const Ray& r) {
+
+    // the ray escapes to the environment map, if there is one
+    if (envLight) return envLight->sample_dir(r);
+
+    return Spectrum(0,0,0);
+  }
+
+  Spectrum PathTracer::shade(const Ray& r, const Intersection& isect,
+      RNG& rng, std::vector<ShadowRay>& shadows, Ray* next,
+      Spectrum* next_weight) {
+
+    // the path ends here unless it is continued below
+    *next_weight = Spectrum();
+
     Spectrum L_out = isect.bsdf->get_emission(); // Le
 
     // TODO :
@@ -447,6 +833,9 @@ namespace CMU462 {
     // TODO:
     // Extend the below code to compute the direct lighting for all the lights
     // in the scene, instead of just the dummy light we provided in part 1.
+    // Rather than looping over them, pick one light per sample with
+    // lightSampler->sample(hit_p, hit_n, ...), and divide what it contributes
+    // by the probability it was picked with.
 
     InfiniteHemisphereLight light(Spectrum(5.f, 5.f, 5.f));
     //DirectionalLight light(Spectrum(5.f, 5.f, 5.f), Vector3D(1.0, -1.0, 0.0));
@@ -467,7 +856,8 @@ namespace CMU462 {
       // the distance from point x to this point on the light source.
       // (pdf is the probability of randomly selecting the random
       // sample point on the light source -- more on this in part 2)
-      Spectrum light_L = light.sample_L(hit_p, &dir_to_light, &dist_to_light, &pdf);
+      Spectrum light_L = light.sample_L(hit_p, &dir_to_light, &dist_to_light,
+                                        &pdf, rng);
 
       // convert direction into coordinate space of the surface, where
       // the surface normal is [0 0 1]
@@ -481,32 +871,180 @@ namespace CMU462 {
       Spectrum f = isect.bsdf->f(w_out, w_in);
 
       // TODO:
-      // Construct a shadow ray and compute whether the intersected surface is
-      // in shadow and accumulate reflected radiance
+      // Construct a shadow ray towards the light and queue it in shadows,
+      // with the reflected radiance it adds if the surface is not in shadow.
+      // Both trace_ray and the wavefront engine trace the queued rays.
     }
 
     // TODO:
-    // Compute an indirect lighting estimate using pathtracing with Monte Carlo.
-    // Note that Ray objects have a depth field now; you should use this to avoid
-    // traveling down one path forever.
+    // Compute an indirect lighting estimate using pathtracing with Monte Carlo:
+    // set *next to the ray the path continues along, and *next_weight to the
+    // factor its radiance is weighed with. Note that Ray objects have a depth
+    // field now; you should use this to avoid traveling down one path forever.
 
     return L_out;
   }
 
-  Spectrum PathTracer::raytrace_pixel(size_t x, size_t y) {
+  Ray PathTracer::camera_ray(size_t x, size_t y, size_t i, size_t num_samples,
+      uint32_t seed) {
 
     // TODO:
-    // Sample the pixel with coordinate (x,y) and return the result spectrum.
-    // The sample rate is given by the number of camera rays per pixel.
-
-    int num_samples = ns_aa;
+    // Return the camera ray of sample i of the num_samples camera rays of the
+    // pixel with coordinate (x,y) in this pass. For its position in the
+    // pixel, use pixelSampler->get_sample(i, num_samples, 0, seed).
 
     Vector2D p = Vector2D(0.5,0.5);
-    return trace_ray(camera->generate_ray(p.x, p.y));
+    return camera->generate_ray(p.x, p.y);
+
+  }
+
+  Spectrum PathTracer::raytrace_pixel(size_t x, size_t y, size_t num_samples,
+      RNG& rng) {
+
+    // The camera rays of a call share a seed of the pixel sampler, and their
+    // paths each take a generator seeded from rng.
+    uint32_t seed = rng.next_uint();
+    Spectrum sum;
+    for (size_t i = 0; i < num_samples; i++) {
+      RNG path_rng(rng.next_uint(), x + y * sampleBuffer.w);
+      sum += trace_ray(camera_ray(x, y, i, num_samples, seed), path_rng);
+    }
+    return sum * (1.f / num_samples);
+
+  }
 
+  size_t PathTracer::raytrace_block(size_t x0, size_t y0, size_t x1,
+      size_t y1, size_t num_samples_tile, size_t num_samples) {
+
+    size_t w = sampleBuffer.w;
+    bool adaptive = adaptiveTolerance > 0;
+    float weight = (float) num_samples / (num_samples_tile + num_samples);
+
+    struct BlockPixel {
+      size_t x, y;
+      RNG rng;        ///< of the pixel, seeds its samples
+      uint32_t seed;  ///< of the pixel sampler
+      Spectrum sum;   ///< of the samples of the pass
+    };
+
+    BlockPixel pixels[PACKET_BLOCK * PACKET_BLOCK];
+    size_t n = 0;
+    for (size_t y = y0; y < y1; y++) {
+      for (size_t x = x0; x < x1; x++) {
+        if (adaptive && pixelStats[x + y * w].converged) continue;
+        // The random numbers of a pixel only depend on the seed, the pixel
+        // and its samples so far, not on the thread that renders it.
+        BlockPixel& pixel = pixels[n++];
+        pixel.x = x;
+        pixel.y = y;
+        pixel.rng = RNG(randomSeed + ((uint64_t) num_samples_tile << 32),
+                        x + y * w);
+      }
+    }
+
+    // Take the same random numbers as raytrace_pixel, which takes the rays
+    // of a pixel one at a time with adaptive sampling, to track the variance
+    // of the pixel.
+    std::vector<Ray> rays;
+    rays.reserve(n);
+    RNG path_rngs[PACKET_BLOCK * PACKET_BLOCK];
+    Intersection isects[PACKET_BLOCK * PACKET_BLOCK];
+    bool hits[PACKET_BLOCK * PACKET_BLOCK];
+    for (size_t i = 0; i < num_samples; i++) {
+      rays.clear();
+      for (size_t k = 0; k < n; k++) {
+        BlockPixel& pixel = pixels[k];
+        if (!i || adaptive) pixel.seed = pixel.rng.next_uint();
+        path_rngs[k] = RNG(pixel.rng.next_uint(), pixel.x + pixel.y * w);
+        rays.push_back(adaptive ?
+            camera_ray(pixel.x, pixel.y, 0, 1, pixel.seed) :
+            camera_ray(pixel.x, pixel.y, i, num_samples, pixel.seed));
+        isects[k] = Intersection();
+      }
+
+      raysTraced += n;
+      if (rayPackets && n) {
+        bvh->intersect_packet(&rays[0], n, isects, hits);
+      } else {
+        for (size_t k = 0; k < n; k++) hits[k] = bvh->intersect(rays[k], &isects[k]);
+      }
+
+      for (size_t k = 0; k < n; k++) {
+        Spectrum s = trace_hit(rays[k], hits[k] ? &isects[k] : NULL,
+                               path_rngs[k]);
+        pixels[k].sum += s;
+        if (adaptive) pixelStats[pixels[k].x + pixels[k].y * w].add(s.illum());
+      }
+    }
+
+    // Stop sampling a pixel once its 95% confidence interval is within the
+    // tolerance.
+    size_t remaining = 0;
+    for (size_t k = 0; k < n; k++) {
+      const BlockPixel& pixel = pixels[k];
+      sampleBuffer.update_pixel(pixel.sum * (1.f / num_samples),
+                                pixel.x, pixel.y, weight);
+      if (!adaptive) continue;
+      PixelStats& stats = pixelStats[pixel.x + pixel.y * w];
+      stats.test(adaptiveTolerance);
+      if (!stats.converged) remaining++;
+    }
+    return remaining;
+  }
+
+  double PathTracer::budget_samples_left() {
+    Timer now = renderTimer;
+    now.stop();
+    double elapsed = now.duration();
+    size_t taken = samplesTaken;
+    if (elapsed <= 0 || !taken) return 1;
+
+    // samples that can still be taken at the rate so far, spread evenly
+    double rate = taken / elapsed;
+    return rate * std::max(0.0, timeBudget - elapsed) /
+           (sampleBuffer.w * sampleBuffer.h);
+  }
+
+  size_t PathTracer::budget_samples_per_pixel() {
+    double taken = (double) (resumedSamples + samplesTaken) /
+                   (sampleBuffer.w * sampleBuffer.h);
+    size_t spp = (size_t) (taken + budget_samples_left() + 0.5);
+    return std::min(std::max<size_t>(ns_aa, 1), std::max<size_t>(spp, 1));
+  }
+
+  size_t PathTracer::pass_samples(size_t num_samples_tile) {
+
+    size_t pass_size = samplesPerPass;
+    if (!pass_size && adaptiveTolerance > 0) pass_size = ADAPTIVE_BATCH_SIZE;
+    size_t target = std::max<size_t>(ns_aa, 1);
+    if (timeBudget > 0) {
+      // The first pass takes one sample per pixel to measure the rate of
+      // the render. Then all tiles are brought to the number of samples per
+      // pixel that fits in the budget, in passes so the estimate can adapt.
+      if (num_samples_tile == 0 || !samplesTaken) {
+        target = std::min(target, num_samples_tile + 1);
+      } else {
+        target = budget_samples_per_pixel();
+      }
+      if (!samplesPerPass) {
+        pass_size = std::max<size_t>(1, target / TIME_BUDGET_PASSES);
+      }
+    }
+    if (num_samples_tile >= target) return 0;
+    size_t num_samples = target - num_samples_tile;
+    if (pass_size) num_samples = std::min(num_samples, pass_size);
+    return num_samples;
   }
 
-  void PathTracer::raytrace_tile(int tile_x, int tile_y,
+  bool PathTracer::tile_finished(size_t num_samples_tile) {
+    if (num_samples_tile >= std::max<size_t>(ns_aa, 1)) return true;
+    // The estimate of what fits in the budget may still grow, so a tile that
+    // reached it takes more passes until too little time is left for even
+    // one more sample per pixel over the whole image.
+    return timeBudget > 0 && samplesTaken && budget_samples_left() < 0.5;
+  }
+
+  size_t PathTracer::raytrace_tile(int tile_x, int tile_y,
       int tile_w, int tile_h) {
 
     size_t w = sampleBuffer.w;
@@ -522,39 +1060,115 @@ namespace CMU462 {
     size_t tile_idx_y = tile_y / imageTileSize;
     size_t num_samples_tile = tile_samples[tile_idx_x + tile_idx_y * num_tiles_w];
 
-    for (size_t y = tile_start_y; y < tile_end_y; y++) {
-      if (!continueRaytracing) return;
-      for (size_t x = tile_start_x; x < tile_end_x; x++) {
-        Spectrum s = raytrace_pixel(x, y);
-        sampleBuffer.update_pixel(s, x, y);
+    // Take the samples of this pass and blend them into the running average
+    // of the earlier passes.
+    bool adaptive = adaptiveTolerance > 0;
+    size_t num_samples = pass_samples(num_samples_tile);
+    if (!num_samples) {
+      if (tile_finished(num_samples_tile)) return 0;
+      // The tile is ahead of the budget estimate, which may still grow:
+      // keep it queued. A worker that went over every tile without taking
+      // a sample waits a little for the others to catch up.
+      if (++idleVisits > num_tiles_w * num_tiles_h) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+      }
+      return (tile_end_x - tile_start_x) * (tile_end_y - tile_start_y);
+    }
+    idleVisits = 0;
+
+    // Make the version of the tile odd while writing to it, so that
+    // checkpoints skip it. A canceled pass leaves it odd for good.
+    std::atomic<uint32_t>& version = tileVersions[tile_idx_x + tile_idx_y * num_tiles_w];
+    uint32_t v = version.load(std::memory_order_relaxed);
+    version.store(v + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    size_t remaining = 0;
+    if (wavefront) {
+      size_t rays;
+      if (!raytrace_tile_wavefront(tile_x, tile_y, tile_w, tile_h,
+                                   num_samples_tile, num_samples,
+                                   &remaining, &rays)) return 0;
+      raysTraced += rays;
+    } else {
+      for (size_t y = tile_start_y; y < tile_end_y; y += PACKET_BLOCK) {
+        if (!continueRaytracing) return 0;
+        for (size_t x = tile_start_x; x < tile_end_x; x += PACKET_BLOCK) {
+          remaining += raytrace_block(x, y,
+                                      std::min(x + PACKET_BLOCK, tile_end_x),
+                                      std::min(y + PACKET_BLOCK, tile_end_y),
+                                      num_samples_tile, num_samples);
+        }
       }
     }
 
-    tile_samples[tile_idx_x + tile_idx_y * num_tiles_w] += 1;
+    num_samples_tile += num_samples;
+    tile_samples[tile_idx_x + tile_idx_y * num_tiles_w] = num_samples_tile;
+    version.store(v + 2, std::memory_order_release);
     sampleBuffer.toColor(frameBuffer, tile_start_x, tile_start_y, tile_end_x, tile_end_y);
+    samplesTaken += num_samples * (tile_end_x - tile_start_x) *
+                                  (tile_end_y - tile_start_y);
+
+    if (adaptive && !remaining) return 0;
+    if (tile_finished(num_samples_tile)) return 0;
+    return adaptive ? remaining : (tile_end_x - tile_start_x) *
+                                  (tile_end_y - tile_start_y);
   }
 
-  void PathTracer::worker_thread() {
+  void PathTracer::worker_thread(size_t worker) {
 
     Timer timer;
     timer.start();
+    raysTraced = 0;
+
+    size_t index;
+    while (continueRaytracing && workQueue.get_work(worker, &index)) {
+      const WorkItem& work = workQueue.get_item(index);
+      size_t remaining = raytrace_tile(work.tile_x, work.tile_y,
+                                       work.tile_w, work.tile_h);
+      if (!remaining) {
+        workQueue.done();
+      } else if (adaptiveTolerance > 0) {
+        // tiles with the most pixels left to converge go first
+        workQueue.put_back(worker, index, remaining);
+      } else if (timeBudget > 0) {
+        // tiles with the fewest samples go first, to keep them level
+        workQueue.put_back(worker, index, -(double) tile_samples[
+          work.tile_x / imageTileSize +
+          (work.tile_y / imageTileSize) * num_tiles_w]);
+      } else {
+        workQueue.put_back(worker, index);
+      }
+    }
+
+    worker_done(timer);
+  }
 
-    WorkItem work;
-    while (continueRaytracing && workQueue.try_get_work(&work)) {
-      raytrace_tile(work.tile_x, work.tile_y, work.tile_w, work.tile_h);
+  void PathTracer::worker_done(Timer& timer) {
+
+    int num_workers = numWorkerThreads + (coordinating ? 1 : 0);
+    rayCount += raysTraced;
+    // Only the last worker wraps up the render. Workers that finish before
+    // it may still see the final count, so one exchange decides who does.
+    if (++workerDoneCount < num_workers || renderFinished.exchange(true)) {
+      return;
     }
 
-    workerDoneCount++;
-    if (!continueRaytracing && workerDoneCount == numWorkerThreads) {
-      timer.stop();
+    // the render is over, let the checkpoint thread write the last one
+    {
+      std::lock_guard<std::mutex> lock(checkpointMutex);
+      checkpointStop = true;
+      checkpointCond.notify_all();
+    }
+    timer.stop();
+    if (!continueRaytracing) {
       fprintf(stdout, "Canceled!\n");
       state = READY;
-    }
-
-    if (continueRaytracing && workerDoneCount == numWorkerThreads) {
-      timer.stop();
-      fprintf(stdout, "Done! (%.4fs)\n", timer.duration());
+    } else {
+      fprintf(stdout, "Done! (%.4fs, %.2f Mrays/s)\n", timer.duration(),
+          rayCount / timer.duration() * 1e-6);
       state = DONE;
+      if (!sampleHeatmapPath.empty()) save_sample_heatmap(sampleHeatmapPath);
     }
   }
 
@@ -573,21 +1187,96 @@ namespace CMU462 {
     return (state == DONE);
   }
 
+  void PathTracer::wait_until_done() {
+    if (state != RENDERING) return;
+    for (int i=0; i<numWorkerThreads; i++) {
+      workerThreads[i]->join();
+      delete workerThreads[i];
+      workerThreads[i] = NULL;
+    }
+    if (coordinatorThread) {
+      coordinatorThread->join();
+      delete coordinatorThread;
+      coordinatorThread = NULL;
+    }
+    join_checkpoint_thread();
+  }
+
   void PathTracer::save_image(string fname) {
 
     if (state != DONE) return;
 
-    uint32_t* frame = &frameBuffer.data[0];
-    size_t w = frameBuffer.w;
-    size_t h = frameBuffer.h;
-    uint32_t* frame_out = new uint32_t[w * h];
-    for(size_t i = 0; i < h; ++i) {
-      memcpy(frame_out + i * w, frame + (h - i - 1) * w, 4 * w);
+    // the radiance itself goes to OpenEXR files, the tonemapped frame
+    // buffer to png files
+    if (ImageWriter::is_exr(fname)) {
+      fprintf(stderr, "[PathTracer] Saving to file: %s\n", fname.c_str());
+      if (imageWriter) {
+        // the next render clears the sample buffer, so the writer gets a copy
+        imageWriter->write_exr(fname, vector<Spectrum>(sampleBuffer.data),
+                               sampleBuffer.w, sampleBuffer.h, true);
+      } else {
+        ImageWriter::encode_exr(fname, &sampleBuffer.data[0], sampleBuffer.w,
+                                sampleBuffer.h, true, true, true);
+      }
+      return;
+    }
+
+    // the frame buffer stays on screen, so the writer gets a copy
+    write_png(fname, vector<uint32_t>(frameBuffer.data), frameBuffer.w,
+              frameBuffer.h, true);
+  }
+
+  void PathTracer::set_image_writer(ImageWriter* writer) {
+    imageWriter = writer;
+  }
+
+  void PathTracer::write_png(const std::string& fname, vector<uint32_t>&& pixels,
+                             size_t w, size_t h, bool flip) {
+    fprintf(stderr, "[PathTracer] Saving to file: %s\n", fname.c_str());
+    if (imageWriter) {
+      imageWriter->write_png(fname, std::move(pixels), w, h, flip);
+    } else {
+      ImageWriter::encode_png(fname, pixels, w, h, flip, false);
+    }
+  }
+
+  void PathTracer::save_sample_heatmap(string fname) {
+
+    if (state != DONE) return;
+
+    size_t w = sampleBuffer.w;
+    size_t h = sampleBuffer.h;
+    vector<size_t> samples(w * h);
+    size_t min_samples = SIZE_MAX, max_samples = 0;
+    for (size_t y = 0; y < h; ++y) {
+      for (size_t x = 0; x < w; ++x) {
+        size_t i = x + y * w;
+        samples[i] = pixelStats.empty() ?
+          tile_samples[x / imageTileSize + (y / imageTileSize) * num_tiles_w] :
+          pixelStats[i].n;
+        min_samples = min(min_samples, samples[i]);
+        max_samples = max(max_samples, samples[i]);
+      }
+    }
+
+    // blue (fewest samples) through green to red (most samples), flipped
+    // vertically like the frame buffer
+    ImageBuffer heatmap(w, h);
+    size_t range = max_samples - min_samples;
+    for (size_t y = 0; y < h; ++y) {
+      for (size_t x = 0; x < w; ++x) {
+        float t = range ? (float) (samples[x + y * w] - min_samples) / range
+                        : 1.f;
+        Color c(clamp(2 * t - 1, 0.f, 1.f),
+                1 - fabs(2 * t - 1),
+                clamp(1 - 2 * t, 0.f, 1.f), 1);
+        heatmap.update_pixel(c, x, h - y - 1);
+      }
     }
 
-    fprintf(stderr, "[PathTracer] Saving to file: %s... ", fname.c_str());
-    lodepng::encode(fname, (unsigned char*) frame_out, w, h);
-    fprintf(stderr, "Done!\n");
+    fprintf(stderr, "[PathTracer] Samples per pixel range from %zu (blue) to "
+        "%zu (red)\n", min_samples, max_samples);
+    write_png(fname, std::move(heatmap.data), w, h, false);
   }
 
 }  // namespace CMU462
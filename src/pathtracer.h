@@ -4,25 +4,40 @@
 #include <stack>
 #include <thread>
 #include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <memory>
 #include <vector>
+#include <map>
+#include <string>
 #include <algorithm>
+#include <functional>
 
 #include "CMU462/timer.h"
 
 #include "bvh.h"
 #include "camera.h"
+#include "light_sampler.h"
 #include "sampler.h"
+#include "rng.h"
 #include "image.h"
+#include "image_writer.h"
+#include "wavefront.h"
 #include "work_queue.h"
 
 #include "static_scene/scene.h"
 using CMU462::StaticScene::Scene;
 
+#include "static_scene/object.h"
+
 #include "static_scene/environment_light.h"
 using CMU462::StaticScene::EnvironmentLight;
 
-using CMU462::StaticScene::BVHNode;
+using CMU462::StaticScene::LinearBVHNode;
+using CMU462::StaticScene::BVHStats;
 using CMU462::StaticScene::BVHAccel;
+using CMU462::StaticScene::BVHInstance;
+using CMU462::StaticScene::LightSampler;
 
 namespace CMU462 {
 
@@ -41,6 +56,79 @@ namespace CMU462 {
 
   };
 
+  /**
+   * Number of remote workers a coordinator takes at most.
+   */
+  static const size_t MAX_REMOTE_WORKERS = 32;
+
+  /**
+   * Number of frames of an animation whose scenes are set up at once: the
+   * first unfinished frame and the ones after it that are prepared while it
+   * renders.
+   */
+  static const size_t VIDEO_FRAMES_AHEAD = 3;
+
+  /**
+   * Running statistics of the samples of a pixel for adaptive sampling:
+   * mean and sum of squared deviations of their illuminance (Welford).
+   */
+  struct PixelStats {
+
+    PixelStats() : n(0), mean(0), m2(0), converged(false) { }
+
+    /**
+     * Add a sample with the given illuminance.
+     */
+    void add(float illum) {
+      n++;
+      float delta = illum - mean;
+      mean += delta / n;
+      m2 += delta * (illum - mean);
+    }
+
+    /**
+     * Mark the pixel converged once the 95% confidence interval of its mean
+     * is within the given fraction of it.
+     */
+    void test(float tolerance) {
+      if (n < 2) return;
+      float variance = m2 / (n - 1);
+      float interval = 1.96f * sqrt(variance / n);
+      converged = interval <= tolerance * mean;
+    }
+
+    size_t n;        ///< number of samples
+    float mean;      ///< mean illuminance
+    float m2;        ///< sum of squared deviations from the mean
+    bool converged;  ///< the pixel needs no more samples
+  };
+
+  /**
+   * A shadow ray queued by shading a hit, with the radiance the hit reflects
+   * along its path if nothing blocks it.
+   */
+  struct ShadowRay {
+    Vector3D o;    ///< origin on the surface
+    Vector3D d;    ///< direction towards the light
+    double max_t;  ///< distance to the light
+    Spectrum L;    ///< radiance if unblocked
+  };
+
+  /**
+   * The BVH of a mesh in object space, kept from frame to frame for as long
+   * as the mesh is instanced. It holds on to the mesh, so that the address
+   * the BVH is found by is never reused for another mesh while it is kept.
+   * The BVH is never changed once built, so the tracers of frames rendered
+   * at the same time can share it.
+   */
+  struct MeshBVH {
+    std::shared_ptr<const StaticScene::Mesh> mesh;  ///< the mesh
+    std::shared_ptr<BVHAccel> accel;  ///< BVH over triangles made for it,
+                                      ///< freed with them by the last holder
+  };
+
+  struct CheckpointHeader;  // checkpoint.cpp
+
   /**
    * A pathtracer with BVH accelerator and BVH visualization capabilities.
    * It is always in exactly one of the following states:
@@ -61,7 +149,19 @@ namespace CMU462 {
           size_t max_ray_depth = 4, size_t ns_area_light = 1,
           size_t ns_diff = 1, size_t ns_glsy = 1, size_t ns_refr = 1,
           size_t num_threads = 1,
-          HDRImageBuffer* envmap = NULL);
+          HDRImageBuffer* envmap = NULL,
+          size_t bvh_width = 2, double bvh_refit_ratio = 1.5,
+          const std::string& bvh_cache_dir = "",
+          size_t samples_per_pass = 0, double adaptive_tolerance = 0,
+          const std::string& sample_heatmap_path = "",
+          uint64_t random_seed = 0,
+          const std::string& pixel_sampler = "random",
+          const std::string& light_sampler = "power",
+          bool wavefront = false, bool ray_packets = true,
+          double time_budget = 0,
+          const std::string& checkpoint_path = "",
+          double checkpoint_interval = 60, bool resume = false,
+          int listen_port = 0);
 
       /**
        * Destructor.
@@ -78,6 +178,16 @@ namespace CMU462 {
        */
       void set_scene(Scene* scene);
 
+      /**
+       * If in the READY state, replaces the scene with one made of the same
+       * primitives in the same order, only moved (the next frame of an
+       * animation). The BVH is refit to the new scene rather than rebuilt,
+       * unless that degrades it by more than the refit ratio.
+       * Like set_scene, this takes ownership of the scene.
+       * \param scene pointer to the new scene to be rendered
+       */
+      void update_scene(Scene* scene);
+
       /**
        * If in the INIT state, configures the pathtracer to use the given camera. If
        * configuration is done, transitions to the READY state.
@@ -140,15 +250,66 @@ namespace CMU462 {
       void decrease_area_light_sample_count();
 
       /**
-       * Save rendered result to png file.
+       * Save rendered result to png file, or its radiance to an OpenEXR
+       * file if the file name ends in .exr.
        */
       void save_image(string filename);
 
+      /**
+       * Save images with the given writer, in the background, rather than
+       * on the calling thread. The writer is not owned.
+       */
+      void set_image_writer(ImageWriter* writer);
+
+      /**
+       * Save a heatmap of the number of samples taken in each pixel to a png
+       * file.
+       */
+      void save_sample_heatmap(string filename);
+
       /**
        * Wait for the scene to finish raytracing.
        */
       bool is_done();
 
+      /**
+       * Connect to a coordinator, that is a path tracer listening for remote
+       * workers, and get the size of the image it renders. The scene and
+       * camera must then be set up for that size before serve_coordinator.
+       * Returns whether the coordinator could be reached.
+       */
+      bool connect_coordinator(const std::string& address,
+                               size_t* width, size_t* height);
+
+      /**
+       * If in the READY state, render the tile passes the coordinator sends,
+       * on as many connections to it as there are worker threads, until it
+       * has no more work.
+       */
+      void serve_coordinator();
+
+      /**
+       * If in the RENDERING state, block until the worker threads have
+       * finished. Unlike is_done this does not draw to the screen, so it can
+       * be used without a window.
+       */
+      void wait_until_done();
+
+      /**
+       * Render frames 0 to num_frames - 1 of an animation and save each to
+       * a png file named prefix followed by its four digit frame number.
+       * Needs a camera and a frame size, but no scene: make_scene is called
+       * for the scene of each frame, up to VIDEO_FRAMES_AHEAD frames ahead
+       * of the first unfinished one, and their BVHs are built while the
+       * earlier frames render. Worker threads that run out of tiles of a
+       * frame go on with the next one, so that the tail of one frame
+       * overlaps the start of the next. Returns once all frames are saved,
+       * or handed to the image writer.
+       */
+      void render_frames(size_t num_frames,
+                         const std::function<Scene*(size_t)>& make_scene,
+                         const std::string& prefix);
+
     private:
 
       /**
@@ -156,36 +317,298 @@ namespace CMU462 {
        */
       bool has_valid_configuration();
 
+      /**
+       * Set up the buffers and the work queue of a render, and start the
+       * checkpoint thread if there is one, but no worker threads.
+       */
+      void prepare_render();
+
       /**
        * Build acceleration structures.
        */
       void build_accel();
 
+      /**
+       * Set up the sampler of the lights of the scene, for the BVH of the
+       * scene.
+       */
+      void build_light_sampler();
+
+      /**
+       * Collect the primitives of the top level BVH from the scene. Mesh
+       * instances are added as instances of the BVH of their mesh, which is
+       * taken from meshAccels or built if there is none. The primitives of
+       * the other objects, the instances and the BVHs they use are also
+       * returned in object_primitives, instances and accels, and the number
+       * of BVHs built is returned.
+       */
+      size_t collect_primitives(std::vector<StaticScene::Primitive*>& primitives,
+          std::vector<StaticScene::Primitive*>& object_primitives,
+          std::vector<BVHInstance*>& instances,
+          std::map<const StaticScene::Mesh*, MeshBVH>& accels);
+
+      /**
+       * Replace the primitives of objects, the mesh instances and their BVHs
+       * with the ones returned by collect_primitives, freeing those no longer
+       * used. Must only be called once the top level BVH no longer refers to
+       * the old ones.
+       */
+      void replace_instances(std::vector<StaticScene::Primitive*>& object_primitives,
+          std::vector<BVHInstance*>& instances,
+          std::map<const StaticScene::Mesh*, MeshBVH>& accels);
+
+      /**
+       * Delete a scene the path tracer was given, but not the environment
+       * light, which the path tracer added to it and shares between frames.
+       */
+      void delete_scene(Scene* scene);
+
       /**
        * Visualize acceleration structures.
        */
       void visualize_accel() const;
 
       /**
-       * Trace an ray in the scene.
+       * Trace an ray in the scene, sampling with the given generator.
+       */
+      Spectrum trace_ray(const Ray& ray, RNG& rng);
+
+      /**
+       * Follow the path of a ray that was already intersected with the
+       * scene: isect is its hit, or NULL if it hit nothing.
+       */
+      Spectrum trace_hit(const Ray& ray, const StaticScene::Intersection* isect,
+                         RNG& rng);
+
+      /**
+       * Trace shadow rays and return the radiance of those that nothing
+       * blocks. With ray packets, the rays are tested in packets, which
+       * suits the rays of a hit, from the same point towards samples of the
+       * same lights.
+       */
+      Spectrum trace_shadows(const ShadowRay* shadows, size_t n);
+
+      /**
+       * Radiance along a ray that hits nothing.
+       */
+      Spectrum escaped(const Ray& ray);
+
+      /**
+       * Shade the hit of a ray: return the radiance it emits, queue the shadow
+       * rays of its direct lighting in shadows, and store the ray the path
+       * continues along in next, with the weight of its radiance in
+       * next_weight, which is black where the path ends. Shared by trace_ray
+       * and the wavefront engine, which trace the shadow and next rays.
+       */
+      Spectrum shade(const Ray& ray, const StaticScene::Intersection& isect,
+                     RNG& rng, std::vector<ShadowRay>& shadows, Ray* next,
+                     Spectrum* next_weight);
+
+      /**
+       * Camera ray i of the num_samples of a pass through the pixel with the
+       * given coordinate, whose pixel sampler takes the given seed.
+       */
+      Ray camera_ray(size_t x, size_t y, size_t i, size_t num_samples,
+                     uint32_t seed);
+
+      /**
+       * Trace camera rays through the pixel with the given coordinate and
+       * return their average. Every path takes its random numbers from a
+       * generator seeded by rng, so the wavefront engine, which traces the
+       * paths side by side, can take the same ones.
+       */
+      Spectrum raytrace_pixel(size_t x, size_t y, size_t num_samples, RNG& rng);
+
+      /**
+       * Trace the camera rays of a pass over the pixels [x0, x1) x [y0, y1)
+       * of a tile, and blend their averages into the sample buffer and pixel
+       * statistics, for raytrace_tile. The camera rays of one sample of all
+       * pixels form a packet. Returns the number of pixels that need more
+       * passes with adaptive sampling.
        */
-      Spectrum trace_ray(const Ray& ray);
+      size_t raytrace_block(size_t x0, size_t y0, size_t x1, size_t y1,
+                            size_t num_samples_tile, size_t num_samples);
 
       /**
-       * Trace a camera ray given by the pixel coordinate.
+       * Trace the camera rays of a pass over a tile as wavefronts, with the
+       * same random numbers as raytrace_tile, and blend their averages into
+       * the sample buffer and pixel statistics like it does. Stores the
+       * number of pixels that need more passes in remaining and the number
+       * of rays traced in rays. Returns false if the render was stopped.
        */
-      Spectrum raytrace_pixel(size_t x, size_t y);
+      bool raytrace_tile_wavefront(int tile_x, int tile_y, int tile_w,
+                                   int tile_h, size_t num_samples_tile,
+                                   size_t num_samples, size_t* remaining,
+                                   size_t* rays);
 
       /**
-       * Raytrace a tile of the scene and update the frame buffer. Is run
-       * in a worker thread.
+       * Stages of the wavefront engine, over the queues of the calling
+       * thread: intersect the rays of a bounce, shade their hits in order of
+       * BSDF type, and trace the shadow rays the shading queued.
        */
-      void raytrace_tile(int tile_x, int tile_y, int tile_w, int tile_h);
+      void wavefront_intersect(Wavefront& wf);
+      void wavefront_shade(Wavefront& wf);
+      void wavefront_shadows(Wavefront& wf);
+
+      /**
+       * Number of camera rays per pixel that the whole image can still take
+       * in the time left of the budget, at the rate the render has traced
+       * them so far.
+       */
+      double budget_samples_left();
+
+      /**
+       * Number of camera rays per pixel that the whole image can take within
+       * the time budget, at the rate the render has traced them so far, and
+       * at most ns_aa.
+       */
+      size_t budget_samples_per_pixel();
+
+      /**
+       * Number of camera rays per pixel to take in the next pass over a tile
+       * that has the given number so far, or 0 if the tile needs no more.
+       */
+      size_t pass_samples(size_t num_samples_tile);
+
+      /**
+       * Whether a tile with the given number of camera rays per pixel needs
+       * no more passes (not counting adaptive sampling).
+       */
+      bool tile_finished(size_t num_samples_tile);
+
+      /**
+       * Raytrace a pass over a tile of the scene, add it to the average of
+       * the earlier passes and update the frame buffer. Is run in a worker
+       * thread. Returns the number of pixels in the tile that need more
+       * passes: all of them until ns_aa samples per pixel are taken (or as
+       * many as fit in the time budget), or with adaptive sampling those
+       * that have not converged yet.
+       */
+      size_t raytrace_tile(int tile_x, int tile_y, int tile_w, int tile_h);
 
       /**
        * Implementation of a ray tracer worker thread
+       * \param worker index of the worker, which owns that deque of workQueue
+       */
+      void worker_thread(size_t worker);
+
+      /**
+       * Copy the tiles that no worker is writing to into the checkpoint
+       * buffers. Tiles being written keep the copy of their previous pass, so
+       * the checkpoint is always made of whole passes, and the workers never
+       * wait for it.
+       */
+      void snapshot_checkpoint();
+
+      /**
+       * Write the checkpoint buffers to the checkpoint file.
+       */
+      void save_checkpoint();
+
+      /**
+       * Load the sample buffer, the samples taken per tile and the pixel
+       * statistics from the checkpoint file, if it was saved by a render of
+       * the same image. Returns whether it was.
        */
-      void worker_thread();
+      bool load_checkpoint();
+
+      /**
+       * Fill in the settings of the path tracer that a checkpoint must have
+       * been rendered with to be resumed.
+       */
+      void set_checkpoint_settings(CheckpointHeader* header) const;
+
+      /**
+       * Hash of the geometry and lights of the scene, which a checkpoint
+       * must have been rendered from to be resumed.
+       */
+      uint64_t scene_hash() const;
+
+      /**
+       * Writes a checkpoint every checkpointInterval seconds while rendering,
+       * and a last one once the render is over.
+       */
+      void checkpoint_thread();
+
+      /**
+       * Wait for the checkpoint thread to write its last checkpoint.
+       */
+      void join_checkpoint_thread();
+
+      /**
+       * Count a worker thread as finished, and finish the render once all of
+       * them are.
+       * \param timer started when the worker was
+       */
+      void worker_done(Timer& timer);
+
+      /**
+       * Open the socket remote workers connect to, unless it is open.
+       * Returns whether it is.
+       */
+      bool listen_for_workers();
+
+      /**
+       * Hands out tile passes to remote workers and blends their results
+       * into the sample buffer, like a worker thread that owns the
+       * MAX_REMOTE_WORKERS deques of workQueue after those of the worker
+       * threads. Tiles of remote workers that fail are put back.
+       */
+      void coordinator_thread();
+
+      /**
+       * Blend a pass over a tile rendered by a remote worker into the sample
+       * buffer, like raytrace_tile. Returns the number of pixels that need
+       * more passes.
+       */
+      size_t add_remote_pass(const WorkItem& work, size_t first_sample,
+                             size_t num_samples, const Spectrum* pass);
+
+      /**
+       * Raytrace a pass over a tile for a coordinator: trace num_samples
+       * camera rays per pixel, with the random numbers raytrace_tile would
+       * use for the pass after first_sample rays, and return the average of
+       * each pixel, row by row, in pass.
+       */
+      void raytrace_tile_pass(int tile_x, int tile_y, int tile_w, int tile_h,
+                              size_t first_sample, size_t num_samples,
+                              std::vector<Spectrum>& pass);
+
+      /**
+       * Render the tile passes the coordinator sends over a connection.
+       */
+      void remote_worker_thread(int socket);
+
+      /**
+       * A path tracer with the same settings, but without a camera, scene,
+       * time budget, checkpoints or remote workers, to render one frame of
+       * render_frames. It starts out with the given mesh BVHs, so that the
+       * meshes that did not change since the last frame keep theirs.
+       */
+      PathTracer* new_frame_tracer(
+          const std::map<const StaticScene::Mesh*, MeshBVH>& mesh_accels);
+
+      /**
+       * Worker thread of render_frames: renders tiles of the first frame
+       * that has any left, and saves each frame it finishes.
+       * \param worker index of the worker in the work queues of the frames
+       */
+      void frame_worker_thread(size_t worker, size_t num_frames,
+                               const std::string& prefix);
+
+      /**
+       * Save a frame of render_frames and free its scene and buffers.
+       */
+      void finish_frame(size_t frame, size_t num_frames,
+                        const std::string& prefix);
+
+      /**
+       * Write an image to a png file with the image writer, or right away if
+       * there is none.
+       */
+      void write_png(const std::string& filename,
+                     std::vector<uint32_t>&& pixels, size_t w, size_t h,
+                     bool flip);
 
       /**
        * Log a ray miss.
@@ -219,18 +642,34 @@ namespace CMU462 {
       size_t ns_diff;       ///< number of samples - diffuse surfaces
       size_t ns_glsy;       ///< number of samples - glossy surfaces
       size_t ns_refr;       ///< number of samples - refractive surfaces
+      size_t samplesPerPass;  ///< camera rays per pixel in a pass, 0 for ns_aa
+      double adaptiveTolerance;  ///< relative error of converged pixels, 0 for off
+      uint64_t randomSeed;  ///< seed of the random numbers of the render
+      double timeBudget;    ///< seconds a render may take, 0 for no limit
 
       // Integration state //
 
-      vector<int> tile_samples; ///< current sample rate for tile
+      vector<int> tile_samples; ///< samples per pixel taken so far in tile
+      vector<PixelStats> pixelStats;  ///< per pixel statistics (adaptive only)
       size_t num_tiles_w;       ///< number of tiles along width of the image
       size_t num_tiles_h;       ///< number of tiles along height of the image
+      Timer renderTimer;        ///< started with the render
+      std::atomic<size_t> samplesTaken;  ///< camera rays traced, all pixels
 
       // Components //
 
       BVHAccel* bvh;                 ///< BVH accelerator aggregate
+      std::vector<BVHInstance*> instances;  ///< mesh instances in bvh
+      std::map<const StaticScene::Mesh*, MeshBVH> meshAccels;  ///< their BVHs
+      std::vector<StaticScene::Primitive*> objectPrimitives;  ///< the rest of bvh
       EnvironmentLight *envLight;    ///< environment map
       Sampler2D* gridSampler;        ///< samples unit grid
+      PixelSampler2D* pixelSampler;  ///< samples of the camera rays of a pixel
+      std::string pixelSamplerName;  ///< name of pixelSampler
+      LightSampler* lightSampler;    ///< picks a light per shadow ray
+      std::string lightSamplerName;  ///< name of lightSampler
+      bool wavefront;                ///< trace tiles as wavefronts of rays
+      bool rayPackets;               ///< trace coherent rays as packets
       Sampler3D* hemisphereSampler;  ///< samples unit hemisphere
       HDRImageBuffer sampleBuffer;   ///< sample buffer
       ImageBuffer frameBuffer;       ///< frame buffer
@@ -240,11 +679,54 @@ namespace CMU462 {
 
       size_t numWorkerThreads;
       size_t imageTileSize;
+      size_t bvhWidth;  ///< requested BVH branching factor
+      double bvhRefitRatio;  ///< SAH degradation at which refits rebuild
+      std::string bvhCacheDir;  ///< directory of the BVH cache, or empty
 
       bool continueRaytracing;                  ///< rendering should continue
       std::vector<std::thread*> workerThreads;  ///< pool of worker threads
       std::atomic<int> workerDoneCount;         ///< worker threads management
-      WorkQueue<WorkItem> workQueue;            ///< queue of work for the workers
+      std::atomic<bool> renderFinished;         ///< a worker wrapped it up
+      std::atomic<size_t> rayCount;             ///< rays traced by finished workers
+      WorkStealingQueue<WorkItem> workQueue;    ///< queue of work for the workers
+
+      // Checkpoints //
+
+      std::string checkpointPath;  ///< file to save checkpoints to, or empty
+      double checkpointInterval;   ///< seconds between checkpoints
+      bool resumeCheckpoint;       ///< the next render resumes the checkpoint
+      size_t resumedSamples;       ///< camera rays traced before resuming
+      std::thread* checkpointThread;  ///< writes checkpoints while rendering
+      std::mutex checkpointMutex;     ///< guards checkpointStop
+      std::condition_variable checkpointCond;  ///< signals checkpointStop
+      bool checkpointStop;            ///< the render is over
+      std::unique_ptr<std::atomic<uint32_t>[]> tileVersions;  ///< odd while a
+                                                              ///< tile is written
+      HDRImageBuffer checkpointBuffer;        ///< sample buffer of the checkpoint
+      vector<int> checkpointTileSamples;      ///< tile_samples of the checkpoint
+      vector<PixelStats> checkpointPixelStats;  ///< pixelStats of the checkpoint
+      uint64_t checkpointSceneHash;  ///< scene_hash() of the render
+
+      // Distributed rendering //
+
+      int listenPort;                 ///< port to take remote workers on, or 0
+      int listenSocket;               ///< socket listening on it, or -1
+      bool coordinating;              ///< the render has a coordinator thread
+      std::thread* coordinatorThread; ///< serves the remote workers
+      std::string coordinatorAddress;       ///< coordinator to render for
+      std::vector<int> coordinatorSockets;  ///< connections to it
+
+      // Animations //
+
+      std::unique_ptr<std::atomic<PathTracer*>[]> frameTracers;  ///< of each
+                                    ///< frame, set once its BVH is built
+      std::unique_ptr<std::atomic<bool>[]> framesFinished;  ///< frame saved
+      std::atomic<size_t> firstFrame;  ///< first frame not finished
+      std::unique_ptr<std::atomic<size_t>[]> workerFrames;  ///< first frame
+                                    ///< each worker may still look at
+      std::mutex frameMutex;           ///< taken to change firstFrame or
+                                       ///< set up a frame
+      std::condition_variable frameCond;  ///< signals either
 
       // Tonemapping Controls //
 
@@ -253,9 +735,14 @@ namespace CMU462 {
       float tm_key;                             ///< key value
       float tm_wht;                             ///< white point
 
+      // Outputs //
+
+      std::string sampleHeatmapPath;  ///< where to save the spp heatmap, or empty
+      ImageWriter* imageWriter;       ///< writes images, or NULL
+
       // Visualizer Controls //
 
-      std::stack<BVHNode*> selectionHistory;  ///< node selection history
+      std::stack<size_t> selectionHistory;    ///< node selection history
       std::vector<LoggedRay> rayLog;          ///< ray tracing log
       bool show_rays;                         ///< show rays from raylog
 
@@ -0,0 +1,83 @@
+#ifndef CMU462_RNG_H
+#define CMU462_RNG_H
+
+#include <stdint.h>
+
+namespace CMU462 {
+
+  /**
+   * A small, fast pseudo random number generator (PCG32, O'Neill 2014).
+   * Unlike std::rand it has no global state: every render thread owns its
+   * own generators, so sampling neither serializes the threads nor depends
+   * on how they interleave. Seeding a generator with the pixel and the
+   * index of its first sample makes a render reproducible for a given seed,
+   * whichever thread renders the pixel.
+   */
+  class RNG {
+    public:
+
+      /**
+       * Create a generator for the given seed. Generators with the same seed
+       * but different streams give independent sequences.
+       */
+      RNG(uint64_t seed = 0, uint64_t stream = 0) {
+        this->seed(seed, stream);
+      }
+
+      /**
+       * Restart the generator.
+       */
+      void seed(uint64_t seed, uint64_t stream = 0) {
+        state = 0;
+        inc = (mix(stream) << 1) | 1;
+        next_uint();
+        state += mix(seed);
+        next_uint();
+      }
+
+      /**
+       * Uniformly distributed 32 bit integer.
+       */
+      uint32_t next_uint() {
+        uint64_t old = state;
+        state = old * 6364136223846793005ULL + inc;
+        uint32_t xorshifted = (uint32_t) (((old >> 18) ^ old) >> 27);
+        uint32_t rot = (uint32_t) (old >> 59);
+        return (xorshifted >> rot) | (xorshifted << ((-rot) & 31));
+      }
+
+      /**
+       * Uniformly distributed float in [0, 1).
+       */
+      float next_float() {
+        return (next_uint() >> 8) * (1.f / (1 << 24));
+      }
+
+      /**
+       * Uniformly distributed double in [0, 1).
+       */
+      double next_double() {
+        return next_uint() * (1.0 / 4294967296.0);
+      }
+
+    private:
+
+      /**
+       * Scramble a seed so that nearby seeds give unrelated states
+       * (splitmix64 finalizer).
+       */
+      static uint64_t mix(uint64_t x) {
+        x += 0x9e3779b97f4a7c15ULL;
+        x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+        return x ^ (x >> 31);
+      }
+
+      uint64_t state;  ///< current state
+      uint64_t inc;    ///< stream, always odd
+
+  }; // class RNG
+
+} // namespace CMU462
+
+#endif // CMU462_RNG_H
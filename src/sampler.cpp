@@ -1,24 +1,30 @@
 #include "sampler.h"
 
+#include "CMU462/timer.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <functional>
+#include <thread>
+#include <vector>
+
 namespace CMU462 {
 
   // Uniform Sampler2D Implementation //
 
-  Vector2D UniformGridSampler2D::get_sample() const {
-
-    // TODO:
-    // Implement uniform 2D grid sampler
+  Vector2D UniformGridSampler2D::get_sample(RNG& rng) const {
 
-    return Vector2D(0.5,0.5);
+    return Vector2D(rng.next_double(), rng.next_double());
 
   }
 
   // Uniform Hemisphere Sampler3D Implementation //
 
-  Vector3D UniformHemisphereSampler3D::get_sample() const {
+  Vector3D UniformHemisphereSampler3D::get_sample(RNG& rng) const {
 
-    double Xi1 = (double)(std::rand()) / RAND_MAX;
-    double Xi2 = (double)(std::rand()) / RAND_MAX;
+    double Xi1 = rng.next_double();
+    double Xi2 = rng.next_double();
 
     double theta = acos(Xi1);
     double phi = 2.0 * PI * Xi2;
@@ -31,15 +37,426 @@ namespace CMU462 {
 
   }
 
-  Vector3D CosineWeightedHemisphereSampler3D::get_sample() const {
+  Vector3D CosineWeightedHemisphereSampler3D::get_sample(RNG& rng) const {
     float f;
-    return get_sample(&f);
+    return get_sample(rng, &f);
   }
 
-  Vector3D CosineWeightedHemisphereSampler3D::get_sample(float *pdf) const {
+  Vector3D CosineWeightedHemisphereSampler3D::get_sample(RNG& rng, float *pdf) const {
     // You may implement this, but don't have to.
     return Vector3D(0, 0, 1);
   }
 
+  // Alias Table //
+
+  void AliasTable::build(const std::vector<float>& weights) {
+
+    size_t n = weights.size();
+    bins.resize(n);
+    totalWeight = 0;
+    for (float w : weights) totalWeight += w;
+    if (!n) return;
+
+    // Scale the weights to an average of one, the size of a bin. Bins of
+    // outcomes below that are filled up by outcomes above it, which then
+    // count as below or above it with what they have left.
+    std::vector<double> scaled(n);
+    std::vector<uint32_t> small, large;
+    for (size_t i = 0; i < n; ++i) {
+      scaled[i] = totalWeight > 0 ? weights[i] * n / totalWeight : 1;
+      bins[i].pmf = totalWeight > 0 ? weights[i] / totalWeight : 1.0 / n;
+      (scaled[i] < 1 ? small : large).push_back(i);
+    }
+    while (!small.empty() && !large.empty()) {
+      uint32_t s = small.back(), l = large.back();
+      small.pop_back();
+      bins[s].threshold = scaled[s];
+      bins[s].alias = l;
+      scaled[l] -= 1 - scaled[s];
+      if (scaled[l] < 1) {
+        large.pop_back();
+        small.push_back(l);
+      }
+    }
+    // what is left is one up to rounding errors
+    for (uint32_t i : small) { bins[i].threshold = 1; bins[i].alias = i; }
+    for (uint32_t i : large) { bins[i].threshold = 1; bins[i].alias = i; }
+  }
+
+  // Pixel Samplers //
+
+  // Hash of a 32 bit integer (lowbias32, Wellons).
+  static uint32_t hash(uint32_t x) {
+    x ^= x >> 16; x *= 0x7feb352d;
+    x ^= x >> 15; x *= 0x846ca68b;
+    x ^= x >> 16;
+    return x;
+  }
+
+  // Combine a value into a seed.
+  static uint32_t hash_combine(uint32_t seed, uint32_t v) {
+    return seed ^ (hash(v) + 0x9e3779b9 + (seed << 6) + (seed >> 2));
+  }
+
+  static uint32_t reverse_bits(uint32_t x) {
+    x = ((x >> 1) & 0x55555555) | ((x & 0x55555555) << 1);
+    x = ((x >> 2) & 0x33333333) | ((x & 0x33333333) << 2);
+    x = ((x >> 4) & 0x0f0f0f0f) | ((x & 0x0f0f0f0f) << 4);
+    x = ((x >> 8) & 0x00ff00ff) | ((x & 0x00ff00ff) << 8);
+    return (x >> 16) | (x << 16);
+  }
+
+  static double to_unit(uint32_t x) {
+    return x * (1.0 / 4294967296.0);
+  }
+
+  Vector2D RandomPixelSampler2D::get_sample(uint32_t index, uint32_t count,
+      uint32_t dimension, uint32_t seed) const {
+
+    RNG rng(((uint64_t) seed << 32) | dimension, index);
+    return Vector2D(rng.next_double(), rng.next_double());
+  }
+
+  // Random permutation of [0, l) indexed by p (Kensler 2013).
+  static uint32_t permute(uint32_t i, uint32_t l, uint32_t p) {
+    uint32_t w = l - 1;
+    w |= w >> 1; w |= w >> 2; w |= w >> 4; w |= w >> 8; w |= w >> 16;
+    do {
+      i ^= p; i *= 0xe170893d;
+      i ^= p >> 16;
+      i ^= (i & w) >> 4;
+      i ^= p >> 8; i *= 0x0929eb3f;
+      i ^= p >> 23;
+      i ^= (i & w) >> 1; i *= 1 | p >> 27;
+      i *= 0x6935fa69;
+      i ^= (i & w) >> 11; i *= 0x74dcb303;
+      i ^= (i & w) >> 2; i *= 0x9e501cc3;
+      i ^= (i & w) >> 2; i *= 0xc860a3df;
+      i &= w;
+      i ^= i >> 5;
+    } while (i >= l);
+    return (i + p) % l;
+  }
+
+  // Random number in [0, 1) indexed by i and p (Kensler 2013).
+  static double randfloat(uint32_t i, uint32_t p) {
+    i ^= p;
+    i ^= i >> 17; i ^= i >> 10; i *= 0xb36534e5;
+    i ^= i >> 12; i ^= i >> 21; i *= 0x93fc4795;
+    i ^= 0xdf6e307f; i ^= i >> 17; i *= 1 | p >> 18;
+    return to_unit(i);
+  }
+
+  Vector2D StratifiedPixelSampler2D::get_sample(uint32_t index, uint32_t count,
+      uint32_t dimension, uint32_t seed) const {
+
+    // an m by n grid of cells, and count strata along each axis
+    uint32_t p = hash_combine(seed, dimension);
+    count = std::max<uint32_t>(count, 1);
+    uint32_t m = std::max<uint32_t>((uint32_t) sqrt((double) count), 1);
+    uint32_t n = (count + m - 1) / m;
+    uint32_t s = permute(index % count, count, p * 0x51633e2d);
+    uint32_t sx = permute(s % m, m, p * 0x68bc21eb);
+    uint32_t sy = permute(s / m, n, p * 0x02e5be93);
+    double jx = randfloat(s, p * 0x967a889b);
+    double jy = randfloat(s, p * 0x368cc8b7);
+    return Vector2D((sx + (sy + jx) / n) / m, (s + jy) / count);
+  }
+
+  static const uint32_t HALTON_PRIMES[] = {
+      2,   3,   5,   7,  11,  13,  17,  19,  23,  29,  31,  37,  41,  43,  47,  53,
+     59,  61,  67,  71,  73,  79,  83,  89,  97, 101, 103, 107, 109, 113, 127, 131
+  };
+  static const uint32_t NUM_HALTON_PRIMES =
+    sizeof(HALTON_PRIMES) / sizeof(HALTON_PRIMES[0]);
+
+  static double radical_inverse(uint32_t index, uint32_t base) {
+    double inv_base = 1.0 / base, scale = inv_base, result = 0;
+    while (index) {
+      result += (index % base) * scale;
+      index /= base;
+      scale *= inv_base;
+    }
+    return result;
+  }
+
+  Vector2D HaltonPixelSampler2D::get_sample(uint32_t index, uint32_t count,
+      uint32_t dimension, uint32_t seed) const {
+
+    // Dimensions past the table reuse its bases, with another shift.
+    RNG rng(seed, dimension);
+    uint32_t b = 2 * dimension % NUM_HALTON_PRIMES;
+    double x = radical_inverse(index, HALTON_PRIMES[b]) + rng.next_double();
+    double y = radical_inverse(index, HALTON_PRIMES[b + 1]) + rng.next_double();
+    return Vector2D(x - floor(x), y - floor(y));
+  }
+
+  // Owen scrambling of the bits of x, from the most significant one down.
+  static uint32_t nested_uniform_scramble(uint32_t x, uint32_t seed) {
+    x = reverse_bits(x);
+    x += seed;
+    x ^= x * 0x6c50b47c;
+    x ^= x * 0xb82f1e52;
+    x ^= x * 0xc7afe638;
+    x ^= x * 0x8d22f6e6;
+    return reverse_bits(x);
+  }
+
+  Vector2D SobolPixelSampler2D::get_sample(uint32_t index, uint32_t count,
+      uint32_t dimension, uint32_t seed) const {
+
+    seed = hash_combine(seed, dimension);
+    index = nested_uniform_scramble(index, seed);
+
+    // first dimension: van der Corput, second: direction numbers of x + 1
+    uint32_t x = reverse_bits(index);
+    uint32_t y = 0;
+    for (uint32_t v = 1u << 31; index; index >>= 1, v ^= v >> 1) {
+      if (index & 1) y ^= v;
+    }
+
+    return Vector2D(to_unit(nested_uniform_scramble(x, hash_combine(seed, 0))),
+                    to_unit(nested_uniform_scramble(y, hash_combine(seed, 1))));
+  }
+
+  PixelSampler2D* new_pixel_sampler(const std::string& name) {
+    if (name == "random") return new RandomPixelSampler2D();
+    if (name == "stratified") return new StratifiedPixelSampler2D();
+    if (name == "halton") return new HaltonPixelSampler2D();
+    if (name == "sobol") return new SobolPixelSampler2D();
+    return NULL;
+  }
+
+  // Benchmark //
+
+  // Uniform hemisphere sampling as it was done with std::rand, for comparison.
+  static Vector3D rand_hemisphere_sample() {
+
+    double Xi1 = (double)(std::rand()) / RAND_MAX;
+    double Xi2 = (double)(std::rand()) / RAND_MAX;
+
+    double theta = acos(Xi1);
+    double phi = 2.0 * PI * Xi2;
+
+    return Vector3D(sinf(theta) * cosf(phi), sinf(theta) * sinf(phi), cosf(theta));
+  }
+
+  void benchmark_samplers() {
+
+    static const size_t thread_counts[] = { 1, 2, 4, 8, 16 };
+    static const size_t num_samples = 1 << 20;
+
+    printf("[Sampler] Uniform hemisphere samples per second per thread "
+           "(%zu samples per thread, %u cores)\n", num_samples,
+           std::thread::hardware_concurrency());
+    printf("threads    std::rand          RNG\n");
+
+    for (size_t num_threads : thread_counts) {
+      double rate[2];
+      for (int with_rng = 0; with_rng < 2; ++with_rng) {
+        std::vector<double> sums(num_threads);
+        std::vector<std::thread> threads;
+        Timer timer;
+        timer.start();
+        for (size_t t = 0; t < num_threads; ++t) {
+          threads.push_back(std::thread([&sums, t, with_rng]() {
+            UniformHemisphereSampler3D sampler;
+            RNG rng(0, t);
+            double sum = 0;
+            for (size_t i = 0; i < num_samples; ++i) {
+              sum += with_rng ? sampler.get_sample(rng).z
+                              : rand_hemisphere_sample().z;
+            }
+            sums[t] = sum;
+          }));
+        }
+        for (std::thread& t : threads) t.join();
+        timer.stop();
+        rate[with_rng] = num_samples / timer.duration();
+      }
+      printf("%7zu  %9.2fM/s  %9.2fM/s\n", num_threads,
+             rate[0] * 1e-6, rate[1] * 1e-6);
+    }
+  }
+
+  void benchmark_sampler_convergence() {
+
+    static const char* sampler_names[] = { "random", "stratified", "halton", "sobol" };
+    static const uint32_t sample_counts[] = { 1, 4, 16, 64, 256, 1024 };
+    static const uint32_t num_pixels = 1024;
+
+    // Test integrals over the samples of dimensions 0 and 1 with their exact
+    // values: a smooth one, one with an edge, and one over both dimensions
+    // (which is only right if the dimensions are decorrelated).
+    struct Integrand {
+      const char* name;
+      double (*f)(const Vector2D& a, const Vector2D& b);
+      double exact;
+    };
+    double gauss = 0.5 * sqrt(PI) * erf(1.0);
+    const Integrand integrands[] = {
+      { "smooth: exp(-|a|^2)",
+        [](const Vector2D& a, const Vector2D& b) { return exp(-a.norm2()); },
+        gauss * gauss },
+      { "edge: |a| < 1",
+        [](const Vector2D& a, const Vector2D& b) { return a.norm2() < 1 ? 1.0 : 0.0; },
+        PI / 4 },
+      { "two dimensions: (|a| < 1) exp(-|b|^2)",
+        [](const Vector2D& a, const Vector2D& b) {
+          return a.norm2() < 1 ? exp(-b.norm2()) : 0.0;
+        },
+        PI / 4 * gauss * gauss },
+    };
+
+    printf("[Sampler] RMSE of %u pixel estimates against the exact value\n",
+           num_pixels);
+    for (const Integrand& integrand : integrands) {
+      printf("%s\n    spp", integrand.name);
+      for (const char* name : sampler_names) printf("  %10s", name);
+      printf("\n");
+
+      for (uint32_t count : sample_counts) {
+        printf("%7u", count);
+        for (const char* name : sampler_names) {
+          PixelSampler2D* sampler = new_pixel_sampler(name);
+          double sum_sq = 0;
+          for (uint32_t pixel = 0; pixel < num_pixels; ++pixel) {
+            uint32_t seed = hash(pixel);
+            double sum = 0;
+            for (uint32_t i = 0; i < count; ++i) {
+              sum += integrand.f(sampler->get_sample(i, count, 0, seed),
+                                 sampler->get_sample(i, count, 1, seed));
+            }
+            double error = sum / count - integrand.exact;
+            sum_sq += error * error;
+          }
+          delete sampler;
+          printf("  %10.2e", sqrt(sum_sq / num_pixels));
+        }
+        printf("\n");
+      }
+    }
+  }
+
+  // Whether no cell of an nx by ny grid over the unit square holds more
+  // than one of the points (so every cell holds one if there are nx * ny).
+  static bool at_most_one_per_cell(const std::vector<Vector2D>& points,
+                                   uint32_t nx, uint32_t ny) {
+    std::vector<bool> used((size_t) nx * ny, false);
+    for (const Vector2D& p : points) {
+      if (!(p.x >= 0 && p.x < 1 && p.y >= 0 && p.y < 1)) return false;
+      size_t cell = (size_t) (p.y * ny) * nx + (size_t) (p.x * nx);
+      if (used[cell]) return false;
+      used[cell] = true;
+    }
+    return true;
+  }
+
+  bool check_pixel_samplers() {
+
+    static const uint32_t num_seeds = 64;
+    static const uint32_t num_dimensions = 4;
+
+    // Every check runs on the points of every count, seed and dimension.
+    struct Check {
+      const char* sampler;
+      const char* property;
+      size_t sets, failures;
+    };
+    std::vector<Check> checks;
+    std::vector<Vector2D> points;
+
+    typedef std::function<bool(uint32_t count, uint32_t dim)> Test;
+    auto run = [&](const char* name, const char* property,
+                   const std::vector<uint32_t>& counts, const Test& test) {
+      PixelSampler2D* sampler = new_pixel_sampler(name);
+      Check check = { name, property, 0, 0 };
+      for (uint32_t count : counts) {
+        for (uint32_t seed = 0; seed < num_seeds; ++seed) {
+          for (uint32_t dim = 0; dim < num_dimensions; ++dim) {
+            points.resize(count);
+            for (uint32_t i = 0; i < count; ++i) {
+              points[i] = sampler->get_sample(i, count, dim, hash(seed));
+            }
+            check.sets++;
+            if (!test(count, dim)) check.failures++;
+          }
+        }
+      }
+      delete sampler;
+      checks.push_back(check);
+    };
+
+    // Correlated multi-jittered: count strata along each axis, and one
+    // sample per cell of the m by n grid if count = m * n (otherwise the
+    // strata along y do not line up with the rows of the grid).
+    std::vector<uint32_t> cmj_counts;
+    for (uint32_t count = 1; count <= 64; ++count) cmj_counts.push_back(count);
+    cmj_counts.insert(cmj_counts.end(), { 100, 255, 256, 1000, 1024 });
+    run("stratified", "count strata along x and y", cmj_counts,
+        [&](uint32_t count, uint32_t dim) {
+          uint32_t m = std::max<uint32_t>((uint32_t) sqrt((double) count), 1);
+          uint32_t n = (count + m - 1) / m;
+          return at_most_one_per_cell(points, m * n, 1) &&
+                 at_most_one_per_cell(points, 1, count);
+        });
+    run("stratified", "m by n grid cells", cmj_counts,
+        [&](uint32_t count, uint32_t dim) {
+          uint32_t m = std::max<uint32_t>((uint32_t) sqrt((double) count), 1);
+          uint32_t n = (count + m - 1) / m;
+          return m * n != count || at_most_one_per_cell(points, m, n);
+        });
+
+    // Halton: the first b^k points of the radical inverse in base b are
+    // b^-k apart, and stay so with the toroidal shift, so that every
+    // interval of length b^-k holds one of them.
+    std::vector<uint32_t> halton_counts;
+    for (uint32_t b = 0; b < 2 * num_dimensions; ++b) {
+      for (uint32_t count = 1; count <= 4096; count *= HALTON_PRIMES[b]) {
+        halton_counts.push_back(count);
+      }
+    }
+    std::sort(halton_counts.begin(), halton_counts.end());
+    halton_counts.erase(std::unique(halton_counts.begin(), halton_counts.end()),
+                        halton_counts.end());
+    run("halton", "b^k intervals along x and y", halton_counts,
+        [&](uint32_t count, uint32_t dim) {
+          // count is a power of the base of x, of y, or of neither
+          for (uint32_t axis = 0; axis < 2; ++axis) {
+            uint32_t k = 1;
+            while (k < count) k *= HALTON_PRIMES[2 * dim + axis];
+            if (k == count && !at_most_one_per_cell(points, axis ? 1 : count,
+                                                    axis ? count : 1)) {
+              return false;
+            }
+          }
+          return true;
+        });
+
+    // Owen scrambled Sobol: a (0, 2)-sequence in base 2, so that the points
+    // of a power of two count are a (0, k, 2)-net, with one point in every
+    // box of 2^a by 2^(k - a) cells.
+    std::vector<uint32_t> sobol_counts;
+    for (uint32_t count = 1; count <= 4096; count *= 2) sobol_counts.push_back(count);
+    run("sobol", "elementary intervals", sobol_counts,
+        [&](uint32_t count, uint32_t dim) {
+          for (uint32_t nx = 1; nx <= count; nx *= 2) {
+            if (!at_most_one_per_cell(points, nx, count / nx)) return false;
+          }
+          return true;
+        });
+
+    printf("[Sampler] Stratification of the pixel samplers (%u seeds, "
+           "%u dimensions)\n", num_seeds, num_dimensions);
+    printf("%10s %28s %8s %9s\n", "sampler", "property", "sets", "failures");
+    bool ok = true;
+    for (const Check& check : checks) {
+      printf("%10s %28s %8zu %9zu\n", check.sampler, check.property,
+             check.sets, check.failures);
+      if (check.failures) ok = false;
+    }
+    printf(ok ? "All samplers are stratified\n" : "STRATIFICATION FAILURES FOUND\n");
+    return ok;
+  }
 
 } // namespace CMU462
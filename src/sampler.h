@@ -5,6 +5,12 @@
 #include "CMU462/vector3D.h"
 #include "CMU462/misc.h"
 
+#include "rng.h"
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
 namespace CMU462 {
 
   /**
@@ -19,9 +25,10 @@ namespace CMU462 {
       virtual ~Sampler2D() { }
 
       /**
-       * Take a point sample of the unit square
+       * Take a point sample of the unit square, using the random numbers
+       * of the given generator
        */
-      virtual Vector2D get_sample() const = 0;
+      virtual Vector2D get_sample(RNG& rng) const = 0;
 
   }; // class Sampler2D
 
@@ -37,9 +44,10 @@ namespace CMU462 {
       virtual ~Sampler3D() { }
 
       /**
-       * Take a vector sample of the unit hemisphere
+       * Take a vector sample of the unit hemisphere, using the random
+       * numbers of the given generator
        */
-      virtual Vector3D get_sample() const = 0;
+      virtual Vector3D get_sample(RNG& rng) const = 0;
 
   }; // class Sampler3D
 
@@ -50,7 +58,7 @@ namespace CMU462 {
   class UniformGridSampler2D : public Sampler2D {
     public:
 
-      Vector2D get_sample() const;
+      Vector2D get_sample(RNG& rng) const;
 
   }; // class UniformSampler2D
 
@@ -60,7 +68,7 @@ namespace CMU462 {
   class UniformHemisphereSampler3D : public Sampler3D {
     public:
 
-      Vector3D get_sample() const;
+      Vector3D get_sample(RNG& rng) const;
 
   }; // class UniformHemisphereSampler3D
 
@@ -71,16 +79,176 @@ namespace CMU462 {
   class CosineWeightedHemisphereSampler3D : public Sampler3D {
     public:
 
-      Vector3D get_sample() const;
+      Vector3D get_sample(RNG& rng) const;
       // Also returns the pdf at the sample point for use in importance sampling.
-      Vector3D get_sample(float* pdf) const;
+      Vector3D get_sample(RNG& rng, float* pdf) const;
 
   }; // class UniformHemisphereSampler3D
 
   /**
-   * TODO (extra credit) :
-   * Jittered sampler implementations
+   * Samples one of a number of outcomes with probability proportional to
+   * its weight, in constant time (Vose's alias method): every outcome has a
+   * bin of equal probability, which holds the outcome itself up to a
+   * threshold and one other outcome, its alias, above it.
+   */
+  class AliasTable {
+    public:
+
+      /**
+       * Set up the table for the given non-negative weights. If they are all
+       * zero, all outcomes are equally likely.
+       */
+      void build(const std::vector<float>& weights);
+
+      /**
+       * Pick an outcome with a uniform random number in [0, 1).
+       */
+      size_t sample(double u) const {
+        double scaled = u * bins.size();
+        size_t i = std::min((size_t) scaled, bins.size() - 1);
+        return scaled - i < bins[i].threshold ? i : bins[i].alias;
+      }
+
+      /**
+       * Pick an outcome with the random numbers of the given generator.
+       */
+      size_t sample(RNG& rng) const { return sample(rng.next_double()); }
+
+      /**
+       * Probability of an outcome.
+       */
+      float pmf(size_t i) const { return bins[i].pmf; }
+
+      /**
+       * Sum of the weights.
+       */
+      double total() const { return totalWeight; }
+
+      /**
+       * Number of outcomes.
+       */
+      size_t size() const { return bins.size(); }
+
+    private:
+
+      struct Bin {
+        float threshold;  ///< fraction of the bin for the outcome itself
+        uint32_t alias;   ///< outcome of the rest of the bin
+        float pmf;        ///< probability of the outcome
+      };
+
+      std::vector<Bin> bins;  ///< one per outcome
+      double totalWeight;     ///< sum of the weights
+
+  }; // class AliasTable
+
+  /**
+   * Interface for generating the samples of a pixel: count points of the
+   * unit square for every dimension (pair of random numbers) of the paths
+   * through the pixel, e.g. dimension 0 for the position in the pixel and
+   * dimension 1 for the lens. The points of one dimension are spread out
+   * more evenly than independent random points, which lowers the variance
+   * of the pixel estimate. Different seeds (one per pixel and pass) give
+   * independent sets of points, and the dimensions are decorrelated from
+   * each other so that the points of one dimension say nothing about the
+   * points of another.
+   */
+  class PixelSampler2D {
+    public:
+
+      /**
+       * Virtual destructor.
+       */
+      virtual ~PixelSampler2D() { }
+
+      /**
+       * Take sample index of count samples of a dimension.
+       */
+      virtual Vector2D get_sample(uint32_t index, uint32_t count,
+                                  uint32_t dimension, uint32_t seed) const = 0;
+
+  }; // class PixelSampler2D
+
+  /**
+   * A PixelSampler2D with independent uniform random samples.
+   */
+  class RandomPixelSampler2D : public PixelSampler2D {
+    public:
+
+      Vector2D get_sample(uint32_t index, uint32_t count,
+                          uint32_t dimension, uint32_t seed) const;
+
+  }; // class RandomPixelSampler2D
+
+  /**
+   * A PixelSampler2D with jittered samples, one per cell of a grid of
+   * about sqrt(count) by sqrt(count) cells, that are also stratified along
+   * each axis (correlated multi-jittered sampling, Kensler 2013).
+   */
+  class StratifiedPixelSampler2D : public PixelSampler2D {
+    public:
+
+      Vector2D get_sample(uint32_t index, uint32_t count,
+                          uint32_t dimension, uint32_t seed) const;
+
+  }; // class StratifiedPixelSampler2D
+
+  /**
+   * A PixelSampler2D with points of the Halton sequence, in two new prime
+   * bases for every dimension, randomized by a toroidal shift.
+   */
+  class HaltonPixelSampler2D : public PixelSampler2D {
+    public:
+
+      Vector2D get_sample(uint32_t index, uint32_t count,
+                          uint32_t dimension, uint32_t seed) const;
+
+  }; // class HaltonPixelSampler2D
+
+  /**
+   * A PixelSampler2D with points of the first two dimensions of the Sobol
+   * sequence, Owen scrambled. Every dimension uses its own scrambling and
+   * shuffled order of the points (Burley 2020, "Practical Hash-based Owen
+   * Scrambling"). Best with a power of two samples per pass.
+   */
+  class SobolPixelSampler2D : public PixelSampler2D {
+    public:
+
+      Vector2D get_sample(uint32_t index, uint32_t count,
+                          uint32_t dimension, uint32_t seed) const;
+
+  }; // class SobolPixelSampler2D
+
+  /**
+   * Create the pixel sampler with the given name (random, stratified,
+   * halton or sobol). Returns NULL for an unknown name.
+   */
+  PixelSampler2D* new_pixel_sampler(const std::string& name);
+
+  /**
+   * Measure how many hemisphere samples per second every thread takes with
+   * 1 to 16 threads, with random numbers from std::rand and from RNG, and
+   * print a table of the results to stdout.
+   */
+  void benchmark_samplers();
+
+  /**
+   * Measure the RMSE of pixel estimates of test integrals, against their
+   * exact value, for 1 to 1024 samples per pixel with every pixel sampler,
+   * and print a table of the results to stdout.
+   */
+  void benchmark_sampler_convergence();
+
+  /**
+   * Check that the stratified, Halton and Sobol pixel samplers spread the
+   * samples of a pixel as they should: one sample per stratum along each
+   * axis and per grid cell for the stratified sampler, one per interval of
+   * length b^-k for the first b^k Halton points, and one per elementary
+   * interval for power of two counts of Sobol points, over many seeds and
+   * dimensions. Prints a table of the failures to stdout and returns true
+   * if there are none.
    */
+  bool check_pixel_samplers();
 
 } // namespace CMU462
 
@@ -1,22 +1,143 @@
 #include "environment_light.h"
 
+#include "CMU462/timer.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <thread>
+
 namespace CMU462 { namespace StaticScene {
 
+// Map coordinates of a unit direction.
+static void dir_to_uv(const Vector3D& dir, double* u, double* v) {
+  double theta = acos(clamp(dir.y, -1.0, 1.0));
+  double phi = atan2(dir.x, -dir.z) + PI;
+  *u = phi / (2 * PI);
+  *v = theta / PI;
+}
+
 EnvironmentLight::EnvironmentLight(const HDRImageBuffer* envMap)
     : envMap(envMap) {
-  // TODO: initialize things here as needed
+
+  Timer timer;
+  timer.start();
+
+  // Every row gets its own distribution over its pixels, so the rows can
+  // be set up in parallel. Only the distribution over the rows waits for
+  // all of them.
+  size_t w = envMap->w, h = envMap->h;
+  columns.resize(h);
+  std::vector<float> row_weight(h);
+  std::vector<double> row_power(h);
+  size_t num_threads = std::max(1u, std::thread::hardware_concurrency());
+  std::vector<std::thread> threads;
+  for (size_t t = 0; t < num_threads; ++t) {
+    threads.push_back(std::thread([&, t] {
+      std::vector<float> weights(w);
+      for (size_t y = t; y < h; y += num_threads) {
+        row_power[y] = row_weights(y, weights);
+        columns[y].build(weights);
+        row_weight[y] = columns[y].total();
+      }
+    }));
+  }
+  for (std::thread& t : threads) t.join();
+  rows.build(row_weight);
+  totalPower = 0;
+  for (double p : row_power) totalPower += p;
+
+  timer.stop();
+  fprintf(stdout, "[EnvironmentLight] Importance sampling %zux%zu map "
+          "(%.4f sec)\n", w, h, timer.duration());
+}
+
+double EnvironmentLight::row_weights(size_t y,
+                                     std::vector<float>& weights) const {
+
+  // lookup() blends each pixel with its neighbours, so a dark pixel next to
+  // a bright one still has radiance near its edge. Weighing every pixel by
+  // the brightest one it is blended with keeps the pdf above zero wherever
+  // the radiance is, which the estimate needs to stay unbiased.
+  long w = envMap->w, h = envMap->h;
+  const std::vector<Spectrum>& data = envMap->data;
+  std::vector<float> column_max(w, 0.f);
+  for (long yy = std::max(0L, (long) y - 1);
+       yy <= std::min(h - 1, (long) y + 1); ++yy) {
+    for (long x = 0; x < w; ++x) {
+      column_max[x] = std::max(column_max[x], data[x + yy * w].illum());
+    }
+  }
+
+  double sin_theta = sin((y + 0.5) / h * PI);
+  double power = 0;
+  weights.resize(w);
+  for (long x = 0; x < w; ++x) {
+    float neighbours = std::max(column_max[x],
+        std::max(column_max[(x + w - 1) % w], column_max[(x + 1) % w]));
+    weights[x] = std::max(0.f, neighbours) * sin_theta;
+    power += std::max(0.f, data[x + y * w].illum()) * sin_theta;
+  }
+  return power;
 }
 
 Spectrum EnvironmentLight::sample_L(const Vector3D& p, Vector3D* wi,
                                     float* distToLight,
-                                    float* pdf) const {
-  // TODO: Implement
-  return Spectrum(0, 0, 0);
+                                    float* pdf, RNG& rng) const {
+
+  // pick a pixel by its power, then a point in it
+  size_t w = envMap->w, h = envMap->h;
+  size_t y = rows.sample(rng);
+  size_t x = columns[y].sample(rng);
+  double u = (x + rng.next_double()) / w;
+  double v = (y + rng.next_double()) / h;
+
+  double theta = v * PI, phi = u * 2 * PI - PI;
+  double sin_theta = sin(theta);
+  *wi = Vector3D(sin_theta * sin(phi), cos(theta), -sin_theta * cos(phi));
+  *distToLight = INF_D;
+
+  // The point is uniform in the pixel, so over the map its density is the
+  // probability of the pixel times the number of pixels. A unit of map area
+  // covers 2 pi^2 sin(theta) of solid angle.
+  if (sin_theta <= 0) {
+    *pdf = 0;
+    return Spectrum();
+  }
+  *pdf = rows.pmf(y) * columns[y].pmf(x) * w * h / (2 * PI * PI * sin_theta);
+  return lookup(u, v);
 }
 
 Spectrum EnvironmentLight::sample_dir(const Ray& r) const {
-  // TODO: Implement
-  return Spectrum(0, 0, 0);
+  double u, v;
+  dir_to_uv(r.d.unit(), &u, &v);
+  return lookup(u, v);
+}
+
+double EnvironmentLight::power(double sceneRadius) const {
+  // The illuminance of the pixels times sin(theta), times the solid angle of
+  // a pixel at the equator, integrates the map over the sphere, which falls
+  // onto a disk across the scene.
+  double solid_angle = 2 * PI * PI / (envMap->w * envMap->h);
+  return totalPower * solid_angle * PI * sceneRadius * sceneRadius;
+}
+
+Spectrum EnvironmentLight::lookup(double u, double v) const {
+
+  // Pixel centers are at half integer coordinates. The map wraps around
+  // horizontally, and stops at the poles vertically.
+  long w = envMap->w, h = envMap->h;
+  double px = u * w - 0.5, py = v * h - 0.5;
+  long x0 = (long) floor(px), y0 = (long) floor(py);
+  float fx = px - x0, fy = py - y0;
+  long x1 = ((x0 + 1) % w + w) % w;
+  x0 = (x0 % w + w) % w;
+  long y1 = std::min(y0 + 1, h - 1);
+  y0 = std::max(y0, 0L);
+
+  const std::vector<Spectrum>& data = envMap->data;
+  return (data[x0 + y0 * w] * (1 - fx) + data[x1 + y0 * w] * fx) * (1 - fy) +
+         (data[x0 + y1 * w] * (1 - fx) + data[x1 + y1 * w] * fx) * fy;
 }
 
 } // namespace StaticScene
@@ -5,6 +5,8 @@
 #include "../image.h"
 #include "scene.h"
 
+#include <vector>
+
 namespace CMU462 { namespace StaticScene {
 
 // An environment light can be thought of as an infinitely big sphere centered
@@ -12,8 +14,15 @@ namespace CMU462 { namespace StaticScene {
 // image. This is commonly used for low-cost renderings of complex backrounds or
 // environments (fancy church, overgrown forest, etc) that would be difficult to
 // model in the scene.
+//
+// The map is a latitude-longitude image: its rows go from straight up (+y) to
+// straight down, and its columns once around the y axis.
 class EnvironmentLight : public SceneLight {
  public:
+  /**
+   * Sets up the distribution of sample_L over the pixels of the map, on as
+   * many threads as there are cores.
+   */
   EnvironmentLight(const HDRImageBuffer* envMap);
   /**
    * In addition to the work done by sample_dir, this function also has to
@@ -29,7 +38,7 @@ class EnvironmentLight : public SceneLight {
    *   this a LOT; it should be fast.
    */
   Spectrum sample_L(const Vector3D& p, Vector3D* wi, float* distToLight,
-                    float* pdf) const;
+                    float* pdf, RNG& rng) const;
   bool is_delta_light() const { return false; }
   /**
    * Returns the color found on the environment map by travelling in a specific
@@ -42,8 +51,26 @@ class EnvironmentLight : public SceneLight {
    */
   Spectrum sample_dir(const Ray& r) const;
 
+  double power(double sceneRadius) const;
+
  private:
+  /**
+   * Bilinearly interpolated radiance at a point of the map, with u along
+   * its width and v along its height, both in [0, 1].
+   */
+  Spectrum lookup(double u, double v) const;
+
+  /**
+   * Weights of the pixels of a row for sampling: the largest illuminance
+   * that lookup() blends into the pixel, times the area it covers on the
+   * sphere. Returns the sum of the pixels' own illuminance times that area.
+   */
+  double row_weights(size_t y, std::vector<float>& weights) const;
+
   const HDRImageBuffer* envMap;
+  double totalPower;                ///< sum of the power of the rows
+  AliasTable rows;                  ///< picks a row by its weight
+  std::vector<AliasTable> columns;  ///< of each row, picks a pixel in it
 }; // class EnvironmentLight
 
 } // namespace StaticScene
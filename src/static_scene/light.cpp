@@ -15,13 +15,18 @@ DirectionalLight::DirectionalLight(const Spectrum& rad,
 }
 
 Spectrum DirectionalLight::sample_L(const Vector3D& p, Vector3D* wi,
-                                    float* distToLight, float* pdf) const {
+                                    float* distToLight, float* pdf, RNG& rng) const {
   *wi = dirToLight;
   *distToLight = INF_D;
   *pdf = 1.0;
   return radiance;
 }
 
+double DirectionalLight::power(double sceneRadius) const {
+  // the irradiance over a disk across the scene
+  return radiance.illum() * PI * sceneRadius * sceneRadius;
+}
+
 // Infinite Hemisphere Light //
 
 InfiniteHemisphereLight::InfiniteHemisphereLight(const Spectrum& rad)
@@ -33,14 +38,19 @@ InfiniteHemisphereLight::InfiniteHemisphereLight(const Spectrum& rad)
 
 Spectrum InfiniteHemisphereLight::sample_L(const Vector3D& p, Vector3D* wi,
                                            float* distToLight,
-                                           float* pdf) const {
-  Vector3D dir = sampler.get_sample();
+                                           float* pdf, RNG& rng) const {
+  Vector3D dir = sampler.get_sample(rng);
   *wi = sampleToWorld* dir;
   *distToLight = INF_D;
   *pdf = 1.0 / (2.0 * M_PI);
   return radiance;
 }
 
+double InfiniteHemisphereLight::power(double sceneRadius) const {
+  // the irradiance of the sky over a disk across the scene
+  return radiance.illum() * PI * PI * sceneRadius * sceneRadius;
+}
+
 // Point Light //
 
 PointLight::PointLight(const Spectrum& rad, const Vector3D& pos) : 
@@ -48,7 +58,7 @@ PointLight::PointLight(const Spectrum& rad, const Vector3D& pos) :
 
 Spectrum PointLight::sample_L(const Vector3D& p, Vector3D* wi,
                              float* distToLight,
-                             float* pdf) const {
+                             float* pdf, RNG& rng) const {
   Vector3D d = position - p;
   *wi = d.unit();
   *distToLight = d.norm();
@@ -56,6 +66,19 @@ Spectrum PointLight::sample_L(const Vector3D& p, Vector3D* wi,
   return radiance;
 }
 
+double PointLight::power(double sceneRadius) const {
+  return 4 * PI * radiance.illum();
+}
+
+bool PointLight::get_bounds(LightBounds* bounds) const {
+  bounds->bb = BBox(position);
+  bounds->axis = Vector3D(0, 0, 1);
+  bounds->cosTheta_o = -1;  // in all directions
+  bounds->cosTheta_e = 0;
+  bounds->power = power(0);
+  return true;
+}
+
 // Spot Light //
 
 SpotLight::SpotLight(const Spectrum& rad, const Vector3D& pos,
@@ -64,10 +87,14 @@ SpotLight::SpotLight(const Spectrum& rad, const Vector3D& pos,
 }
 
 Spectrum SpotLight::sample_L(const Vector3D& p, Vector3D* wi,
-                             float* distToLight, float* pdf) const {
+                             float* distToLight, float* pdf, RNG& rng) const {
   return Spectrum();
 }
 
+double SpotLight::power(double sceneRadius) const {
+  return 0;
+}
+
 
 // Area Light //
 
@@ -78,19 +105,35 @@ AreaLight::AreaLight(const Spectrum& rad,
     dim_x(dim_x), dim_y(dim_y), area(dim_x.norm() * dim_y.norm()) { }
 
 Spectrum AreaLight::sample_L(const Vector3D& p, Vector3D* wi, 
-                             float* distToLight, float* pdf) const {
+                             float* distToLight, float* pdf, RNG& rng) const {
 
-  Vector2D sample = sampler.get_sample() - Vector2D(0.5f, 0.5f);
+  Vector2D sample = sampler.get_sample(rng) - Vector2D(0.5f, 0.5f);
   Vector3D d = position + sample.x * dim_x + sample.y * dim_y - p;
-  float cosTheta = dot(d, direction);
   float sqDist = d.norm2();
   float dist = sqrt(sqDist);
   *wi = d / dist;
+  float cosTheta = dot(*wi, direction);
   *distToLight = dist;
   *pdf = sqDist / (area * fabs(cosTheta));
   return cosTheta < 0 ? radiance : Spectrum();
 };
 
+double AreaLight::power(double sceneRadius) const {
+  return PI * area * radiance.illum();
+}
+
+bool AreaLight::get_bounds(LightBounds* bounds) const {
+  bounds->bb = BBox(position + 0.5 * (dim_x + dim_y));
+  bounds->bb.expand(position + 0.5 * (dim_x - dim_y));
+  bounds->bb.expand(position - 0.5 * (dim_x + dim_y));
+  bounds->bb.expand(position - 0.5 * (dim_x - dim_y));
+  bounds->axis = direction.unit();  // it lights the side it faces
+  bounds->cosTheta_o = 1;
+  bounds->cosTheta_e = 0;
+  bounds->power = power(0);
+  return true;
+}
+
 // Sphere Light //
 
 SphereLight::SphereLight(const Spectrum& rad, const SphereObject* sphere) {
@@ -98,20 +141,76 @@ SphereLight::SphereLight(const Spectrum& rad, const SphereObject* sphere) {
 }
 
 Spectrum SphereLight::sample_L(const Vector3D& p, Vector3D* wi, 
-                               float* distToLight, float* pdf) const {
+                               float* distToLight, float* pdf, RNG& rng) const {
 
   return Spectrum();
 }
 
-// Mesh Light
+double SphereLight::power(double sceneRadius) const {
+  return 0;
+}
 
-MeshLight::MeshLight(const Spectrum& rad, const Mesh* mesh) {
+// Mesh Light
 
+MeshLight::MeshLight(const Spectrum& rad, const Mesh* mesh,
+                     const Matrix4x4& transform)
+  : mesh(mesh), radiance(rad), area(0) {
+
+  const vector<size_t>& indices = mesh->get_indices();
+  vector<float> areas;
+  for (size_t i = 0; i < indices.size(); ++i) {
+    Vector3D p = mesh->positions[indices[i]];
+    corners.push_back((transform * Vector4D(p, 1.0)).projectTo3D());
+    if (i % 3 == 2) {
+      const Vector3D* c = &corners[i - 2];
+      areas.push_back(cross(c[1] - c[0], c[2] - c[0]).norm() / 2);
+      area += areas.back();
+    }
+  }
+  triangles.build(areas);
 }
 
 Spectrum MeshLight::sample_L(const Vector3D& p, Vector3D* wi, 
-                             float* distToLight, float* pdf) const {
-  return Spectrum();
+                             float* distToLight, float* pdf, RNG& rng) const {
+
+  if (area <= 0) {
+    *pdf = 0;
+    return Spectrum();
+  }
+
+  // a uniform point on a triangle picked by its area is a uniform point on
+  // the whole mesh
+  const Vector3D* c = &corners[3 * triangles.sample(rng)];
+  double su = sqrt(rng.next_double()), v = rng.next_double();
+  Vector3D q = c[0] * (1 - su) + c[1] * (su * (1 - v)) + c[2] * (su * v);
+  Vector3D n = cross(c[1] - c[0], c[2] - c[0]).unit();
+
+  Vector3D d = q - p;
+  double sqDist = d.norm2();
+  double dist = sqrt(sqDist);
+  *wi = d / dist;
+  *distToLight = dist;
+  double cosTheta = fabs(dot(n, *wi));
+  if (cosTheta <= 0) {
+    *pdf = 0;
+    return Spectrum();
+  }
+  *pdf = sqDist / (area * cosTheta);
+  return radiance;
+}
+
+double MeshLight::power(double sceneRadius) const {
+  return 2 * PI * area * radiance.illum();
+}
+
+bool MeshLight::get_bounds(LightBounds* bounds) const {
+  bounds->bb = BBox();
+  for (const Vector3D& c : corners) bounds->bb.expand(c);
+  bounds->axis = Vector3D(0, 0, 1);
+  bounds->cosTheta_o = -1;  // both sides of all triangles
+  bounds->cosTheta_e = 0;
+  bounds->power = power(0);
+  return true;
 }
 
 } // namespace StaticScene
@@ -3,6 +3,7 @@
 
 #include "CMU462/vector3D.h"
 #include "CMU462/matrix3x3.h"
+#include "CMU462/matrix4x4.h"
 #include "CMU462/spectrum.h"
 #include "../sampler.h" // UniformHemisphereSampler3D, UniformGridSampler2D
 #include "../image.h"   // HDRImageBuffer
@@ -10,6 +11,8 @@
 #include "scene.h"  // SceneLight
 #include "object.h" // Mesh, SphereObject
 
+#include <vector>
+
 namespace CMU462 { namespace StaticScene {
 
 // Directional Light //
@@ -18,8 +21,9 @@ class DirectionalLight : public SceneLight {
  public:
   DirectionalLight(const Spectrum& rad, const Vector3D& lightDir);
   Spectrum sample_L(const Vector3D& p, Vector3D* wi, float* distToLight,
-                    float* pdf) const;
+                    float* pdf, RNG& rng) const;
   bool is_delta_light() const { return true; }
+  double power(double sceneRadius) const;
 
  private:
   Spectrum radiance;
@@ -33,8 +37,9 @@ class InfiniteHemisphereLight : public SceneLight {
  public:
   InfiniteHemisphereLight(const Spectrum& rad);
   Spectrum sample_L(const Vector3D& p, Vector3D* wi, float* distToLight,
-                    float* pdf) const;
+                    float* pdf, RNG& rng) const;
   bool is_delta_light() const { return false; }
+  double power(double sceneRadius) const;
 
  private:
   Spectrum radiance;
@@ -50,8 +55,10 @@ class PointLight : public SceneLight {
  public: 
   PointLight(const Spectrum& rad, const Vector3D& pos);
   Spectrum sample_L(const Vector3D& p, Vector3D* wi, float* distToLight,
-                    float* pdf) const;
+                    float* pdf, RNG& rng) const;
   bool is_delta_light() const { return true; }
+  double power(double sceneRadius) const;
+  bool get_bounds(LightBounds* bounds) const;
 
  private:
   Spectrum radiance;
@@ -66,8 +73,9 @@ class SpotLight : public SceneLight {
   SpotLight(const Spectrum& rad, const Vector3D& pos, 
             const Vector3D& dir, float angle);
   Spectrum sample_L(const Vector3D& p, Vector3D* wi, float* distToLight,
-                    float* pdf) const;
+                    float* pdf, RNG& rng) const;
   bool is_delta_light() const { return true; }
+  double power(double sceneRadius) const;
 
  private:
   Spectrum radiance;
@@ -85,8 +93,10 @@ class AreaLight : public SceneLight {
             const Vector3D& pos,   const Vector3D& dir, 
             const Vector3D& dim_x, const Vector3D& dim_y);
   Spectrum sample_L(const Vector3D& p, Vector3D* wi, float* distToLight,
-                    float* pdf) const;
+                    float* pdf, RNG& rng) const;
   bool is_delta_light() const { return false; }
+  double power(double sceneRadius) const;
+  bool get_bounds(LightBounds* bounds) const;
 
  private:
   Spectrum radiance;
@@ -105,8 +115,9 @@ class SphereLight : public SceneLight {
  public:
   SphereLight(const Spectrum& rad, const SphereObject* sphere);
   Spectrum sample_L(const Vector3D& p, Vector3D* wi, float* distToLight,
-                    float* pdf) const;
+                    float* pdf, RNG& rng) const;
   bool is_delta_light() const { return false; }
+  double power(double sceneRadius) const;
 
  private:
   const SphereObject* sphere;
@@ -116,17 +127,26 @@ class SphereLight : public SceneLight {
 }; // class SphereLight
 
 // Mesh Light
+//
+// Light emitted from both sides of every triangle of a mesh, sampled by
+// picking a triangle in proportion to its area and a uniform point on it.
 
 class MeshLight : public SceneLight {
  public:
-  MeshLight(const Spectrum& rad, const Mesh* mesh);
+  MeshLight(const Spectrum& rad, const Mesh* mesh,
+            const Matrix4x4& transform = Matrix4x4::identity());
   Spectrum sample_L(const Vector3D& p, Vector3D* wi, float* distToLight,
-                    float* pdf) const;
+                    float* pdf, RNG& rng) const;
   bool is_delta_light() const { return false; }
+  double power(double sceneRadius) const;
+  bool get_bounds(LightBounds* bounds) const;
 
  private:
   const Mesh* mesh;
   Spectrum radiance;
+  std::vector<Vector3D> corners;  ///< world space, three per triangle
+  AliasTable triangles;           ///< picks a triangle by its area
+  double area;                    ///< of all triangles
 
 }; // class MeshLight
 
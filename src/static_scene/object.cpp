@@ -48,6 +48,11 @@ Mesh::Mesh(const HalfedgeMesh& mesh, BSDF* bsdf) {
 
 }
 
+Mesh::~Mesh() {
+  delete[] positions;
+  delete[] normals;
+}
+
 vector<Primitive*> Mesh::get_primitives() const {
 
   vector<Primitive*> primitives;
@@ -65,6 +70,20 @@ BSDF* Mesh::get_bsdf() const {
   return bsdf;
 }
 
+// Mesh instance //
+
+MeshInstance::MeshInstance(const std::shared_ptr<const Mesh>& mesh,
+                           const Matrix4x4& transform)
+    : mesh(mesh), transform(transform) { }
+
+vector<Primitive*> MeshInstance::get_primitives() const {
+  return mesh->get_primitives();
+}
+
+BSDF* MeshInstance::get_bsdf() const {
+  return mesh->get_bsdf();
+}
+
 // Sphere object //
 
 SphereObject::SphereObject(const Vector3D& o, double r, BSDF* bsdf) {
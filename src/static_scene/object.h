@@ -4,6 +4,8 @@
 #include "../halfEdgeMesh.h"
 #include "scene.h"
 
+#include <memory>
+
 namespace CMU462 { namespace StaticScene {
 
 /**
@@ -20,6 +22,12 @@ class Mesh : public SceneObject {
    */
   Mesh(const HalfedgeMesh& mesh, BSDF* bsdf);
 
+  /**
+   * Destructor. Frees the vertex arrays, which the triangles of the mesh
+   * refer to, so they must be freed first.
+   */
+  ~Mesh();
+
   /**
    * Get all the primitives (Triangle) in the mesh.
    * Note that Triangle reference the mesh for the actual data.
@@ -33,6 +41,11 @@ class Mesh : public SceneObject {
    */
   BSDF* get_bsdf() const;
 
+  /**
+   * Get the vertex indices of the triangles, three per triangle.
+   */
+  const vector<size_t>& get_indices() const { return indices; }
+
   Vector3D *positions;  ///< position array
   Vector3D *normals;    ///< normal array
 
@@ -42,8 +55,64 @@ class Mesh : public SceneObject {
 
   vector<size_t> indices;  ///< triangles defined by indices
 
+  // the vertex arrays are owned by the mesh
+  Mesh(const Mesh&);
+  Mesh& operator=(const Mesh&);
+
 };
 
+/**
+ * A mesh placed in the world by a transform.
+ * The mesh is in object space and is shared by the instances of it, such as
+ * the instances of successive frames of a rigid animation, so that it only
+ * needs one BVH. It is freed along with the last of them.
+ */
+class MeshInstance : public SceneObject {
+ public:
+
+  /**
+   * Constructor.
+   * \param mesh the mesh to instance, in object space
+   * \param transform object to world space transform
+   */
+  MeshInstance(const std::shared_ptr<const Mesh>& mesh,
+               const Matrix4x4& transform);
+
+  /**
+   * Get all the primitives (Triangle) in the instanced mesh.
+   * Note that these are in object space.
+   * \return all the primitives in the instanced mesh
+   */
+  vector<Primitive*> get_primitives() const;
+
+  /**
+   * Get the BSDF of the surface material of the instanced mesh.
+   * \return BSDF of the surface material of the instanced mesh
+   */
+  BSDF* get_bsdf() const;
+
+  /**
+   * Get the instanced mesh.
+   */
+  const Mesh* get_mesh() const { return mesh.get(); }
+
+  /**
+   * Get the instanced mesh, to keep it from being freed with the instance.
+   */
+  const std::shared_ptr<const Mesh>& get_shared_mesh() const { return mesh; }
+
+  /**
+   * Get the object to world space transform.
+   */
+  const Matrix4x4& get_transform() const { return transform; }
+
+ private:
+
+  std::shared_ptr<const Mesh> mesh;  ///< the instanced mesh
+  Matrix4x4 transform;               ///< object to world space transform
+
+}; // class MeshInstance
+
 /**
  * A sphere object.
  */
@@ -14,6 +14,11 @@ namespace CMU462 { namespace StaticScene {
 class Primitive {
  public:
 
+  /**
+   * Virtual destructor.
+   */
+  virtual ~Primitive() { }
+
   /**
    * Get the world space bounding box of the primitive.
    * \return world space bounding box of the primitive
@@ -0,0 +1,39 @@
+#include "scene.h"
+
+#include "../bsdf.h"
+#include "light.h"
+
+namespace CMU462 { namespace StaticScene {
+
+Scene::Scene(const std::vector<SceneObject *>& objects,
+             const std::vector<SceneLight *>& lights)
+    : objects(objects), lights(lights) {
+
+  // Meshes with an emission BSDF light the scene like any other light, so
+  // that they can be sampled rather than only found by chance. Emissive
+  // spheres are not yet, as SphereLight is not implemented.
+  for (SceneObject* obj : objects) {
+    EmissionBSDF* emission = dynamic_cast<EmissionBSDF*>(obj->get_bsdf());
+    if (!emission) continue;
+
+    SceneLight* light = NULL;
+    if (Mesh* mesh = dynamic_cast<Mesh*>(obj)) {
+      light = new MeshLight(emission->get_emission(), mesh);
+    } else if (MeshInstance* instance = dynamic_cast<MeshInstance*>(obj)) {
+      light = new MeshLight(emission->get_emission(), instance->get_mesh(),
+                            instance->get_transform());
+    }
+    if (light) {
+      objectLights.push_back(light);
+      this->lights.push_back(light);
+    }
+  }
+}
+
+Scene::~Scene() {
+  for (SceneObject* obj : objects) delete obj;
+  for (SceneLight* light : lights) delete light;
+}
+
+} // namespace StaticScene
+} // namespace CMU462
@@ -3,6 +3,7 @@
 
 #include "CMU462/CMU462.h"
 #include "primitive.h"
+#include "../rng.h"
 
 #include <vector>
 
@@ -14,6 +15,11 @@ namespace CMU462 { namespace StaticScene {
 class SceneObject {
  public:
 
+  /**
+   * Virtual destructor.
+   */
+  virtual ~SceneObject() { }
+
   /**
    * Get all the primitives in the scene object.
    * \return a vector of all the primitives in the scene object
@@ -29,15 +35,50 @@ class SceneObject {
 };
 
 
+/**
+ * Where a light emits from and in which directions, for estimating how
+ * much of its power reaches a point: it emits from within a bounding box,
+ * along directions within theta_o of an axis, each spreading up to a further
+ * theta_e (Conty Estevez and Kulla 2018, "Importance Sampling of Many Lights
+ * with Adaptive Tree Splitting").
+ */
+struct LightBounds {
+  BBox bb;           ///< region the light emits from
+  Vector3D axis;     ///< mean direction of emission
+  float cosTheta_o;  ///< cos of the spread of the axes of emission
+  float cosTheta_e;  ///< cos of the spread of the emission about an axis
+  double power;      ///< total power emitted
+};
+
 /**
  * Interface for lights in the scene.
  */
 class SceneLight {
  public:
+  virtual ~SceneLight() { }
+
+  /**
+   * Sample a direction wi from p towards the light, using the random numbers
+   * of the given generator. Returns the radiance arriving along wi, and
+   * stores the distance to the light and the pdf of the direction.
+   */
   virtual Spectrum sample_L(const Vector3D& p, Vector3D* wi,
-                            float* distToLight, float* pdf) const = 0;
+                            float* distToLight, float* pdf,
+                            RNG& rng) const = 0;
   virtual bool is_delta_light() const = 0;
 
+  /**
+   * Total power the light emits, as an illuminance. Lights infinitely far
+   * away count what they send into a scene of the given radius.
+   */
+  virtual double power(double sceneRadius) const = 0;
+
+  /**
+   * Get the bounds of the light. Returns false for lights infinitely far
+   * away, which have none.
+   */
+  virtual bool get_bounds(LightBounds* bounds) const { return false; }
+
 };
 
 
@@ -46,9 +87,19 @@ class SceneLight {
  * all data is already transformed to world space.
  */
 struct Scene {
+
+  /**
+   * Constructor. Objects with an emissive surface also become lights of
+   * the scene, after the given ones.
+   */
   Scene(const std::vector<SceneObject *>& objects,
-        const std::vector<SceneLight *>& lights)
-    : objects(objects), lights(lights) { }
+        const std::vector<SceneLight *>& lights);
+
+  /**
+   * Destructor. Deletes the objects and all lights, given or made for
+   * emissive objects.
+   */
+  ~Scene();
 
   // kept to make sure they don't get deleted, in case the
   //  primitives depend on them (e.g. Mesh Triangles).
@@ -57,22 +108,12 @@ struct Scene {
   // for sake of consistency of the scene object Interface
   std::vector<SceneLight*> lights;
 
-  // TODO (sky) :
-  // Adding object with emission BSDFs as mesh lights and sphere lights so 
-  // that light sampling configurations also applies to mesh lights. 
-//  for (SceneObject *obj : objects) {
-//    if (obj->get_material().emit != Spectrum()) {
-//      
-//      // mesh light
-//      if (dynamic_cast<Mesh*>(obj)) {
-//        staticLights.push_back()
-//      }
-//      
-//      // sphere light
-//      if (dynamic_cast<Sphere*>(obj)) {
-//
-//      }
-//  }
+  // the lights made for emissive objects, also in lights
+  std::vector<SceneLight*> objectLights;
+
+ private:
+  Scene(const Scene&);
+  Scene& operator=(const Scene&);
 
 };
 
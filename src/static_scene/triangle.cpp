@@ -5,33 +5,71 @@
 
 namespace CMU462 { namespace StaticScene {
 
-Triangle::Triangle(const Mesh* mesh, vector<size_t>& v) :
-    mesh(mesh), v(v) { }
 Triangle::Triangle(const Mesh* mesh, size_t v1, size_t v2, size_t v3) :
     mesh(mesh), v1(v1), v2(v2), v3(v3) { }
 
 BBox Triangle::get_bbox() const {
-  
-  // TODO: 
-  // compute the bounding box of the triangle
-  
-  return BBox();
+  BBox bb(mesh->positions[v1]);
+  bb.expand(mesh->positions[v2]);
+  bb.expand(mesh->positions[v3]);
+  return bb;
+}
+
+void Triangle::get_vertices(Vector3D& p1, Vector3D& p2, Vector3D& p3) const {
+  p1 = mesh->positions[v1];
+  p2 = mesh->positions[v2];
+  p3 = mesh->positions[v3];
+}
+
+bool Triangle::test(const Ray& r, double& t, double& u, double& v) const {
+
+  // Moller-Trumbore: solve o + t d = (1-u-v) p1 + u p2 + v p3
+  const Vector3D& p1 = mesh->positions[v1];
+  const Vector3D& p2 = mesh->positions[v2];
+  const Vector3D& p3 = mesh->positions[v3];
+
+  Vector3D e1 = p2 - p1;
+  Vector3D e2 = p3 - p1;
+  Vector3D s1 = cross(r.d, e2);
+  double det = dot(s1, e1);
+  if (det == 0.0) return false;
+  double inv_det = 1.0 / det;
+
+  Vector3D s = r.o - p1;
+  u = dot(s1, s) * inv_det;
+  if (u < 0.0 || u > 1.0) return false;
+
+  Vector3D s2 = cross(s, e1);
+  v = dot(s2, r.d) * inv_det;
+  if (v < 0.0 || u + v > 1.0) return false;
+
+  t = dot(s2, e2) * inv_det;
+  return t >= r.min_t && t <= r.max_t;
 }
 
 bool Triangle::intersect(const Ray& r) const {
-  
-  // TODO: implement ray-triangle intersection
-  
-  return false;
+  double t, u, v;
+  return test(r, t, u, v);
 }
 
 bool Triangle::intersect(const Ray& r, Intersection *isect) const {
-  
-  // TODO: 
-  // implement ray-triangle intersection. When an intersection takes
-  // place, the Intersection data should be updated accordingly
-  
-  return false;
+
+  double t, u, v;
+  if (!test(r, t, u, v)) return false;
+
+  r.max_t = t;
+
+  Vector3D n = (1 - u - v) * mesh->normals[v1] +
+                         u * mesh->normals[v2] +
+                         v * mesh->normals[v3];
+  n.normalize();
+  if (dot(n, r.d) > 0) n = -n;
+
+  isect->t = t;
+  isect->n = n;
+  isect->primitive = this;
+  isect->bsdf = get_bsdf();
+  return true;
 }
 
 void Triangle::draw(const Color& c) const {
@@ -24,7 +24,6 @@ namespace CMU462 { namespace StaticScene {
    * \param v2 index of triangle vertex in the mesh's attribute arrays
    * \param v3 index of triangle vertex in the mesh's attribute arrays
    */
-  Triangle(const Mesh* mesh, vector<size_t>& v);
   Triangle(const Mesh* mesh, size_t v1, size_t v2, size_t v3);
 
    /**
@@ -33,6 +32,11 @@ namespace CMU462 { namespace StaticScene {
     */
   BBox get_bbox() const;
 
+  /**
+   * Get the world space positions of the triangle vertices.
+   */
+  void get_vertices(Vector3D& p1, Vector3D& p2, Vector3D& p3) const;
+
    /**
     * Ray - Triangle intersection.
     * Check if the given ray intersects with the triangle, no intersection
@@ -74,14 +78,19 @@ namespace CMU462 { namespace StaticScene {
 
  private:
 
+  /**
+   * Tests for ray-triangle intersection within [r.min_t, r.max_t], writing
+   * the hit time to t and the barycentric coordinates of the hit point
+   * (relative to v2 and v3) to u and v.
+   */
+  bool test(const Ray& r, double& t, double& u, double& v) const;
+
   const Mesh* mesh;   ///< pointer to the mesh the triangle is a part of
 
   size_t v1; ///< index into the mesh attribute arrays
   size_t v2; ///< index into the mesh attribute arrays
   size_t v3; ///< index into the mesh attribute arrays
 
-  vector<size_t> v;
-
 }; // class Triangle
 
 } // namespace StaticScene
@@ -0,0 +1,221 @@
+#include "pathtracer.h"
+
+#include <typeinfo>
+
+using namespace CMU462::StaticScene;
+using namespace std;
+
+namespace CMU462 {
+
+  // Paths of a wavefront at most. A tile pass with more camera rays is
+  // traced as several wavefronts of whole pixels, so the queues of a thread
+  // stay within a few megabytes.
+  static const size_t WAVEFRONT_PATHS = 1 << 16;
+
+  // Queues of the calling worker thread, reused from tile to tile.
+  static thread_local Wavefront queues;
+
+  // Shadow rays queued by shading a single hit.
+  static thread_local vector<ShadowRay> hitShadows;
+
+  // Rays of the packets of the calling thread, as Ray has no default
+  // constructor to make arrays of.
+  static thread_local vector<Ray> packetRays;
+
+  bool PathTracer::raytrace_tile_wavefront(int tile_x, int tile_y,
+      int tile_w, int tile_h, size_t num_samples_tile, size_t num_samples,
+      size_t* remaining, size_t* rays) {
+
+    size_t w = sampleBuffer.w;
+    size_t h = sampleBuffer.h;
+    size_t x0 = tile_x, x1 = std::min<size_t>(x0 + tile_w, w);
+    size_t y0 = tile_y, y1 = std::min<size_t>(y0 + tile_h, h);
+    bool adaptive = adaptiveTolerance > 0;
+    float weight = (float) num_samples / (num_samples_tile + num_samples);
+
+    Wavefront& wf = queues;
+    *remaining = 0;
+    *rays = 0;
+
+    size_t next_pixel = 0, num_pixels = (x1 - x0) * (y1 - y0);
+    while (next_pixel < num_pixels) {
+
+      // Camera stage: the paths of whole pixels, each with the random
+      // numbers raytrace_pixel would give it.
+      wf.paths.clear();
+      wf.rays.clear();
+      for (; next_pixel < num_pixels; next_pixel++) {
+        if (wf.paths.size() &&
+            wf.paths.size() + num_samples > WAVEFRONT_PATHS) break;
+        size_t x = x0 + next_pixel % (x1 - x0);
+        size_t y = y0 + next_pixel / (x1 - x0);
+        if (adaptive && pixelStats[x + y * w].converged) continue;
+
+        RNG rng(randomSeed + ((uint64_t) num_samples_tile << 32), x + y * w);
+        uint32_t seed = rng.next_uint();
+        for (size_t i = 0; i < num_samples; i++) {
+          // adaptive sampling takes the rays of a pixel one at a time
+          if (adaptive && i) seed = rng.next_uint();
+          RNG path_rng(rng.next_uint(), x + y * w);
+          Ray r = adaptive ? camera_ray(x, y, 0, 1, seed)
+                           : camera_ray(x, y, i, num_samples, seed);
+          wf.rays.push(r, wf.paths.size());
+          wf.paths.push(path_rng, x + y * w);
+        }
+      }
+
+      // Follow the paths a bounce at a time until all of them end.
+      while (wf.rays.size()) {
+        if (!continueRaytracing) return false;
+        *rays += wf.rays.size();
+        wavefront_intersect(wf);
+        wavefront_shade(wf);
+        if (!continueRaytracing) return false;
+        *rays += wf.shadows.size();
+        wavefront_shadows(wf);
+        std::swap(wf.rays, wf.next_rays);
+      }
+
+      // Accumulation stage: blend the average of the paths of each pixel
+      // into the sample buffer, as raytrace_tile does.
+      for (size_t p = 0; p < wf.paths.size(); p += num_samples) {
+        size_t x = wf.paths.pixel[p] % w, y = wf.paths.pixel[p] / w;
+        if (!adaptive) {
+          Spectrum sum;
+          for (size_t i = 0; i < num_samples; i++) sum += wf.paths.L(p + i);
+          sampleBuffer.update_pixel(sum * (1.f / num_samples), x, y, weight);
+          continue;
+        }
+
+        PixelStats& stats = pixelStats[x + y * w];
+        Spectrum sum;
+        for (size_t i = 0; i < num_samples; i++) {
+          Spectrum s = wf.paths.L(p + i);
+          sum += s;
+          stats.add(s.illum());
+        }
+        sampleBuffer.update_pixel(sum * (1.f / num_samples), x, y, weight);
+
+        stats.test(adaptiveTolerance);
+        if (!stats.converged) (*remaining)++;
+      }
+    }
+
+    return true;
+  }
+
+  void PathTracer::wavefront_intersect(Wavefront& wf) {
+
+    // Camera rays are queued in order of pixel, so runs of them are
+    // coherent enough to trace as packets.
+    HitQueue& hits = wf.hits;
+    hits.clear();
+    bool packets = rayPackets && wf.rays.size() && wf.rays.depth[0] == 0;
+    Intersection isects[BVH_PACKET_SIZE];
+    bool hit[BVH_PACKET_SIZE];
+    for (size_t first = 0; first < wf.rays.size(); first += BVH_PACKET_SIZE) {
+      size_t count = std::min(wf.rays.size() - first, BVH_PACKET_SIZE);
+      packetRays.clear();
+      for (size_t k = 0; k < count; k++) {
+        packetRays.push_back(wf.rays.get(first + k));
+        isects[k] = Intersection();
+      }
+      if (packets) {
+        bvh->intersect_packet(&packetRays[0], count, isects, hit);
+      } else {
+        for (size_t k = 0; k < count; k++) {
+          hit[k] = bvh->intersect(packetRays[k], &isects[k]);
+        }
+      }
+
+      for (size_t k = 0; k < count; k++) {
+        if (!hit[k]) {
+          uint32_t p = wf.rays.path[first + k];
+          wf.paths.add_L(p, wf.paths.beta(p) * escaped(packetRays[k]));
+          continue;
+        }
+        hits.t.push_back(isects[k].t);
+        hits.nx.push_back(isects[k].n.x);
+        hits.ny.push_back(isects[k].n.y);
+        hits.nz.push_back(isects[k].n.z);
+        hits.bsdf.push_back(isects[k].bsdf);
+        hits.type.push_back(typeid(*isects[k].bsdf).hash_code());
+        hits.ray.push_back(first + k);
+      }
+    }
+  }
+
+  void PathTracer::wavefront_shade(Wavefront& wf) {
+
+    // Shade the hits on surfaces of the same type of BSDF, and then of the
+    // same BSDF, one after the other, so that they run the same code on the
+    // same data.
+    HitQueue& hits = wf.hits;
+    hits.order.resize(hits.size());
+    for (size_t i = 0; i < hits.size(); i++) hits.order[i] = i;
+    std::sort(hits.order.begin(), hits.order.end(),
+              [&](uint32_t a, uint32_t b) {
+      if (hits.type[a] != hits.type[b]) return hits.type[a] < hits.type[b];
+      if (hits.bsdf[a] != hits.bsdf[b]) return hits.bsdf[a] < hits.bsdf[b];
+      return a < b;
+    });
+
+    wf.next_rays.clear();
+    wf.shadows.clear();
+    for (uint32_t i : hits.order) {
+      Ray r = wf.rays.get(hits.ray[i]);
+      uint32_t p = wf.rays.path[hits.ray[i]];
+      Intersection isect;
+      isect.t = hits.t[i];
+      isect.n = Vector3D(hits.nx[i], hits.ny[i], hits.nz[i]);
+      isect.bsdf = hits.bsdf[i];
+
+      Ray next(Vector3D(0, 0, 0), Vector3D(0, 0, 1));
+      Spectrum next_weight;
+      Spectrum beta = wf.paths.beta(p);
+      hitShadows.clear();
+      wf.paths.add_L(p, beta * shade(r, isect, wf.paths.rng[p], hitShadows,
+                                     &next, &next_weight));
+      for (const ShadowRay& shadow : hitShadows) {
+        wf.shadows.push(shadow.o, shadow.d, shadow.max_t, beta * shadow.L, p);
+      }
+      if (next_weight != Spectrum()) {
+        wf.paths.scale_beta(p, next_weight);
+        wf.next_rays.push(next, p);
+      }
+    }
+  }
+
+  void PathTracer::wavefront_shadows(Wavefront& wf) {
+
+    // The shadow rays of a hit are queued together, from the same point
+    // towards the same lights, so runs of them make packets.
+    ShadowQueue& shadows = wf.shadows;
+    bool occluded[BVH_PACKET_SIZE];
+    for (size_t first = 0; first < shadows.size(); first += BVH_PACKET_SIZE) {
+      size_t count = std::min(shadows.size() - first, BVH_PACKET_SIZE);
+      packetRays.clear();
+      for (size_t k = first; k < first + count; k++) {
+        packetRays.push_back(
+            Ray(Vector3D(shadows.ox[k], shadows.oy[k], shadows.oz[k]),
+                Vector3D(shadows.dx[k], shadows.dy[k], shadows.dz[k]),
+                shadows.max_t[k]));
+      }
+      if (rayPackets) {
+        bvh->occluded_packet(&packetRays[0], count, occluded);
+      } else {
+        for (size_t k = 0; k < count; k++) {
+          occluded[k] = bvh->intersect(packetRays[k]);
+        }
+      }
+
+      for (size_t k = 0; k < count; k++) {
+        if (occluded[k]) continue;
+        size_t i = first + k;
+        wf.paths.add_L(shadows.path[i],
+                       Spectrum(shadows.r[i], shadows.g[i], shadows.b[i]));
+      }
+    }
+  }
+
+}  // namespace CMU462
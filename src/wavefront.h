@@ -0,0 +1,158 @@
+#ifndef CMU462_WAVEFRONT_H
+#define CMU462_WAVEFRONT_H
+
+#include <stdint.h>
+
+#include <vector>
+
+#include "CMU462/spectrum.h"
+#include "CMU462/vector3D.h"
+#include "bsdf.h"
+#include "ray.h"
+#include "rng.h"
+
+namespace CMU462 {
+
+  /**
+   * Rays of a wavefront, one array per component, so that a stage walking
+   * over all of them streams through memory.
+   */
+  struct RayQueue {
+
+    size_t size() const { return path.size(); }
+
+    void clear() {
+      ox.clear(); oy.clear(); oz.clear();
+      dx.clear(); dy.clear(); dz.clear();
+      min_t.clear(); max_t.clear();
+      depth.clear(); path.clear();
+    }
+
+    void push(const Ray& r, uint32_t p) {
+      ox.push_back(r.o.x); oy.push_back(r.o.y); oz.push_back(r.o.z);
+      dx.push_back(r.d.x); dy.push_back(r.d.y); dz.push_back(r.d.z);
+      min_t.push_back(r.min_t); max_t.push_back(r.max_t);
+      depth.push_back(r.depth); path.push_back(p);
+    }
+
+    Ray get(size_t i) const {
+      Ray r(Vector3D(ox[i], oy[i], oz[i]), Vector3D(dx[i], dy[i], dz[i]),
+            max_t[i], depth[i]);
+      r.min_t = min_t[i];
+      return r;
+    }
+
+    std::vector<double> ox, oy, oz;      ///< origins
+    std::vector<double> dx, dy, dz;      ///< directions
+    std::vector<double> min_t, max_t;    ///< segments of the rays
+    std::vector<uint32_t> depth;         ///< depths of the rays
+    std::vector<uint32_t> path;          ///< paths the rays belong to
+  };
+
+  /**
+   * Hits of the rays of a wavefront that hit something.
+   */
+  struct HitQueue {
+
+    size_t size() const { return ray.size(); }
+
+    void clear() {
+      t.clear(); nx.clear(); ny.clear(); nz.clear();
+      bsdf.clear(); type.clear(); ray.clear(); order.clear();
+    }
+
+    std::vector<double> t;               ///< distances along the rays
+    std::vector<double> nx, ny, nz;      ///< surface normals
+    std::vector<BSDF*> bsdf;             ///< surfaces hit
+    std::vector<size_t> type;            ///< hash codes of the BSDF types
+    std::vector<uint32_t> ray;           ///< index in the ray queue
+    std::vector<uint32_t> order;         ///< hits grouped by type of BSDF
+  };
+
+  /**
+   * Shadow rays of a wavefront, with the radiance they add to their path,
+   * weighed by its throughput, if nothing blocks them.
+   */
+  struct ShadowQueue {
+
+    size_t size() const { return path.size(); }
+
+    void clear() {
+      ox.clear(); oy.clear(); oz.clear();
+      dx.clear(); dy.clear(); dz.clear();
+      max_t.clear(); r.clear(); g.clear(); b.clear(); path.clear();
+    }
+
+    void push(const Vector3D& o, const Vector3D& d, double t,
+              const Spectrum& L, uint32_t p) {
+      ox.push_back(o.x); oy.push_back(o.y); oz.push_back(o.z);
+      dx.push_back(d.x); dy.push_back(d.y); dz.push_back(d.z);
+      max_t.push_back(t);
+      r.push_back(L.r); g.push_back(L.g); b.push_back(L.b);
+      path.push_back(p);
+    }
+
+    std::vector<double> ox, oy, oz;      ///< origins
+    std::vector<double> dx, dy, dz;      ///< directions
+    std::vector<double> max_t;           ///< distances to the lights
+    std::vector<float> r, g, b;          ///< radiance if unblocked
+    std::vector<uint32_t> path;          ///< paths the rays belong to
+  };
+
+  /**
+   * State of the paths of a wavefront: one per camera ray, in order of
+   * pixel and then sample, so the samples of a pixel are next to each
+   * other.
+   */
+  struct PathQueue {
+
+    size_t size() const { return pixel.size(); }
+
+    void clear() {
+      rng.clear(); pixel.clear();
+      L_r.clear(); L_g.clear(); L_b.clear();
+      beta_r.clear(); beta_g.clear(); beta_b.clear();
+    }
+
+    void push(const RNG& generator, uint32_t p) {
+      rng.push_back(generator);
+      pixel.push_back(p);
+      L_r.push_back(0); L_g.push_back(0); L_b.push_back(0);
+      beta_r.push_back(1); beta_g.push_back(1); beta_b.push_back(1);
+    }
+
+    Spectrum L(size_t i) const { return Spectrum(L_r[i], L_g[i], L_b[i]); }
+
+    Spectrum beta(size_t i) const {
+      return Spectrum(beta_r[i], beta_g[i], beta_b[i]);
+    }
+
+    void add_L(size_t i, const Spectrum& s) {
+      L_r[i] += s.r; L_g[i] += s.g; L_b[i] += s.b;
+    }
+
+    void scale_beta(size_t i, const Spectrum& s) {
+      beta_r[i] *= s.r; beta_g[i] *= s.g; beta_b[i] *= s.b;
+    }
+
+    std::vector<RNG> rng;                ///< random numbers of the paths
+    std::vector<uint32_t> pixel;         ///< pixel of the path in the image
+    std::vector<float> L_r, L_g, L_b;    ///< radiance gathered so far
+    std::vector<float> beta_r, beta_g, beta_b;  ///< throughput so far
+  };
+
+  /**
+   * The queues of a wavefront, kept by every render thread between tiles so
+   * that their memory is reused.
+   */
+  struct Wavefront {
+    PathQueue paths;      ///< paths being traced
+    RayQueue rays;        ///< rays of the current bounce
+    RayQueue next_rays;   ///< rays the paths continue along
+    HitQueue hits;        ///< hits of the current bounce
+    ShadowQueue shadows;  ///< shadow rays of the current bounce
+  };
+
+}  // namespace CMU462
+
+#endif  // CMU462_WAVEFRONT_H
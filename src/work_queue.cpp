@@ -0,0 +1,112 @@
+#include "work_queue.h"
+
+#include "CMU462/timer.h"
+
+#include <cmath>
+#include <cstdio>
+
+using namespace std;
+using namespace CMU462;
+
+// Size of the synthetic image rendered by the benchmark.
+static const int BENCHMARK_IMAGE_SIZE = 1024;
+
+namespace {
+
+  struct BenchmarkTile {
+    int x, y, size;
+  };
+
+  /**
+   * Stand-in for tracing a pixel: a few dozen dependent flops, more towards
+   * the middle of the image so that the tiles are unevenly expensive, as
+   * they are in most scenes.
+   */
+  float shade(int x, int y) {
+    float dx = x - 0.5f * BENCHMARK_IMAGE_SIZE;
+    float dy = y - 0.5f * BENCHMARK_IMAGE_SIZE;
+    float r = sqrtf(dx * dx + dy * dy) / BENCHMARK_IMAGE_SIZE;
+    int iterations = 16 + (int) (64 * max(0.f, 1.f - 2.f * r));
+    float v = x * 0.001f + y;
+    for (int i = 0; i < iterations; ++i) v = v * 0.999f + 0.5f;
+    return v;
+  }
+
+  void worker(WorkStealingQueue<BenchmarkTile>* queue, size_t id,
+              vector<float>* image) {
+    size_t index;
+    while (queue->get_work(id, &index)) {
+      const BenchmarkTile& tile = queue->get_item(index);
+      int x1 = min(tile.x + tile.size, BENCHMARK_IMAGE_SIZE);
+      int y1 = min(tile.y + tile.size, BENCHMARK_IMAGE_SIZE);
+      for (int y = tile.y; y < y1; ++y) {
+        for (int x = tile.x; x < x1; ++x) {
+          (*image)[y * BENCHMARK_IMAGE_SIZE + x] = shade(x, y);
+        }
+      }
+      queue->done();
+    }
+  }
+
+}  // namespace
+
+void benchmark_work_queue() {
+
+  static const size_t thread_counts[] = { 1, 2, 4, 8, 16, 32, 64 };
+  static const int tile_sizes[] = { 8, 16, 32, 64 };
+  static const int repetitions = 5;
+
+  size_t cores = thread::hardware_concurrency();
+  printf("[WorkQueue] Rendering a synthetic %dx%d image on %zu cores\n",
+         BENCHMARK_IMAGE_SIZE, BENCHMARK_IMAGE_SIZE, cores);
+  printf("[WorkQueue] Best of %d runs: time in ms (speedup over 1 thread), "
+         "steals\n", repetitions);
+  printf("threads");
+  for (int tile_size : tile_sizes) {
+    char label[16];
+    snprintf(label, sizeof(label), "%dx%d", tile_size, tile_size);
+    printf("  %24s", label);
+  }
+  printf("\n");
+
+  vector<float> image(BENCHMARK_IMAGE_SIZE * BENCHMARK_IMAGE_SIZE);
+  double serial[4] = { 0 };
+
+  for (size_t num_threads : thread_counts) {
+    printf("%7zu", num_threads);
+    for (int s = 0; s < 4; ++s) {
+      int tile_size = tile_sizes[s];
+      double best = 0;
+      size_t steals = 0;
+
+      for (int r = 0; r < repetitions; ++r) {
+        WorkStealingQueue<BenchmarkTile> queue;
+        for (int y = 0; y < BENCHMARK_IMAGE_SIZE; y += tile_size) {
+          for (int x = 0; x < BENCHMARK_IMAGE_SIZE; x += tile_size) {
+            BenchmarkTile tile = { x, y, tile_size };
+            queue.put_work(tile);
+          }
+        }
+
+        Timer timer;
+        timer.start();
+        queue.start(num_threads);
+        vector<thread> threads;
+        for (size_t t = 0; t < num_threads; ++t) {
+          threads.push_back(thread(worker, &queue, t, &image));
+        }
+        for (thread& t : threads) t.join();
+        timer.stop();
+
+        if (r == 0 || timer.duration() < best) {
+          best = timer.duration();
+          steals = queue.num_steals();
+        }
+      }
+
+      if (num_threads == 1) serial[s] = best;
+      printf("  %8.2f (%5.2fx) %6zu", best * 1e3, serial[s] / best, steals);
+    }
+    printf("\n");
+  }
+}
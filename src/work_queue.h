@@ -1,53 +1,346 @@
-#ifndef __WORK_QUEUE_H__
-#define __WORK_QUEUE_H__
+#ifndef CMU462_WORK_QUEUE_H
+#define CMU462_WORK_QUEUE_H
 
+#include <stdint.h>
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <memory>
 #include <mutex>
+#include <thread>
 #include <vector>
 
 /**
- * Note that this queue has no wait-until-more-work-is-added capability; it's
- * intended for more isolated or batch-processing-like situations.
+ * A work stealing queue: every worker owns a deque of work items that it
+ * pops from one end, and only when its own deque is empty does it steal from
+ * the other end of another worker's deque. Workers therefore only touch
+ * shared state when they run out of work, and only take a lock to sleep
+ * when there is nothing to get at all.
+ *
+ * Work is added with put_work before start, which deals the items out to the
+ * workers in order of priority so that every worker begins with the highest
+ * priority items. A worker that gets an item must hand it back with either
+ * done (it is finished) or put_back (it needs another pass). Items put back
+ * are held by the worker until it runs out of other work, so that passes
+ * sweep over all items rather than repeating one item. get_work only gives
+ * up once every item is done or the queue is stopped, since items being
+ * worked on may still be put back; until then it sleeps, and is woken
+ * whenever items put back become available, the last item is done or the
+ * queue is stopped.
+ *
+ * The deques are Chase-Lev deques (Le et al., "Correct and Efficient
+ * Work-Stealing for Weak Memory Models", 2013) holding item indices.
  */
 template <class T>
-class WorkQueue {
+class WorkStealingQueue {
   private:
-    std::vector<T> storage;
-    std::mutex lock;
 
-  public:
+    /**
+     * A ring buffer of item indices. Only its owner writes to it, but
+     * thieves read it concurrently, hence the atomic slots.
+     */
+    struct Buffer {
+
+      Buffer(size_t capacity)
+        : mask(capacity - 1), slots(new std::atomic<uint32_t>[capacity]) { }
+
+      size_t capacity() const { return mask + 1; }
+
+      uint32_t get(int64_t i) const {
+        return slots[i & mask].load(std::memory_order_relaxed);
+      }
+
+      void put(int64_t i, uint32_t index) {
+        slots[i & mask].store(index, std::memory_order_relaxed);
+      }
 
-    WorkQueue() {}
+      size_t mask;
+      std::unique_ptr<std::atomic<uint32_t>[]> slots;
+    };
+
+    /**
+     * A worker's deque. The owner pushes and pops at the bottom, thieves
+     * steal from the top.
+     */
+    struct Deque {
+
+      Deque() : top(0), bottom(0), buffer(NULL) { }
+
+      std::atomic<int64_t> top;
+      char pad[64];  // keep the owner's and the thieves' end apart
+      std::atomic<int64_t> bottom;
+      std::atomic<Buffer*> buffer;
+      std::vector<std::unique_ptr<Buffer> > buffers;  ///< current and retired
+      std::vector<uint32_t> deferred;  ///< items put back, owner only
+    };
+
+    std::vector<T> items;            ///< all work items
+    std::vector<double> priorities;  ///< priority of every item
+    std::vector<std::unique_ptr<Deque> > deques;  ///< one per worker
+    std::atomic<size_t> pending;     ///< items not done yet
+    std::atomic<size_t> steals;      ///< successful steals
+    std::atomic<bool> stopped;       ///< get_work should give up
+
+    std::mutex wait_mutex;           ///< guards sleeping in get_work
+    std::condition_variable wakeup;  ///< wakes workers sleeping in get_work
+    std::atomic<uint64_t> events;    ///< counts the reasons to wake up
+
+    /**
+     * Wake the workers sleeping in get_work, after items became available,
+     * the last item was done or the queue was stopped.
+     */
+    void wake_all() {
+      {
+        std::lock_guard<std::mutex> lock(wait_mutex);
+        events.fetch_add(1, std::memory_order_release);
+      }
+      wakeup.notify_all();
+    }
 
-    bool is_empty() {
-      lock.lock();
-      bool result = storage.empty();
-      lock.unlock();
-      return result;
+    void push(Deque& d, uint32_t index) {
+      int64_t b = d.bottom.load(std::memory_order_relaxed);
+      int64_t t = d.top.load(std::memory_order_acquire);
+      Buffer* a = d.buffer.load(std::memory_order_relaxed);
+      if (b - t >= (int64_t) a->capacity()) {
+        // Grow into a new buffer. The old one stays alive until clear,
+        // since thieves may still be reading from it.
+        Buffer* grown = new Buffer(2 * a->capacity());
+        for (int64_t i = t; i < b; ++i) grown->put(i, a->get(i));
+        d.buffers.emplace_back(grown);
+        d.buffer.store(grown, std::memory_order_release);
+        a = grown;
+      }
+      a->put(b, index);
+      std::atomic_thread_fence(std::memory_order_release);
+      d.bottom.store(b + 1, std::memory_order_relaxed);
     }
 
-    bool try_get_work(T *outPtr) {
-      lock.lock();
-      if (storage.empty()) {
-        lock.unlock();
+    bool pop(Deque& d, uint32_t* index) {
+      int64_t b = d.bottom.load(std::memory_order_relaxed) - 1;
+      Buffer* a = d.buffer.load(std::memory_order_relaxed);
+      d.bottom.store(b, std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      int64_t t = d.top.load(std::memory_order_relaxed);
+      if (t > b) {
+        // empty
+        d.bottom.store(b + 1, std::memory_order_relaxed);
         return false;
       }
-      *outPtr = storage.front();
-      storage.erase(storage.begin());
-      lock.unlock();
-      return true;
+      *index = a->get(b);
+      if (t < b) return true;
+
+      // last item: race the thieves for it
+      bool won = d.top.compare_exchange_strong(t, t + 1,
+          std::memory_order_seq_cst, std::memory_order_relaxed);
+      d.bottom.store(b + 1, std::memory_order_relaxed);
+      return won;
+    }
+
+    bool steal(Deque& d, uint32_t* index) {
+      int64_t t = d.top.load(std::memory_order_acquire);
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      int64_t b = d.bottom.load(std::memory_order_acquire);
+      if (t >= b) return false;
+      Buffer* a = d.buffer.load(std::memory_order_acquire);
+      *index = a->get(t);
+      return d.top.compare_exchange_strong(t, t + 1,
+          std::memory_order_seq_cst, std::memory_order_relaxed);
     }
 
-    void put_work(const T& item) {
-      lock.lock();
-      storage.push_back(item);
-      lock.unlock();
+    void publish_deferred(Deque& d) {
+      std::stable_sort(d.deferred.begin(), d.deferred.end(),
+          [this](uint32_t a, uint32_t b) {
+            return priorities[a] < priorities[b];
+          });
+      for (uint32_t i : d.deferred) push(d, i);
+      if (!d.deferred.empty()) wake_all();
+      d.deferred.clear();
     }
 
+  public:
+
+    WorkStealingQueue()
+      : pending(0), steals(0), stopped(false), events(0) { }
+
+    /**
+     * Add an item, to be handed out before items of lower priority. Must
+     * not be called while workers are running.
+     */
+    void put_work(const T& item, double priority = 0) {
+      items.push_back(item);
+      priorities.push_back(priority);
+    }
+
+    /**
+     * Deal the items out to the given number of workers. Must be called
+     * before the workers start.
+     */
+    void start(size_t num_workers) {
+      num_workers = std::max<size_t>(1, num_workers);
+      deques.clear();
+      for (size_t w = 0; w < num_workers; ++w) {
+        deques.emplace_back(new Deque());
+        Deque& d = *deques.back();
+        size_t capacity = 16;
+        while (capacity < items.size() / num_workers + 1) capacity *= 2;
+        d.buffers.emplace_back(new Buffer(capacity));
+        d.buffer.store(d.buffers.back().get(), std::memory_order_relaxed);
+      }
+
+      std::vector<uint32_t> order(items.size());
+      for (size_t i = 0; i < order.size(); ++i) order[i] = i;
+      std::stable_sort(order.begin(), order.end(),
+          [this](uint32_t a, uint32_t b) {
+            return priorities[a] > priorities[b];
+          });
+
+      // Worker w gets items w, w + num_workers, ... of the priority order.
+      // They are pushed lowest priority first, as the owner pops the most
+      // recently pushed item.
+      for (size_t k = order.size(); k-- > 0; ) {
+        push(*deques[k % num_workers], order[k]);
+      }
+
+      pending = items.size();
+      steals = 0;
+      stopped = false;
+    }
+
+    /**
+     * Get an item for the given worker: from its own deque if possible,
+     * otherwise stolen from another worker. Sleeps while other workers may
+     * still put items back. Returns false once all items are done or the
+     * queue is stopped.
+     */
+    bool get_work(size_t worker, size_t* index) {
+      while (!stopped) {
+        // anything that happens after this makes the wait below return
+        uint64_t seen = events.load(std::memory_order_acquire);
+        if (try_get_work(worker, index)) return true;
+        if (pending.load(std::memory_order_acquire) == 0) return false;
+
+        // a steal lost to another thief may have left items behind
+        bool empty = true;
+        for (size_t k = 0; k < deques.size() && empty; ++k) {
+          const Deque& d = *deques[k];
+          empty = d.bottom.load(std::memory_order_acquire) <=
+                  d.top.load(std::memory_order_acquire);
+        }
+        if (!empty) continue;
+
+        std::unique_lock<std::mutex> lock(wait_mutex);
+        wakeup.wait(lock, [&] {
+          return events.load(std::memory_order_acquire) != seen || stopped;
+        });
+      }
+      return false;
+    }
+
+    /**
+     * Like get_work, but returns false right away if there is no item to
+     * get at the moment.
+     */
+    bool try_get_work(size_t worker, size_t* index) {
+      size_t num_workers = deques.size();
+      Deque& own = *deques[worker];
+      uint32_t i;
+      for (int attempt = 0; attempt < 2 && !stopped; ++attempt) {
+        if (pop(own, &i)) {
+          *index = i;
+          return true;
+        }
+        for (size_t k = 1; k < num_workers; ++k) {
+          if (steal(*deques[(worker + k) % num_workers], &i)) {
+            steals.fetch_add(1, std::memory_order_relaxed);
+            *index = i;
+            return true;
+          }
+        }
+        if (own.deferred.empty()) break;
+        // start the next pass over the items put back, in priority order
+        publish_deferred(own);
+      }
+      return false;
+    }
+
+    /**
+     * The item with the given index.
+     */
+    const T& get_item(size_t index) const {
+      return items[index];
+    }
+
+    /**
+     * Queue an item the worker got again, for another pass. It is handed
+     * out again once the worker has run out of other items.
+     */
+    void put_back(size_t worker, size_t index) {
+      deques[worker]->deferred.push_back(index);
+    }
+
+    /**
+     * Queue an item the worker got again, with a new priority.
+     */
+    void put_back(size_t worker, size_t index, double priority) {
+      priorities[index] = priority;
+      put_back(worker, index);
+    }
+
+    /**
+     * Let other workers get the items the worker put back, for a worker
+     * that stops getting work while the queue is still running.
+     */
+    void flush(size_t worker) {
+      publish_deferred(*deques[worker]);
+    }
+
+    /**
+     * Mark an item the worker got as finished.
+     */
+    void done() {
+      if (pending.fetch_sub(1, std::memory_order_acq_rel) == 1) wake_all();
+    }
+
+    /**
+     * Make get_work return false in all workers.
+     */
+    void stop() {
+      stopped = true;
+      wake_all();
+    }
+
+    /**
+     * Number of items not done yet.
+     */
+    size_t num_pending() const {
+      return pending.load(std::memory_order_acquire);
+    }
+
+    /**
+     * Number of items stolen since start.
+     */
+    size_t num_steals() const {
+      return steals.load(std::memory_order_relaxed);
+    }
+
+    /**
+     * Remove all items. Must not be called while workers are running.
+     */
     void clear() {
-      lock.lock();
-      storage.clear();
-      lock.unlock();
+      items.clear();
+      priorities.clear();
+      deques.clear();
+      pending = 0;
+      stopped = false;
     }
 };
 
-#endif  // WORK_QUEUE_H_
+/**
+ * Measure the overhead of the work stealing queue with 1 to 64 threads and
+ * 8x8 to 64x64 pixel tiles of a synthetic image, and print a table of the
+ * results to stdout.
+ */
+void benchmark_work_queue();
+
+#endif // CMU462_WORK_QUEUE_H